@@ -0,0 +1,89 @@
+#ifndef CHUNKSEARCH_HH
+#define CHUNKSEARCH_HH
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <utility>
+
+// Find all occurrences of a byte pattern in data that arrives in chunks (e.g.
+// the clusters of a file), also the ones that span two or more chunks. The
+// chunks are searched in place with the C library memmem(), only the
+// last pattern size - 1 bytes of the previous chunks are kept in a buffer.
+//
+// Usage: reset() before each file, then feed() its chunks in order.
+class ChunkSearch
+{
+public:
+	explicit ChunkSearch(std::string pattern_) : pattern(std::move(pattern_)) {}
+
+	[[nodiscard]] size_t size() const { return pattern.size(); }
+
+	void reset()
+	{
+		carry.clear();
+		offset = 0;
+		nextMatch = 0;
+	}
+
+	// Search the next chunk, 'found(pos)' is called for each occurrence with
+	// its position relative to the start of the first chunk (after reset())
+	template<typename Found>
+	void feed(const uint8_t* data, size_t len, Found&& found)
+	{
+		size_t n = pattern.size();
+		if (n == 0) return;
+		const char* chunk = reinterpret_cast<const char*>(data);
+
+		// occurrences starting in the previous chunks
+		size_t carryLen = carry.size();
+		if (carryLen) {
+			carry.append(chunk, std::min(len, n - 1));
+			for (size_t i = 0; i < carryLen && i + n <= carry.size(); ++i) {
+				if (memcmp(carry.data() + i, pattern.data(), n) == 0) {
+					report(offset - carryLen + i, found);
+				}
+			}
+			carry.resize(carryLen);
+		}
+
+		// occurrences within this chunk
+		const char* p = chunk;
+		const char* end = chunk + len;
+		while (size_t(end - p) >= n) {
+			const void* hit = memmem(p, end - p, pattern.data(), n);
+			if (!hit) break;
+			p = static_cast<const char*>(hit);
+			report(offset + (p - chunk), found);
+			++p;
+		}
+
+		// keep the tail that could be the start of an occurrence
+		if (len >= n - 1) {
+			carry.assign(end - (n - 1), n - 1);
+		} else {
+			carry.append(chunk, len);
+			if (carry.size() > n - 1) carry.erase(0, carry.size() - (n - 1));
+		}
+		offset += len;
+	}
+
+private:
+	template<typename Found>
+	void report(uint64_t pos, Found& found)
+	{
+		// a short chunk can leave an occurrence in 'carry' for the next one
+		if (pos < nextMatch) return;
+		nextMatch = pos + 1;
+		found(pos);
+	}
+
+	std::string pattern;
+	std::string carry;      // the last bytes of the previous chunks
+	uint64_t offset = 0;    // position of the next chunk
+	uint64_t nextMatch = 0; // occurrences before this were already reported
+};
+
+#endif
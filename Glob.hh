@@ -0,0 +1,101 @@
+#ifndef GLOB_HH
+#define GLOB_HH
+
+#include <cctype>
+#include <string_view>
+
+// Case insensitive wildcard matching for MSX (and host) paths. Supports
+//   '*'     any sequence of characters, but not crossing a '/'
+//   '**'    any sequence of characters, also crossing '/'
+//   '?'     any single character except '/'
+//   '[...]' one character from the set, '[!...]' or '[^...]' negates it
+namespace Glob {
+
+[[nodiscard]] inline bool hasWildcards(std::string_view pattern)
+{
+	return pattern.find_first_of("*?[") != std::string_view::npos;
+}
+
+[[nodiscard]] inline bool sameChar(char a, char b)
+{
+	return toupper(static_cast<unsigned char>(a)) == toupper(static_cast<unsigned char>(b));
+}
+
+// Try to match 'c' with the character class at the start of 'pattern' (just
+// after the '['). On success 'pattern' is advanced past the closing ']'.
+// Returns false if 'c' doesn't match, or if the class isn't terminated (then
+// 'pattern' is left unchanged and '[' should be taken literally).
+[[nodiscard]] inline bool matchClass(std::string_view& pattern, char c, bool& valid)
+{
+	size_t i = 0;
+	bool negate = false;
+	if (i < pattern.size() && (pattern[i] == '!' || pattern[i] == '^')) {
+		negate = true;
+		++i;
+	}
+	bool found = false;
+	bool first = true;
+	while (i < pattern.size() && (first || pattern[i] != ']')) {
+		first = false;
+		char lo = pattern[i];
+		char hi = lo;
+		if (i + 2 < pattern.size() && pattern[i + 1] == '-' && pattern[i + 2] != ']') {
+			hi = pattern[i + 2];
+			i += 2;
+		}
+		auto u = toupper(static_cast<unsigned char>(c));
+		auto l = tolower(static_cast<unsigned char>(c));
+		if ((lo <= u && u <= hi) || (lo <= l && l <= hi)) found = true;
+		++i;
+	}
+	valid = i < pattern.size();
+	if (!valid) return false;
+	pattern.remove_prefix(i + 1);
+	return found != negate;
+}
+
+[[nodiscard]] inline bool match(std::string_view pattern, std::string_view str)
+{
+	while (!pattern.empty()) {
+		char p = pattern.front();
+		if (p == '*') {
+			bool deep = pattern.starts_with("**");
+			while (!pattern.empty() && pattern.front() == '*') pattern.remove_prefix(1);
+			if (pattern.empty()) {
+				return deep || str.find('/') == std::string_view::npos;
+			}
+			for (size_t i = 0; i <= str.size(); ++i) {
+				if (match(pattern, str.substr(i))) return true;
+				if (i < str.size() && !deep && str[i] == '/') return false;
+			}
+			return false;
+		}
+		if (str.empty()) return false;
+		char c = str.front();
+		if (p == '?') {
+			if (c == '/') return false;
+			pattern.remove_prefix(1);
+		} else if (p == '[') {
+			std::string_view rest = pattern.substr(1);
+			bool valid;
+			bool ok = matchClass(rest, c, valid);
+			if (valid) {
+				if (!ok || c == '/') return false;
+				pattern = rest;
+			} else {
+				// no closing ']', match '[' literally
+				if (c != '[') return false;
+				pattern.remove_prefix(1);
+			}
+		} else {
+			if (!sameChar(p, c)) return false;
+			pattern.remove_prefix(1);
+		}
+		str.remove_prefix(1);
+	}
+	return str.empty();
+}
+
+} // namespace Glob
+
+#endif
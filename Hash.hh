@@ -0,0 +1,85 @@
+#ifndef HASH_HH
+#define HASH_HH
+
+#include "endian.hh"
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+
+// Minimal implementation of the XXH64 hash function (same results as the
+// reference implementation from https://github.com/Cyan4973/xxHash).
+namespace Hash {
+
+inline constexpr uint64_t PRIME1 = 0x9E3779B185EBCA87ULL;
+inline constexpr uint64_t PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+inline constexpr uint64_t PRIME3 = 0x165667B19E3779F9ULL;
+inline constexpr uint64_t PRIME4 = 0x85EBCA77C2B2AE63ULL;
+inline constexpr uint64_t PRIME5 = 0x27D4EB2F165667C5ULL;
+
+[[nodiscard]] inline uint64_t round(uint64_t acc, uint64_t input)
+{
+	acc += input * PRIME2;
+	acc = std::rotl(acc, 31);
+	return acc * PRIME1;
+}
+
+[[nodiscard]] inline uint64_t mergeRound(uint64_t acc, uint64_t val)
+{
+	acc ^= round(0, val);
+	return acc * PRIME1 + PRIME4;
+}
+
+[[nodiscard]] inline uint64_t xxh64(const void* data, size_t len, uint64_t seed = 0)
+{
+	const auto* p = static_cast<const uint8_t*>(data);
+	const uint8_t* end = p + len;
+	uint64_t h;
+
+	if (len >= 32) {
+		uint64_t v1 = seed + PRIME1 + PRIME2;
+		uint64_t v2 = seed + PRIME2;
+		uint64_t v3 = seed;
+		uint64_t v4 = seed - PRIME1;
+		do {
+			v1 = round(v1, Endian::read_UA_L64(p +  0));
+			v2 = round(v2, Endian::read_UA_L64(p +  8));
+			v3 = round(v3, Endian::read_UA_L64(p + 16));
+			v4 = round(v4, Endian::read_UA_L64(p + 24));
+			p += 32;
+		} while (p <= end - 32);
+		h = std::rotl(v1, 1) + std::rotl(v2, 7) + std::rotl(v3, 12) + std::rotl(v4, 18);
+		h = mergeRound(h, v1);
+		h = mergeRound(h, v2);
+		h = mergeRound(h, v3);
+		h = mergeRound(h, v4);
+	} else {
+		h = seed + PRIME5;
+	}
+	h += len;
+
+	while (end - p >= 8) {
+		h ^= round(0, Endian::read_UA_L64(p));
+		h = std::rotl(h, 27) * PRIME1 + PRIME4;
+		p += 8;
+	}
+	if (end - p >= 4) {
+		h ^= uint64_t(Endian::read_UA_L32(p)) * PRIME1;
+		h = std::rotl(h, 23) * PRIME2 + PRIME3;
+		p += 4;
+	}
+	while (p < end) {
+		h ^= *p++ * PRIME5;
+		h = std::rotl(h, 11) * PRIME1;
+	}
+
+	h ^= h >> 33;
+	h *= PRIME2;
+	h ^= h >> 29;
+	h *= PRIME3;
+	h ^= h >> 32;
+	return h;
+}
+
+} // namespace Hash
+
+#endif
@@ -0,0 +1,113 @@
+#ifndef IMAGEDATA_HH
+#define IMAGEDATA_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+// The bytes of a disk image: either owned (read into memory or created), or
+// a private mapping of the image file. A mapping is only read from disk where
+// it's used, so a command that touches a small part of a large image, or that
+// reads it in an order of its own choosing (see finishExtraction()), doesn't
+// load all of it first. Changes to a mapping stay in memory (MAP_PRIVATE),
+// resize() turns it into an owned copy.
+class ImageData
+{
+public:
+	ImageData() = default;
+	~ImageData() { unmap(); }
+	ImageData(ImageData&& other) noexcept { swap(other); }
+	ImageData& operator=(ImageData&& other) noexcept
+	{
+		clear();
+		swap(other);
+		return *this;
+	}
+	ImageData(const ImageData&) = delete;
+	ImageData& operator=(const ImageData&) = delete;
+
+	[[nodiscard]] uint8_t* data() { return mapped ? mapped : owned.data(); }
+	[[nodiscard]] const uint8_t* data() const { return mapped ? mapped : owned.data(); }
+	[[nodiscard]] size_t size() const { return mapped ? mappedSize : owned.size(); }
+	[[nodiscard]] bool empty() const { return size() == 0; }
+	[[nodiscard]] bool isMapped() const { return mapped != nullptr; }
+
+	void clear()
+	{
+		unmap();
+		owned.clear();
+	}
+	void resize(size_t n)
+	{
+		toOwned();
+		owned.resize(n);
+	}
+	void assign(size_t n, uint8_t value)
+	{
+		unmap();
+		owned.assign(n, value);
+	}
+
+	// Map the first 'size' bytes of file 'fd'. The mapping takes over 'fd'
+	// (and so a lock on it), it's closed when the mapping is dropped.
+	// Returns false (and leaves 'fd' open) if the file can't be mapped.
+	bool map(int fd, size_t size)
+	{
+		if (size == 0) return false;
+		void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		if (p == MAP_FAILED) return false;
+		clear();
+		owned.shrink_to_fit();
+		mapped = static_cast<uint8_t*>(p);
+		mappedSize = size;
+		mappedFd = fd;
+		return true;
+	}
+
+	// The mapping will be read front to back from now on
+	void adviseSequential()
+	{
+		if (mapped) madvise(mapped, mappedSize, MADV_SEQUENTIAL);
+	}
+
+	void swap(ImageData& other) noexcept
+	{
+		std::swap(owned, other.owned);
+		std::swap(mapped, other.mapped);
+		std::swap(mappedSize, other.mappedSize);
+		std::swap(mappedFd, other.mappedFd);
+	}
+
+private:
+	void toOwned()
+	{
+		if (!mapped) return;
+		std::vector<uint8_t> copy(mapped, mapped + mappedSize);
+		unmap();
+		owned = std::move(copy);
+	}
+	void unmap()
+	{
+		if (!mapped) return;
+		munmap(mapped, mappedSize);
+		close(mappedFd);
+		mapped = nullptr;
+		mappedSize = 0;
+		mappedFd = -1;
+	}
+
+	std::vector<uint8_t> owned;
+	uint8_t* mapped = nullptr;
+	size_t mappedSize = 0;
+	int mappedFd = -1;
+};
+
+inline void swap(ImageData& a, ImageData& b) noexcept
+{
+	a.swap(b);
+}
+
+#endif
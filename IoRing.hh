@@ -0,0 +1,212 @@
+#ifndef IORING_HH
+#define IORING_HH
+
+#include <cstdint>
+#include <sys/uio.h>
+
+#if __has_include(<linux/io_uring.h>)
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define HAVE_IO_URING 1
+#endif
+
+// Minimal io_uring wrapper (raw system calls, no liburing needed) to queue
+// many host file operations with a single system call. valid() is false if
+// io_uring can't be used (non-Linux host, old kernel, blocked by a seccomp
+// filter, ...), callers should then fall back to plain blocking calls.
+//
+// Usage: queue at most 'entries' operations with the prep*() methods, then
+// submitAndWait() until all have completed; each completion is passed
+// as (userData, result) with a negative errno value on failure.
+class IoRing
+{
+public:
+#ifdef HAVE_IO_URING
+	explicit IoRing(unsigned entries)
+	{
+		io_uring_params p;
+		memset(&p, 0, sizeof(p));
+		fd = int(syscall(__NR_io_uring_setup, entries, &p));
+		if (fd < 0) return;
+
+		sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+		cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+		if (p.features & IORING_FEAT_SINGLE_MMAP) {
+			sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+		}
+		sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE,
+		              MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+		cqRing = (p.features & IORING_FEAT_SINGLE_MMAP) ? sqRing
+		       : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE,
+		              MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+		void* sqesMap = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE,
+		                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+		if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqesMap == MAP_FAILED) {
+			if (sqesMap != MAP_FAILED) munmap(sqesMap, sqesSize);
+			unmapRings();
+			close(fd);
+			fd = -1;
+			return;
+		}
+		sqes = static_cast<io_uring_sqe*>(sqesMap);
+
+		auto* sq = static_cast<uint8_t*>(sqRing);
+		sqTail  = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+		sqMask  = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+		sqArray = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+		sqEntries = p.sq_entries;
+		auto* cq = static_cast<uint8_t*>(cqRing);
+		cqHead = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+		cqTail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+		cqMask = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+		cqes   = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+		for (unsigned i = 0; i < sqEntries; ++i) sqArray[i] = i;
+
+		if (!supportsOps()) shutdown();
+	}
+
+	~IoRing() { shutdown(); }
+
+	[[nodiscard]] bool valid() const { return fd >= 0; }
+	[[nodiscard]] unsigned capacity() const { return sqEntries; }
+
+	// Open 'path' relative to directory 'dirFd' (the result is the new fd)
+	void prepOpenAt(int dirFd, const char* path, int flags, unsigned mode, uint64_t userData)
+	{
+		io_uring_sqe* sqe = nextSqe(IORING_OP_OPENAT, dirFd, userData);
+		sqe->addr = reinterpret_cast<uintptr_t>(path);
+		sqe->len = mode;
+		sqe->open_flags = flags;
+	}
+	// Read/write the buffers in 'iov' at file offset 0, when 'link' is true the
+	// next operation only starts after this one fully succeeded
+	void prepReadv(int fileFd, const iovec* iov, unsigned count, uint64_t userData, bool link)
+	{
+		prepRw(IORING_OP_READV, fileFd, iov, count, userData, link);
+	}
+	void prepWritev(int fileFd, const iovec* iov, unsigned count, uint64_t userData, bool link)
+	{
+		prepRw(IORING_OP_WRITEV, fileFd, iov, count, userData, link);
+	}
+	void prepClose(int fileFd, uint64_t userData)
+	{
+		nextSqe(IORING_OP_CLOSE, fileFd, userData);
+	}
+
+	// Submit all queued operations and wait until they've all completed
+	template<typename Func>
+	void submitAndWait(Func&& onComplete)
+	{
+		unsigned pending = queued;
+		unsigned toSubmit = queued;
+		queued = 0;
+		std::atomic_ref(*sqTail).store(sqTailLocal, std::memory_order_release);
+		while (pending) {
+			int r = int(syscall(__NR_io_uring_enter, fd, toSubmit, 1,
+			                    IORING_ENTER_GETEVENTS, nullptr, 0));
+			if (r < 0) {
+				if (errno == EINTR) continue;
+				return; // shouldn't happen, the ring is unusable
+			}
+			toSubmit -= std::min<unsigned>(r, toSubmit);
+			unsigned head = *cqHead;
+			unsigned tail = std::atomic_ref(*cqTail).load(std::memory_order_acquire);
+			for (; head != tail; ++head, --pending) {
+				const io_uring_cqe& cqe = cqes[head & cqMask];
+				onComplete(cqe.user_data, cqe.res);
+			}
+			std::atomic_ref(*cqHead).store(head, std::memory_order_release);
+		}
+	}
+
+	IoRing(const IoRing&) = delete;
+	IoRing& operator=(const IoRing&) = delete;
+
+private:
+	io_uring_sqe* nextSqe(uint8_t opcode, int fileFd, uint64_t userData)
+	{
+		io_uring_sqe* sqe = &sqes[sqTailLocal++ & sqMask];
+		++queued;
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = opcode;
+		sqe->fd = fileFd;
+		sqe->user_data = userData;
+		return sqe;
+	}
+
+	void prepRw(uint8_t opcode, int fileFd, const iovec* iov, unsigned count, uint64_t userData, bool link)
+	{
+		io_uring_sqe* sqe = nextSqe(opcode, fileFd, userData);
+		sqe->addr = reinterpret_cast<uintptr_t>(iov);
+		sqe->len = count;
+		if (link) sqe->flags = IOSQE_IO_LINK;
+	}
+
+	[[nodiscard]] bool supportsOps()
+	{
+		constexpr unsigned NUM_OPS = 64;
+		alignas(io_uring_probe) uint8_t buf[sizeof(io_uring_probe) + NUM_OPS * sizeof(io_uring_probe_op)] = {};
+		auto* probe = reinterpret_cast<io_uring_probe*>(buf);
+		if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, NUM_OPS) < 0) {
+			return false;
+		}
+		for (unsigned op : {IORING_OP_OPENAT, IORING_OP_READV, IORING_OP_WRITEV, IORING_OP_CLOSE}) {
+			if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	void shutdown()
+	{
+		if (fd < 0) return;
+		munmap(sqes, sqesSize);
+		unmapRings();
+		close(fd);
+		fd = -1;
+	}
+
+	void unmapRings()
+	{
+		if (sqRing != MAP_FAILED) munmap(sqRing, sqRingSize);
+		if (cqRing != MAP_FAILED && cqRing != sqRing) munmap(cqRing, cqRingSize);
+	}
+
+	int fd = -1;
+	void* sqRing = MAP_FAILED;
+	void* cqRing = MAP_FAILED;
+	size_t sqRingSize = 0;
+	size_t cqRingSize = 0;
+	size_t sqesSize = 0;
+	io_uring_sqe* sqes = nullptr;
+	unsigned* sqTail = nullptr;
+	unsigned* sqArray = nullptr;
+	unsigned sqMask = 0;
+	unsigned sqEntries = 0;
+	unsigned sqTailLocal = 0;
+	unsigned queued = 0;
+	unsigned* cqHead = nullptr;
+	unsigned* cqTail = nullptr;
+	io_uring_cqe* cqes = nullptr;
+	unsigned cqMask = 0;
+#else
+	explicit IoRing(unsigned /*entries*/) {}
+	[[nodiscard]] bool valid() const { return false; }
+	[[nodiscard]] unsigned capacity() const { return 0; }
+	void prepOpenAt(int, const char*, int, unsigned, uint64_t) {}
+	void prepReadv(int, const iovec*, unsigned, uint64_t, bool) {}
+	void prepWritev(int, const iovec*, unsigned, uint64_t, bool) {}
+	void prepClose(int, uint64_t) {}
+	template<typename Func> void submitAndWait(Func&&) {}
+#endif
+};
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef MSXNAME_HH
+#define MSXNAME_HH
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+// A file name as stored in an MSX dir entry: 8 + 3 upper case characters,
+// padded with spaces. It's a trivially copyable value, so names can be
+// built, compared and used as map keys without any heap allocation.
+class MsxName
+{
+public:
+	static constexpr size_t SIZE = 8 + 3;
+
+	// The lower case "name.ext" form of an MSX name, as used in host paths
+	class Condensed
+	{
+	public:
+		[[nodiscard]] constexpr std::string_view view() const { return {buf.data(), len}; }
+		constexpr operator std::string_view() const { return view(); }
+
+	private:
+		friend class MsxName;
+		std::array<char, 8 + 1 + 3> buf = {};
+		size_t len = 0;
+	};
+
+	constexpr MsxName() { chars.fill(' '); }
+
+	/** The raw 11 characters of a dir entry (or of another 11 character buffer)
+	 */
+	[[nodiscard]] static MsxName fromRaw(const void* raw)
+	{
+		MsxName result;
+		memcpy(result.chars.data(), raw, SIZE);
+		return result;
+	}
+
+	/** Transform a (long) host name into the 8.3 upper case name as used in
+	 * the dir entries on an MSX. Only the last path component is used.
+	 */
+	[[nodiscard]] static constexpr MsxName fromHost(std::string_view fullFilename)
+	{
+		auto slash = fullFilename.find_last_of("/\\");
+		std::string_view fullFile = (slash == std::string_view::npos)
+		                          ? fullFilename : fullFilename.substr(slash + 1);
+
+		// handle special case '.' and '..' first
+		MsxName result;
+		if (fullFile == "." || fullFile == "..") {
+			for (size_t i = 0; i < fullFile.size(); ++i) result.chars[i] = '.';
+			return result;
+		}
+
+		std::string_view file = fullFile;
+		std::string_view ext;
+		if (auto dot = fullFile.rfind('.'); dot != std::string_view::npos) {
+			file = fullFile.substr(0, dot);
+			ext = fullFile.substr(dot + 1);
+		}
+		if (file.empty()) std::swap(file, ext);
+		while (!file.empty() && file.back() == ' ') file.remove_suffix(1);
+		while (!ext .empty() && ext .back() == ' ') ext .remove_suffix(1);
+
+		// put in major case and create '_' if needed
+		for (size_t i = 0; i < 8 && i < file.size(); ++i) result.chars[0 + i] = toMSXChr(file[i]);
+		for (size_t i = 0; i < 3 && i < ext .size(); ++i) result.chars[8 + i] = toMSXChr(ext [i]);
+		return result;
+	}
+
+	[[nodiscard]] constexpr Condensed condensed() const
+	{
+		Condensed result;
+		for (size_t i = 0; i < 8 && chars[i] != ' '; ++i) {
+			result.buf[result.len++] = toLower(chars[i]);
+		}
+		if (chars[8] != ' ' || chars[9] != ' ' || chars[10] != ' ') {
+			result.buf[result.len++] = '.';
+			for (size_t i = 8; i < SIZE && chars[i] != ' '; ++i) {
+				result.buf[result.len++] = toLower(chars[i]);
+			}
+		}
+		return result;
+	}
+
+	[[nodiscard]] constexpr std::string_view view() const { return {chars.data(), SIZE}; }
+	[[nodiscard]] constexpr const char* data() const { return chars.data(); }
+	[[nodiscard]] constexpr char& operator[](size_t i) { return chars[i]; }
+	[[nodiscard]] constexpr char operator[](size_t i) const { return chars[i]; }
+
+	[[nodiscard]] constexpr bool operator==(const MsxName&) const = default;
+
+	struct Hash {
+		[[nodiscard]] size_t operator()(const MsxName& name) const
+		{
+			uint64_t lo = 0;
+			uint32_t hi = 0;
+			memcpy(&lo, name.chars.data(), 8);
+			memcpy(&hi, name.chars.data() + 8, 3);
+			return size_t((lo ^ (uint64_t(hi) << 21)) * 0x9E3779B97F4A7C15ULL >> 16);
+		}
+	};
+
+private:
+	[[nodiscard]] static constexpr char toUpper(char c)
+	{
+		return (c >= 'a' && c <= 'z') ? char(c - 'a' + 'A') : c;
+	}
+	[[nodiscard]] static constexpr char toLower(char c)
+	{
+		return (c >= 'A' && c <= 'Z') ? char(c - 'A' + 'a') : c;
+	}
+	[[nodiscard]] static constexpr char toMSXChr(char c)
+	{
+		c = toUpper(c);
+		return (c == ' ' || c == '.') ? '_' : c;
+	}
+
+	std::array<char, SIZE> chars;
+};
+
+static_assert(sizeof(MsxName) == MsxName::SIZE);
+static_assert(MsxName::fromHost("command2.com").view() == "COMMAND2COM");
+static_assert(MsxName::fromHost("dir/a long name.text").condensed().view() == "a_long_n.tex");
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef OUTPUTBUFFER_HH
+#define OUTPUTBUFFER_HH
+
+#include <charconv>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string_view>
+#include <vector>
+
+// Large buffered writer for bulk output (machine readable listings, streams
+// written to stdout). Avoids the per-line overhead of iostreams and never
+// allocates after construction.
+class OutputBuffer
+{
+public:
+	explicit OutputBuffer(FILE* file_, size_t size = 256 * 1024)
+		: file(file_), buf(size) {}
+	~OutputBuffer() { flush(); }
+	OutputBuffer(const OutputBuffer&) = delete;
+	OutputBuffer& operator=(const OutputBuffer&) = delete;
+
+	void write(std::string_view s) { write(s.data(), s.size()); }
+	void write(const void* data, size_t size) {
+		if (size > buf.size() - used) {
+			flush();
+			if (size > buf.size()) {
+				fwrite(data, 1, size, file);
+				return;
+			}
+		}
+		memcpy(buf.data() + used, data, size);
+		used += size;
+	}
+	void write(char c) {
+		if (used == buf.size()) flush();
+		buf[used++] = c;
+	}
+
+	// decimal number, optionally zero padded to 'width' digits
+	void writeUInt(uint64_t x, int width = 0) {
+		char tmp[20];
+		auto* end = std::to_chars(tmp, tmp + sizeof(tmp), x).ptr;
+		for (int i = int(end - tmp); i < width; ++i) write('0');
+		write(tmp, end - tmp);
+	}
+
+	// hexadecimal number (lower case), zero padded to 'width' digits
+	void writeHex(uint64_t x, int width = 0) {
+		char tmp[16];
+		auto* end = std::to_chars(tmp, tmp + sizeof(tmp), x, 16).ptr;
+		for (int i = int(end - tmp); i < width; ++i) write('0');
+		write(tmp, end - tmp);
+	}
+
+	// write to another file from now on
+	void setFile(FILE* file_) {
+		flush();
+		file = file_;
+	}
+
+	void flush() {
+		if (used) {
+			fwrite(buf.data(), 1, used, file);
+			used = 0;
+		}
+		fflush(file);
+	}
+
+private:
+	FILE* file;
+	std::vector<char> buf;
+	size_t used = 0;
+};
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef PATHFILTER_HH
+#define PATHFILTER_HH
+
+#include "Glob.hh"
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Exclude/include rules (--exclude, --include, --exclude-from) for the
+// entries found while walking a host directory or a directory in an image.
+// As in GNU tar a pattern matches a path when it matches the whole path or a
+// tail of it that starts after a '/': 'CVS' and '*.o' match in every
+// directory, 'src/*.o' only in directories named src. A pattern ending in
+// '/' only matches directories. Matching is done with Glob (so it's case
+// insensitive, like MSX names).
+//
+// Excluded directories are skipped with everything below them. Include
+// patterns select files: when there are any, only the files that match one
+// of them (and aren't excluded) are used.
+//
+// Patterns are prepared once: only '**' matches a '/', so a pattern with N
+// components can only match the last N components of a path, that tail is
+// the only one that's tried.
+class PathFilter
+{
+public:
+	void exclude(std::string_view pattern) { add(excludes, pattern); }
+	void include(std::string_view pattern) { add(includes, pattern); }
+
+	[[nodiscard]] bool empty() const { return excludes.empty() && includes.empty(); }
+
+	// Should 'path' be skipped (for a directory: with all its contents)?
+	[[nodiscard]] bool skips(std::string_view path, bool isDir) const
+	{
+		if (excludes.empty() && includes.empty()) return false;
+		if (matchesAny(excludes, path, isDir)) return true;
+		return !isDir && !includes.empty() && !matchesAny(includes, path, isDir);
+	}
+
+	// Like skips(), but also when one of the parent directories of 'path' is
+	// excluded. For paths that aren't found by walking their parents (e.g.
+	// the entries of a tar stream).
+	[[nodiscard]] bool skipsWithParents(std::string_view path, bool isDir) const
+	{
+		if (excludes.empty() && includes.empty()) return false;
+		for (auto slash = path.find('/'); slash != std::string_view::npos;
+		     slash = path.find('/', slash + 1)) {
+			if (slash && matchesAny(excludes, path.substr(0, slash), true)) return true;
+		}
+		return skips(path, isDir);
+	}
+
+private:
+	struct Rule {
+		std::string pattern;
+		size_t components; // 0 if the pattern contains '**', any tail can match
+		bool dirOnly;
+	};
+
+	static void add(std::vector<Rule>& rules, std::string_view pattern)
+	{
+		bool dirOnly = pattern.ends_with('/');
+		while (pattern.ends_with('/')) pattern.remove_suffix(1);
+		while (pattern.starts_with("./")) pattern.remove_prefix(2);
+		if (pattern.empty()) return;
+		size_t components = (pattern.find("**") != std::string_view::npos) ? 0
+		                  : 1 + std::count(pattern.begin(), pattern.end(), '/');
+		rules.push_back({std::string(pattern), components, dirOnly});
+	}
+
+	// The last 'n' components of 'path', empty if it has fewer
+	[[nodiscard]] static std::string_view tail(std::string_view path, size_t n)
+	{
+		size_t pos = path.size();
+		while (n--) {
+			if (pos == 0) return {};
+			pos = path.rfind('/', pos - 1);
+			if (pos == std::string_view::npos) return n ? std::string_view{} : path;
+		}
+		return path.substr(pos + 1);
+	}
+
+	[[nodiscard]] static bool matchesAny(const std::vector<Rule>& rules, std::string_view path, bool isDir)
+	{
+		for (const auto& r : rules) {
+			if (r.dirOnly && !isDir) continue;
+			if (r.components) {
+				std::string_view t = tail(path, r.components);
+				if (!t.empty() && Glob::match(r.pattern, t)) return true;
+				continue;
+			}
+			for (std::string_view t = path; !t.empty();) {
+				if (Glob::match(r.pattern, t)) return true;
+				auto slash = t.find('/');
+				if (slash == std::string_view::npos) break;
+				t.remove_prefix(slash + 1);
+			}
+		}
+		return false;
+	}
+
+	std::vector<Rule> excludes;
+	std::vector<Rule> includes;
+};
+
+#endif
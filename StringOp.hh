@@ -1,9 +1,11 @@
 #ifndef STRINGOP_HH
 #define STRINGOP_HH
 
+#include <algorithm>
 #include <string>
 #include <string_view>
 #include <utility>
+#include <vector>
 
 // Minimal re-implementation of the corresponding functions in openMSX.
 namespace StringOp
@@ -84,6 +86,17 @@ namespace StringOp
 			return {str.substr(0, pos), str.substr(pos + 1)};
 		}
 	}
+
+	[[nodiscard]] inline std::vector<std::string_view> split(std::string_view str, char separator)
+	{
+		std::vector<std::string_view> result;
+		for (size_t pos = 0; pos <= str.size();) {
+			size_t end = std::min(str.find(separator, pos), str.size());
+			result.push_back(str.substr(pos, end - pos));
+			pos = end + 1;
+		}
+		return result;
+	}
 }
 
 #endif
@@ -29,9 +29,17 @@ static_assert(BIG || LITTLE, "mixed endian not supported");
 	        (x >> 24);
 }
 
+// Reverse bytes in a 64-bit number: 0x0123456789abcdef becomes 0xefcdab8967452301
+[[nodiscard]] static inline uint64_t byteswap64(uint64_t x)
+{
+	return (uint64_t(byteswap32(uint32_t(x >>  0))) << 32) |
+	       (uint64_t(byteswap32(uint32_t(x >> 32))) <<  0);
+}
+
 // Use overloading to get a (statically) polymorphic byteswap() function.
 [[nodiscard]] static inline uint16_t byteswap(uint16_t x) { return byteswap16(x); }
 [[nodiscard]] static inline uint32_t byteswap(uint32_t x) { return byteswap32(x); }
+[[nodiscard]] static inline uint64_t byteswap(uint64_t x) { return byteswap64(x); }
 
 
 
@@ -48,6 +56,10 @@ inline void write_UA_L32(void* p, uint32_t x)
 {
 	write_UA<BIG>(p, x);
 }
+inline void write_UA_L64(void* p, uint64_t x)
+{
+	write_UA<BIG>(p, x);
+}
 
 template<bool SWAP, std::integral T> [[nodiscard]] static inline T read_UA(const void* p)
 {
@@ -64,6 +76,10 @@ template<bool SWAP, std::integral T> [[nodiscard]] static inline T read_UA(const
 {
 	return read_UA<BIG, uint32_t>(p);
 }
+[[nodiscard]] inline uint64_t read_UA_L64(const void* p)
+{
+	return read_UA<BIG, uint64_t>(p);
+}
 
 
 class UA_L16 {
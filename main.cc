@@ -19,9 +19,20 @@
    59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
 */
 
+#include "ChunkSearch.hh"
+#include "Glob.hh"
+#include "Hash.hh"
+#include "ImageData.hh"
+#include "IoRing.hh"
+#include "MsxName.hh"
+#include "OutputBuffer.hh"
+#include "PathFilter.hh"
 #include "StringOp.hh"
 #include "endian.hh"
 #include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <csignal>
 #include <climits>
 #include <cstdint>
 #include <cstdio>
@@ -30,17 +41,31 @@
 #include <ctime>
 #include <deque>
 #include <dirent.h>
+#include <fstream>
+#include <fcntl.h>
 #include <getopt.h>
 #include <iomanip>
 #include <iostream>
+#if __has_include(<linux/fs.h>)
+#include <linux/fs.h> // FICLONE
+#endif
 #include <optional>
+#include <poll.h>
 #include <span>
 #include <sstream>
 #include <string>
 #include <string_view>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <utime.h>
 #include <vector>
 
@@ -75,6 +100,19 @@ struct MSXBootSector {
 	uint8_t bootProgram[512 - 30]; // actual boot program
 };
 
+// Offset in the boot sector of the 32-bit sector count, only valid when
+// 'nrSectors' is zero (partitions of more than 65535 sectors, always FAT16)
+static constexpr int BOOT_LARGE_SECTORS = 0x20;
+
+// The rest of the extended BPB that comes with the 32-bit sector count (see
+// setExtendedBootSector()), the boot program follows it
+static constexpr int BOOT_DRIVE_NUMBER = 0x24;
+static constexpr int BOOT_SIGNATURE    = 0x26;
+static constexpr int BOOT_VOLUME_ID    = 0x27;
+static constexpr int BOOT_VOLUME_LABEL = 0x2B;
+static constexpr int BOOT_FS_TYPE      = 0x36;
+static constexpr int BOOT_EXT_PROGRAM  = 0x3E;
+
 struct MSXDirEntry {
 	uint8_t filename[8];
 	uint8_t ext[3];
@@ -111,7 +149,9 @@ struct PC98Part {
 	uint8_t name[16];
 };
 
-static constexpr uint16_t EOF_FAT = 0x0FFF; // signals EOF in FAT12
+static constexpr uint16_t EOF_FAT = 0xFFFF; // signals EOF (readFAT() maps FAT12 0xFF8-0xFFF here)
+static constexpr int MAX_FAT12_CLUSTERS = 4084; // more data clusters means FAT16
+static constexpr int MAX_FAT16_CLUSTERS = 65524;
 static constexpr int SECTOR_SIZE = 512;
 static constexpr int NUM_OF_ENT = SECTOR_SIZE / 0x20; // number of entries per sector
 
@@ -129,12 +169,20 @@ struct PhysDirEntry {
 };
 
 // The (global) disk image
-std::vector<uint8_t> dskImage;
+ImageData dskImage;
 uint8_t* fsImage;
+// Per 4kB block of the image as read from disk, to write back only the
+// changed blocks (see writeImageToDisk()). Only filled when
+// 'trackImageChanges' is set.
+std::vector<uint64_t> imageBlockHashes;
+bool trackImageChanges = false;
+struct stat imageFileStat; // of the image file when it was read
 
 // These are set by readBootSector()
-int maxCluster;
+int maxCluster;    // highest valid cluster number
 int sectorsPerCluster = 2;
+int clusterShift = 1; // log2(sectorsPerCluster), -1 if it's not a power of 2
+bool fat16 = false; // FAT entries are 16 instead of 12 bits
 int rootDirStart; // first sector from the root directory
 int rootDirEnd;   // last sector from the root directory
 int msxChrootSector;
@@ -147,6 +195,15 @@ bool doSubdirs = true;
 bool touchOption = false;
 bool msxPartOption = false;
 bool showDebug = false;
+std::optional<time_t> fixedTime; // from SOURCE_DATE_EPOCH, for the entries of a new image
+PathFilter pathFilter; // --exclude/--include, for entries found in directories
+
+// Output format of the (verbose) file listing
+enum class ListFormat { TEXT, NDJSON, CSV, TSV };
+ListFormat listFormat = ListFormat::TEXT;
+OutputBuffer listOutput(stdout);
+int currentPartition = -1; // partition being listed, -1 for a plain disk image
+size_t listPathSkip = 0;   // length of the host directory prefix in listed paths
 
 // boot block created with regular nms8250 and '_format'
 static constexpr uint8_t dos1BootBlock[512] = {
@@ -220,11 +277,127 @@ static constexpr uint8_t dos2BootBlock[512] = {
 	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
 };
 
+// Offset of the boot program in dos2BootBlock (the jump at 0x1E skips the
+// "VOL_ID" block) and the offsets in it of the low bytes of the addresses
+// that point into the boot sector itself (it's loaded at 0xC000)
+static constexpr int DOS2_BOOT_PROGRAM = 0x30;
+static constexpr int dos2BootRelocs[] = {0x33, 0x36, 0x39, 0x41, 0x57, 0x5D, 0x67, 0x77};
+static_assert(std::ranges::all_of(dos2BootRelocs, [](int offset) {
+	return dos2BootBlock[offset] + (BOOT_EXT_PROGRAM - DOS2_BOOT_PROGRAM) <= 0xFF;
+}));
+
 uint16_t getLE16(const uint8_t* x)
 {
 	return (x[0] << 0) + (x[1] << 8);
 }
 
+/** Disk geometry used by setBootSector() for a range of image sizes, the
+ * profiles can also be selected by name with --size
+ */
+struct GeometryProfile {
+	const char* name;
+	int minSectors;     // smallest image size that uses this profile
+	int nbSectors;      // image size when selected by name
+	bool fixedSize;     // all images in the range get exactly 'nbSectors'
+	uint16_t nbSides;
+	uint8_t nbFats;
+	uint16_t nbSectorsPerFat;    // 0: depends on the image size (FAT16)
+	uint8_t nbSectorsPerCluster; // 0: depends on the image size (FAT16)
+	uint8_t nbHiddenSectors;
+	uint16_t nbDirEntry;
+	uint8_t descriptor;
+
+	/** First sector of the data area (cluster 2), only meaningful for
+	 * profiles with a fixed FAT size
+	 */
+	[[nodiscard]] constexpr int dataStart() const
+	{
+		return 1 + nbFats * nbSectorsPerFat + nbDirEntry / NUM_OF_ENT;
+	}
+};
+
+// Sorted on size, the HD profiles use the same layout as IDEFDISK v3.1. Some
+// values ('nbSides', FAT size of the small HD profiles) were simply copied
+// from an existing partition.
+static constexpr GeometryProfile geometryProfiles[] = {
+	// name       min     size   fixed sides fats fat spc hid  dir desc
+	{"single",        0,    720, true,   1,  2,   2,  2,  1, 112, 0xf8},
+	{"double",      721,   1440, true,   2,  2,   3,  2,  1, 112, 0xf9},
+	{"ide-1m",     1441,   2048, false,  2,  2,   3,  2,  1, 112, 0xf0},
+	{"ide-2m",     2880,   4096, false,  2,  2,   3,  1,  1, 224, 0xf0},
+	{"ide-4m",     4127,   8192, false,  2,  2,   3,  2,  1, 256, 0xf0},
+	{"ide-8m",     8213,  16384, false,  2,  2,   3,  4,  1, 256, 0xf0},
+	{"ide-16m",   16389,  32732, false,  2,  2,   3,  8,  1, 256, 0xf0},
+	{"ide",       32733,  65401, false, 32,  2,  12, 16, 16, 256, 0xf0},
+	{"fat16",   0x10000, 131072, false, 32,  2,   0,  0, 16, 512, 0xf0}, // Nextor
+};
+static_assert(std::ranges::is_sorted(geometryProfiles, {}, &GeometryProfile::minSectors));
+static_assert(std::ranges::all_of(geometryProfiles, [](const GeometryProfile& p) {
+	return std::has_single_bit(unsigned(p.nbSectorsPerCluster)) || p.nbSectorsPerCluster == 0;
+}));
+
+/** The profile used for images of 'nbSectors' sectors
+ */
+const GeometryProfile& geometryForSize(int nbSectors)
+{
+	auto it = std::ranges::upper_bound(geometryProfiles, nbSectors, {},
+	                                   &GeometryProfile::minSectors);
+	return *(it - 1);
+}
+
+/** The profile called 'name' (case insensitive), nullptr if there's none
+ */
+const GeometryProfile* findGeometry(std::string_view name)
+{
+	for (const auto& p : geometryProfiles) {
+		if (name.size() == strlen(p.name) &&
+		    strncasecmp(name.data(), p.name, name.size()) == 0) {
+			return &p;
+		}
+	}
+	return nullptr;
+}
+
+/** Print the table of geometry profiles (for --list-profiles)
+ */
+void listGeometries()
+{
+	std::cout << "name     size     sectors         cluster  root  FAT\n";
+	for (size_t i = 0; i < std::size(geometryProfiles); ++i) {
+		const auto& p = geometryProfiles[i];
+		std::string range = std::to_string(p.minSectors) + '-';
+		if (i + 1 < std::size(geometryProfiles)) {
+			range += std::to_string(geometryProfiles[i + 1].minSectors - 1);
+		}
+		if (p.fixedSize) range = std::to_string(p.nbSectors);
+		std::string cluster = p.nbSectorsPerCluster
+			? std::to_string(p.nbSectorsPerCluster * SECTOR_SIZE)
+			: "varies";
+		std::cout << std::left << std::setw(9) << p.name
+		          << std::setw(9) << (std::to_string(p.nbSectors / 2) + 'K')
+		          << std::setw(16) << range
+		          << std::setw(9) << cluster
+		          << std::setw(6) << p.nbDirEntry
+		          << (p.nbSectorsPerFat ? "FAT12" : "FAT16") << '\n';
+	}
+	std::cout << std::right;
+}
+
+/** Pointer to a sector of the current partition (fsImage), the offset is
+ * calculated in 64-bit so it can't overflow on large FAT16 partitions
+ */
+uint8_t* sectorData(int sector)
+{
+	return fsImage + size_t(sector) * SECTOR_SIZE;
+}
+
+/** The number of sectors from fsImage to the end of the image
+ */
+uint64_t availableSectors()
+{
+	return (dskImage.data() + dskImage.size() - fsImage) / SECTOR_SIZE;
+}
+
 /** Transforms a cluster number towards the first sector of this cluster
  * The calculation uses info read fom the boot sector
  */
@@ -233,12 +406,49 @@ int clusterToSector(int cluster)
 	return 1 + rootDirEnd + sectorsPerCluster * (cluster - 2);
 }
 
+/** The first sector of subdirectory 'dirEntry', 0 (an empty chain) if its
+ * start cluster is invalid, e.g. in a corrupt image
+ */
+int subdirSector(const MSXDirEntry* dirEntry)
+{
+	unsigned cluster = dirEntry->startCluster;
+	return (cluster >= 2 && cluster <= unsigned(maxCluster)) ? clusterToSector(cluster) : 0;
+}
+
 /** Transforms a sector number towards it containing cluster
  * The calculation uses info read fom the boot sector
  */
 uint16_t sectorToCluster(int sector)
 {
-	return 2 + ((sector - (1 + rootDirEnd)) / sectorsPerCluster);
+	int offset = sector - (1 + rootDirEnd);
+	return 2 + ((clusterShift >= 0) ? (offset >> clusterShift)
+	                                : (offset / sectorsPerCluster));
+}
+
+/** The highest usable cluster number of a file system with 'nbSectors'
+ * sectors, where cluster 2 starts at 'dataStart', and whether it uses
+ * FAT16 ('isFat16')
+ */
+int maxClusterFor(int nbSectors, int dataStart, int nbSectorsPerCluster, int sectorsPerFat, bool& isFat16)
+{
+	if (nbSectorsPerCluster <= 0) {
+		// corrupt boot sector, no usable clusters
+		isFat16 = false;
+		return 1;
+	}
+	int result = 2 + (nbSectors - dataStart) / nbSectorsPerCluster - 1;
+
+	// The FAT type follows from the number of data clusters. IDEFDISK
+	// creates 32MB FAT12 partitions that have slightly more than 4084
+	// clusters, so also check that the FAT is big enough to hold 16-bit
+	// entries before switching to FAT16.
+	int nbClusters = result - 1;
+	isFat16 = (nbClusters > MAX_FAT12_CLUSTERS) &&
+	          (sectorsPerFat * SECTOR_SIZE / 2 >= result + 1);
+	// never let the FAT chain point beyond what the FAT can hold
+	int fatEntries = isFat16 ? (sectorsPerFat * SECTOR_SIZE / 2)
+	                         : (sectorsPerFat * SECTOR_SIZE * 2 / 3);
+	return std::min(result, fatEntries - 1);
 }
 
 /** Initialize global variables by reading info from the boot sector
@@ -248,16 +458,29 @@ void readBootSector()
 	const auto* boot = reinterpret_cast<const MSXBootSector*>(fsImage);
 
 	int nbSectors = boot->nrSectors;
+	if (nbSectors == 0) {
+		nbSectors = Endian::read_UA_L32(fsImage + BOOT_LARGE_SECTORS);
+	}
 	int nbFats = boot->nrFats;
 	int sectorsPerFat = boot->sectorsFat;
 	int nbRootDirSectors = boot->dirEntries / NUM_OF_ENT;
 	sectorsPerCluster = boot->spCluster;
+	clusterShift = std::has_single_bit(unsigned(sectorsPerCluster))
+	             ? std::countr_zero(unsigned(sectorsPerCluster)) : -1;
 
 	rootDirStart = 1 + nbFats * sectorsPerFat;
 	msxChrootSector = rootDirStart;
 
 	rootDirEnd = rootDirStart + nbRootDirSectors - 1;
-	maxCluster = sectorToCluster(nbSectors);
+	maxCluster = maxClusterFor(nbSectors, rootDirEnd + 1, sectorsPerCluster, sectorsPerFat, fat16);
+	// a truncated image (e.g. a partial card dump) only holds the clusters
+	// that fit in it, chains must never point beyond its end
+	uint64_t available = availableSectors();
+	if (available < uint64_t(nbSectors) && sectorsPerCluster > 0) {
+		uint64_t fitting = (available > uint64_t(rootDirEnd + 1))
+		                 ? (available - (rootDirEnd + 1)) / sectorsPerCluster : 0;
+		maxCluster = int(std::min<uint64_t>(maxCluster, 1 + fitting));
+	}
 
 	PRT_DEBUG("---------- Boot sector info -----\n"
 	          "\n"
@@ -274,111 +497,140 @@ void readBootSector()
 	          "Calculated values\n"
 	          "\n"
 	          "maxCluster   " << maxCluster << "\n"
+	          "FAT type     " << (fat16 ? "FAT16" : "FAT12") << "\n"
 	          "RootDirStart " << rootDirStart << "\n"
 	          "RootDirEnd   " << rootDirEnd << "\n"
 	          "---------------------------------\n"
 	          "\n");
 }
 
+// The file system layout of a new image, see layoutForSize()
+struct FsLayout {
+	const GeometryProfile* profile;
+	int nbSectors;
+	uint16_t nbSectorsPerFat;
+	uint8_t nbSectorsPerCluster; // 0: too large for FAT16
+
+	[[nodiscard]] int dataStart() const
+	{
+		return 1 + profile->nbFats * nbSectorsPerFat + profile->nbDirEntry / NUM_OF_ENT;
+	}
+	/** The number of usable data clusters
+	 */
+	[[nodiscard]] int nbClusters() const
+	{
+		bool isFat16;
+		return maxClusterFor(nbSectors, dataStart(), nbSectorsPerCluster, nbSectorsPerFat, isFat16) - 1;
+	}
+};
+
+/** The layout of a new image of (about) 'nbSectors' sectors
+ */
+FsLayout layoutForSize(int nbSectors)
+{
+	const GeometryProfile& profile = geometryForSize(nbSectors);
+	if (profile.fixedSize) nbSectors = profile.nbSectors;
+	FsLayout result{&profile, nbSectors, profile.nbSectorsPerFat, profile.nbSectorsPerCluster};
+
+	if (result.nbSectorsPerCluster == 0) {
+		// FAT16 partition as used by Nextor, take the smallest cluster
+		// size that keeps the number of clusters within FAT16 limits
+		int spc = 4;
+		while (nbSectors / spc > MAX_FAT16_CLUSTERS) {
+			if (spc == 64) return result;
+			spc *= 2;
+		}
+		int nbClusters = nbSectors / spc; // upper bound
+		result.nbSectorsPerCluster = spc;
+		result.nbSectorsPerFat = ((nbClusters + 2) * 2 + SECTOR_SIZE - 1) / SECTOR_SIZE;
+	}
+	return result;
+}
+
+/** Turn the boot sector into one with an extended BPB, as Nextor uses for
+ * FAT16 partitions, for an image of 'nbSectors' (more than 65535) sectors.
+ * The extended BPB takes the place of the boot program of the MSX boot
+ * blocks, so the MSX-DOS 2 boot program is moved (and relocated) past it
+ * and the jump at the start of the sector points to it.
+ */
+void setExtendedBootSector(int nbSectors)
+{
+	memset(fsImage + 0x1E, 0, SECTOR_SIZE - 0x1E);
+	fsImage[0] = 0xEB;
+	fsImage[1] = BOOT_EXT_PROGRAM - 2;
+	fsImage[2] = 0x90;
+	Endian::write_UA_L32(fsImage + BOOT_LARGE_SECTORS, nbSectors);
+	fsImage[BOOT_DRIVE_NUMBER] = 0x80;
+	fsImage[BOOT_SIGNATURE] = 0x29;
+	memcpy(fsImage + BOOT_VOLUME_ID, dos2BootBlock + BOOT_VOLUME_ID, 4);
+	memcpy(fsImage + BOOT_VOLUME_LABEL, "NO NAME    ", 11);
+	memcpy(fsImage + BOOT_FS_TYPE, "FAT16   ", 8);
+
+	constexpr int shift = BOOT_EXT_PROGRAM - DOS2_BOOT_PROGRAM;
+	memcpy(fsImage + BOOT_EXT_PROGRAM, dos2BootBlock + DOS2_BOOT_PROGRAM,
+	       SECTOR_SIZE - 2 - BOOT_EXT_PROGRAM);
+	for (int offset : dos2BootRelocs) fsImage[offset + shift] += shift;
+	fsImage[SECTOR_SIZE - 2] = 0x55;
+	fsImage[SECTOR_SIZE - 1] = 0xAA;
+}
+
 /** Create a correct boot sector depending on the required size of the filesystem
  * Will implicitly call readBootSector for global var initialising
  */
-void setBootSector(uint16_t nbSectors)
+void setBootSector(int nbSectors)
 {
-	// variables set to single sided disk by default
-	uint16_t nbSides = 1;
-	uint8_t nbFats = 2;
-	uint8_t nbReservedSectors = 1; // Just copied from a 32MB IDE partition
-	uint8_t nbSectorsPerFat = 2;
-	uint8_t nbSectorsPerCluster = 2;
-	uint8_t nbHiddenSectors = 1;
-	uint16_t nbDirEntry = 112;
-	uint8_t descriptor = 0xf8;
-
-	// now set correct info according to size of image (in sectors!)
-	// and using the same layout as used by Jon in IDEFDISK v 3.1
-	if (nbSectors >= 32733) {
-		nbFats = 2;  // unknown yet
-		nbSectorsPerFat = 12; // copied from a partition from an IDE HD
-		nbSectorsPerCluster = 16;
-		nbDirEntry = 256;
-		nbSides = 32; // copied from a partition from an IDE HD
-		nbHiddenSectors = 16;
-		descriptor = 0xf0;
-	} else if (nbSectors >= 16389) {
-		nbSides = 2;         // unknown yet
-		nbFats = 2;          // unknown yet
-		nbSectorsPerFat = 3; // unknown yet
-		nbSectorsPerCluster = 8;
-		nbDirEntry = 256;
-		descriptor = 0xf0;
-	} else if (nbSectors >= 8213) {
-		nbSides = 2;         // unknown yet
-		nbFats = 2;          // unknown yet
-		nbSectorsPerFat = 3; // unknown yet
-		nbSectorsPerCluster = 4;
-		nbDirEntry = 256;
-		descriptor = 0xf0;
-	} else if (nbSectors >= 4127) {
-		nbSides = 2;         // unknown yet
-		nbFats = 2;          // unknown yet
-		nbSectorsPerFat = 3; // unknown yet
-		nbSectorsPerCluster = 2;
-		nbDirEntry = 256;
-		descriptor = 0xf0;
-	} else if (nbSectors >= 2880) {
-		nbSides = 2;         // unknown yet
-		nbFats = 2;          // unknown yet
-		nbSectorsPerFat = 3; // unknown yet
-		nbSectorsPerCluster = 1;
-		nbDirEntry = 224;
-		descriptor = 0xf0;
-	} else if (nbSectors >= 1441) {
-		nbSides = 2;         // unknown yet
-		nbFats = 2;          // unknown yet
-		nbSectorsPerFat = 3; // unknown yet
-		nbSectorsPerCluster = 2;
-		nbDirEntry = 112;
-		descriptor = 0xf0;
-	} else if (nbSectors <= 720) {
-		// normal single sided disk
-		nbSectors = 720;
-	} else {
-		// normal double sided disk
-		nbSectors = 1440;
-		nbSides = 2;
-		nbFats = 2;
-		nbSectorsPerFat = 3;
-		nbSectorsPerCluster = 2;
-		nbDirEntry = 112;
-		descriptor = 0xf9;
+	FsLayout layout = layoutForSize(nbSectors);
+	if (layout.nbSectorsPerCluster == 0) {
+		CRITICAL_ERROR("Image too large, FAT16 supports at most "
+		               << (64 * MAX_FAT16_CLUSTERS) << " sectors");
 	}
+	const GeometryProfile& profile = *layout.profile;
+	nbSectors = layout.nbSectors;
+	uint8_t nbReservedSectors = 1; // Just copied from a 32MB IDE partition
+	uint16_t nbSectorsPerFat = layout.nbSectorsPerFat;
+	uint8_t nbSectorsPerCluster = layout.nbSectorsPerCluster;
+
 	auto* boot = reinterpret_cast<MSXBootSector*>(fsImage);
 
-	boot->nrSectors = nbSectors;
-	boot->nrSides = nbSides;
+	if (nbSectors > 0xFFFF) {
+		boot->nrSectors = 0;
+		setExtendedBootSector(nbSectors);
+	} else {
+		boot->nrSectors = nbSectors;
+	}
+	boot->nrSides = profile.nbSides;
 	boot->spCluster = nbSectorsPerCluster;
-	boot->nrFats = nbFats;
+	boot->nrFats = profile.nbFats;
 	boot->sectorsFat = nbSectorsPerFat;
-	boot->dirEntries = nbDirEntry;
-	boot->descriptor = descriptor;
+	boot->dirEntries = profile.nbDirEntry;
+	boot->descriptor = profile.descriptor;
 	boot->resvSectors = nbReservedSectors;
-	boot->hiddenSectors = nbHiddenSectors;
+	boot->hiddenSectors = profile.nbHiddenSectors;
 
 	readBootSector();
 }
 
 // Get the next cluster number from the FAT chain
+// Any end-of-chain marker is returned as EOF_FAT
 uint16_t readFAT(uint16_t clNr)
 {
+	if (fat16) {
+		uint16_t val = Endian::read_UA_L16(fsImage + SECTOR_SIZE + 2 * clNr);
+		return (val >= 0xFFF8) ? EOF_FAT : val;
+	}
 	const uint8_t* p = fsImage + SECTOR_SIZE + (clNr * 3) / 2;
-	return (clNr & 1) ? (p[0] >> 4) + (p[1] << 4)
-	                  : p[0] + ((p[1] & 0x0F) << 8);
+	uint16_t val = (clNr & 1) ? (p[0] >> 4) + (p[1] << 4)
+	                          : p[0] + ((p[1] & 0x0F) << 8);
+	return (val >= 0x0FF8) ? EOF_FAT : val;
 }
 
 // Write an entry to the FAT
 void writeFAT(uint16_t clNr, uint16_t val)
 {
+	if (fat16) {
+		Endian::write_UA_L16(fsImage + SECTOR_SIZE + 2 * clNr, val);
+		return;
+	}
 	uint8_t* p = fsImage + SECTOR_SIZE + (clNr * 3) / 2;
 	if (clNr & 1) {
 		p[0] = (p[0] & 0x0F) + (val << 4);
@@ -415,7 +667,7 @@ void mkdir_ex(const char* name)
 uint8_t findUsableIndexInSector(int sector)
 {
 	// find a not used (0x00) or deleted entry (0xe5)
-	uint8_t* p = fsImage + SECTOR_SIZE * sector;
+	uint8_t* p = sectorData(sector);
 	uint8_t i = 0;
 	while (i < NUM_OF_ENT && p[0] != 0x00 && p[0] != 0xe5) {
 		++i;
@@ -438,7 +690,8 @@ int getNextSector(int sector)
 		return sector + 1;
 	} else {
 		unsigned nextCl = readFAT(currCluster);
-		if (nextCl == EOF_FAT) {
+		if (nextCl == EOF_FAT || nextCl < 2 || nextCl > unsigned(maxCluster)) {
+			// also stop on corrupt chains instead of reading outside the image
 			return 0;
 		} else {
 			return clusterToSector(nextCl);
@@ -446,6 +699,61 @@ int getNextSector(int sector)
 	}
 }
 
+/** Cluster/sector calculations with the geometry of a known profile as
+ * compile time constants, SPC == 0 is the generic version that uses the
+ * values read from the boot sector
+ */
+template<int SPC, int DATA_START>
+struct ClusterMath {
+	static constexpr bool generic = SPC == 0;
+
+	[[nodiscard]] static int clusterSize()
+	{
+		if constexpr (generic) return sectorsPerCluster * SECTOR_SIZE;
+		else return SPC * SECTOR_SIZE;
+	}
+	[[nodiscard]] static int toSector(unsigned cluster)
+	{
+		if constexpr (generic) return clusterToSector(cluster);
+		else return DATA_START + SPC * (int(cluster) - 2);
+	}
+	// getNextSector() with the geometry as constants
+	[[nodiscard]] static int nextSector(int sector)
+	{
+		if constexpr (generic) {
+			return getNextSector(sector);
+		} else {
+			if (sector < DATA_START) return (sector == rootDirEnd) ? 0 : sector + 1;
+			int offset = sector - DATA_START;
+			if ((offset + 1) % SPC) return sector + 1;
+			unsigned nextCl = readFAT(2 + offset / SPC);
+			if (nextCl == EOF_FAT || nextCl < 2 || nextCl > unsigned(maxCluster)) return 0;
+			return toSector(nextCl);
+		}
+	}
+};
+
+template<typename Func, size_t... Is>
+bool withProfileMath(Func& func, std::index_sequence<Is...>)
+{
+	return (... || (geometryProfiles[Is].nbSectorsPerCluster != 0 &&
+	                sectorsPerCluster == geometryProfiles[Is].nbSectorsPerCluster &&
+	                rootDirEnd + 1 == geometryProfiles[Is].dataStart() &&
+	                (func(ClusterMath<geometryProfiles[Is].nbSectorsPerCluster,
+	                                  geometryProfiles[Is].dataStart()>{}), true)));
+}
+
+/** Call 'func(math)' with the ClusterMath specialized for the geometry of
+ * the current image, or the generic one if it doesn't match a profile
+ */
+template<typename Func>
+void withClusterMath(Func&& func)
+{
+	if (!withProfileMath(func, std::make_index_sequence<std::size(geometryProfiles)>{})) {
+		func(ClusterMath<0, 0>{});
+	}
+}
+
 /** if there are no more free entries in a subdirectory, the subdir is
  * expanded with an extra cluster, This function gets the free cluster,
  * clears it and updates the fat for the subdir
@@ -455,7 +763,9 @@ int appendClusterToSubdir(int sector)
 {
 	uint16_t curCl = sectorToCluster(sector);
 	if (readFAT(curCl) != EOF_FAT) {
-		CRITICAL_ERROR("appendClusterToSubdir called with sector in a not EOF_FAT cluster");
+		// corrupt directory chain
+		std::cout << "appendClusterToSubdir called with sector in a not EOF_FAT cluster\n";
+		return 0;
 	}
 	uint16_t nextCl = findFirstFreeCluster();
 	if (nextCl > maxCluster) {
@@ -464,7 +774,7 @@ int appendClusterToSubdir(int sector)
 	}
 	int logicalSector = clusterToSector(nextCl);
 	// clear this cluster
-	memset(fsImage + SECTOR_SIZE * logicalSector, 0, SECTOR_SIZE * sectorsPerCluster);
+	memset(sectorData(logicalSector), 0, SECTOR_SIZE * sectorsPerCluster);
 	writeFAT(curCl, nextCl);
 	writeFAT(nextCl, EOF_FAT);
 	return logicalSector;
@@ -474,9 +784,9 @@ int appendClusterToSubdir(int sector)
  * returns: a pointer to a MSXDirEntry if name was found
  *          a nullptr if no match was found
  */
-MSXDirEntry* findEntryInDir(const std::string& name, int sector, uint8_t dirEntryIndex)
+MSXDirEntry* findEntryInDir(const MsxName& name, int sector, uint8_t dirEntryIndex)
 {
-	uint8_t* p = fsImage + SECTOR_SIZE * sector + 32 * dirEntryIndex;
+	uint8_t* p = sectorData(sector) + 32 * dirEntryIndex;
 	uint8_t i = 0;
 	do {
 		i = 0;
@@ -486,7 +796,7 @@ MSXDirEntry* findEntryInDir(const std::string& name, int sector, uint8_t dirEntr
 		}
 		if (i == NUM_OF_ENT) {
 			sector = getNextSector(sector);
-			p = fsImage + SECTOR_SIZE * sector;
+			p = sectorData(sector);
 		}
 	} while (i >= NUM_OF_ENT && sector);
 	return sector ? reinterpret_cast<MSXDirEntry*>(p) : nullptr;
@@ -495,7 +805,7 @@ MSXDirEntry* findEntryInDir(const std::string& name, int sector, uint8_t dirEntr
 /** This function returns the sector and dirIndex for a new directory entry
  * if needed the involved subdirectory is expanded by an extra cluster
  * returns: a PhysDirEntry containing sector and index
- *          if failed then the sector number is 0
+ *          if failed then the index is NUM_OF_ENT
  */
 PhysDirEntry addEntryToDir(int sector)
 {
@@ -505,7 +815,7 @@ PhysDirEntry addEntryToDir(int sector)
 	uint8_t newIndex = findUsableIndexInSector(sector);
 	if (sector <= rootDirEnd) {
 		// we are adding this to the root sector
-		while (newIndex >= NUM_OF_ENT && sector <= rootDirEnd) {
+		while (newIndex >= NUM_OF_ENT && sector < rootDirEnd) {
 			newIndex = findUsableIndexInSector(++sector);
 		}
 		newEntry.sector = sector;
@@ -522,7 +832,9 @@ PhysDirEntry addEntryToDir(int sector)
 					nextSector = appendClusterToSubdir(sector);
 					PRT_DEBUG("appendClusterToSubdir(" << sector << ") returns" << nextSector);
 					if (nextSector == 0) {
-						CRITICAL_ERROR("disk is full");
+						// not fatal: the daemon mode must survive this
+						std::cout << "disk is full\n";
+						return {sector, NUM_OF_ENT};
 					}
 				}
 				sector = nextSector;
@@ -536,68 +848,236 @@ PhysDirEntry addEntryToDir(int sector)
 	return newEntry;
 }
 
-// create an MSX filename 8.3 format, if needed in vfat like abbreviation
-static char toMSXChr(char a)
+/** The condensed form ("name.ext") of the name in 'dirEntry'
+ */
+MsxName::Condensed condenseName(const MSXDirEntry* dirEntry)
+{
+	return MsxName::fromRaw(dirEntry->filename).condensed();
+}
+
+/** Join a relative path and a name
+ */
+std::string joinPath(std::string_view dir, std::string_view name)
+{
+	std::string result(dir);
+	if (!result.empty()) result += '/';
+	result += name;
+	return result;
+}
+
+// The 8.3 names used in a directory, so new names can be checked for
+// collisions without rescanning the directory. Each name maps to the host
+// path (relative to the msx root dir) it was created from in this run, or to
+// "" for entries that were already on the image.
+struct DirNames {
+	std::unordered_map<MsxName, std::string, MsxName::Hash> owner;
+	std::unordered_map<MsxName, int, MsxName::Hash> nextTilde; // next ~N to try per 8.3 name
+	std::string hostPath; // of the directory itself, relative to the msx root dir
+	std::string msxPath;
+};
+std::unordered_map<int, DirNames> dirNames; // key is the first sector of the directory
+
+// Host path <-> condensed msx path (both relative to the msx root dir) for
+// entries whose msx name differs from their host name, see '--name-map'
+std::unordered_map<std::string, std::string> hostToMsxName;
+std::unordered_map<std::string, std::string> msxToHostName;
+
+/** Get the names used in the directory starting at 'sector', the directory
+ * is only scanned the first time
+ */
+DirNames& getDirNames(int sector)
 {
-	a = toupper(a);
-	if (a == ' ' || a == '.') {
-		a = '_';
+	auto [it, inserted] = dirNames.try_emplace(sector);
+	if (inserted) {
+		withClusterMath([&](auto math) {
+			int sectorsLeft = (maxCluster + 1) * sectorsPerCluster;
+			for (int s = sector; s != 0 && sectorsLeft--; s = math.nextSector(s)) {
+				const auto* p = reinterpret_cast<const char*>(sectorData(s));
+				for (int i = 0; i < NUM_OF_ENT; ++i, p += 32) {
+					if (p[0] != char(0x00) && p[0] != char(0xE5)) {
+						it->second.owner.try_emplace(MsxName::fromRaw(p));
+					}
+				}
+			}
+		});
 	}
-	return a;
+	return it->second;
+}
+
+/** Make the VFAT like name NAME~N.EXT from 8.3 name 'simple'
+ */
+MsxName makeTildeName(const MsxName& simple, int n)
+{
+	char suffix[12];
+	int len = snprintf(suffix, sizeof(suffix), "~%d", n);
+	std::string_view base(simple.data(), 8);
+	StringOp::trimRight(base, ' ');
+	size_t keep = std::min(base.size(), size_t(8 - len));
+	MsxName result = simple;
+	for (size_t i = keep; i < 8; ++i) result[i] = ' ';
+	memcpy(&result[keep], suffix, len);
+	return result;
 }
 
-/** Transform a long hostname in a 8.3 uppercase filename as used in the
- * dirEntries on an MSX
+/** Choose the name for an entry with 8.3 name 'simple', created from
+ * 'hostPath', in the directory starting at 'sector'. That's 'simple' (or the
+ * name from the name map) if it's still free or if the existing entry belongs
+ * to this host path (then 'exists' is set). If another host file already
+ * took it a unique NAME~N.EXT is made. The name is only registered as used
+ * when 'claim' is set.
  */
-std::string makeSimpleMSXFileName(std::string_view fullFilename)
+MsxName chooseMSXName(const MsxName& simple, const std::string& hostPath,
+                      int sector, bool& exists, bool claim = true)
 {
-	auto [dir, fullFile] = StringOp::splitOnLast(fullFilename, "/\\");
+	DirNames& names = getDirNames(sector);
+	MsxName result = simple;
+	if (auto m = hostToMsxName.find(hostPath); m != hostToMsxName.end()) {
+		result = MsxName::fromHost(m->second);
+	}
+	std::string msxPath = joinPath(names.msxPath, result.condensed());
+	auto it = names.owner.find(result);
+	if (it == names.owner.end()) {
+		exists = false;
+	} else if (it->second.empty()) {
+		// already on the image, it's ours unless the name map says otherwise
+		auto m = msxToHostName.find(msxPath);
+		exists = m == msxToHostName.end() || m->second == hostPath;
+	} else {
+		exists = it->second == hostPath;
+	}
+	if (!exists && it != names.owner.end()) {
+		int& n = names.nextTilde[simple];
+		do {
+			result = makeTildeName(simple, ++n);
+		} while (names.owner.contains(result));
+		msxPath = joinPath(names.msxPath, result.condensed());
+	}
+	if (claim) {
+		names.owner[result] = hostPath;
+		if (strcasecmp(msxPath.c_str(), hostPath.c_str()) != 0) {
+			hostToMsxName[hostPath] = msxPath;
+			msxToHostName[msxPath] = hostPath;
+		}
+	}
+	return result;
+}
 
-	// handle special case '.' and '..' first
-	std::string result(8 + 3, ' ');
-	if (fullFile == "." || fullFile == "..") {
-		memcpy(result.data(), fullFile.data(), fullFile.size());
-		return result;
+/** Choose the 8.3 name for host file or directory 'hostName' (only the last
+ * path component is used) in the directory starting at 'sector', see
+ * chooseMSXName()
+ */
+MsxName msxNameFor(std::string_view hostName, int sector, bool& exists, bool claim = true)
+{
+	hostName = StringOp::splitOnLast(hostName, "/\\").second;
+	std::string hostPath = joinPath(getDirNames(sector).hostPath, hostName);
+	return chooseMSXName(MsxName::fromHost(hostName), hostPath, sector, exists, claim);
+}
+
+/** Remember the host and msx path of subdir 'msxName' (made from 'hostName')
+ * starting at 'sector' in the directory starting at 'parent'
+ */
+void enterSubdir(int parent, int sector, std::string_view hostName, const MsxName& msxName)
+{
+	hostName = StringOp::splitOnLast(hostName, "/\\").second;
+	const DirNames& p = getDirNames(parent);
+	DirNames& d = getDirNames(sector);
+	d.hostPath = joinPath(p.hostPath, hostName);
+	d.msxPath = joinPath(p.msxPath, msxName.condensed());
+}
+
+/** Is host path 'path' (from a name map) inside the directory it's relative
+ * to, so that it's safe to extract to?
+ */
+bool isRelativeInside(std::string_view path)
+{
+	if (path.starts_with('/')) return false;
+	for (auto part : StringOp::split(path, '/')) {
+		if (part == "..") return false;
 	}
+	return true;
+}
 
-	auto [file, ext] = StringOp::splitOnLast(fullFile, '.');
-	if (file.empty()) std::swap(file, ext);
+/** Read the name map of an earlier run, a missing file is not an error
+ */
+void readNameMap(const std::string& fileName)
+{
+	std::ifstream in(fileName);
+	std::string line;
+	for (int lineNr = 1; std::getline(in, line); ++lineNr) {
+		auto [hostPath, msxPath] = StringOp::splitOnFirst(line, '\t');
+		if (hostPath.empty() || msxPath.empty()) continue;
+		if (!isRelativeInside(hostPath)) {
+			std::cout << fileName << ':' << lineNr << ": ignored, " << hostPath
+			          << " is outside the archive directory\n";
+			continue;
+		}
+		hostToMsxName[std::string(hostPath)] = msxPath;
+		msxToHostName[std::string(msxPath)] = hostPath;
+	}
+}
 
-	StringOp::trimRight(file, ' ');
-	StringOp::trimRight(ext , ' ');
+/** Write the name map: one 'host path<TAB>msx path' line per entry whose
+ * msx name differs from its host name
+ */
+void writeNameMap(const std::string& fileName)
+{
+	std::vector<std::pair<std::string_view, std::string_view>> lines(
+		hostToMsxName.begin(), hostToMsxName.end());
+	std::sort(lines.begin(), lines.end());
 
-	// put in major case and create '_' if needed
-	std::string fileS(file.data(), std::min<size_t>(8, file.size()));
-	std::string extS (ext .data(), std::min<size_t>(3, ext .size()));
-	transform(fileS.begin(), fileS.end(), fileS.begin(), toMSXChr);
-	transform(extS .begin(), extS .end(), extS .begin(), toMSXChr);
+	std::string tmpName = fileName + ".tmp";
+	FILE* file = fopen(tmpName.c_str(), "wb");
+	if (!file) {
+		std::cout << "Couldn't write name map " << fileName << '\n';
+		return;
+	}
+	{
+		OutputBuffer out(file);
+		for (auto [hostPath, msxPath] : lines) {
+			if (hostPath.find_first_of("\t\n") != std::string_view::npos) continue;
+			out.write(hostPath);
+			out.write('\t');
+			out.write(msxPath);
+			out.write('\n');
+		}
+	}
+	bool ok = ferror(file) == 0;
+	ok &= fclose(file) == 0;
+	if (!ok || rename(tmpName.c_str(), fileName.c_str()) != 0) {
+		std::cout << "Couldn't write name map " << fileName << '\n';
+		remove(tmpName.c_str());
+	}
+}
 
-	// add correct number of spaces
-	memcpy(result.data() + 0, fileS.data(), fileS.size());
-	memcpy(result.data() + 8, extS .data(), extS .size());
-	return result;
+/** The host path to extract the entry with (relative) msx path 'msxPath' to
+ */
+const std::string& hostPathFor(const std::string& msxPath)
+{
+	auto it = msxToHostName.find(msxPath);
+	return it == msxToHostName.end() ? msxPath : it->second;
 }
 
-/** This function creates a new MSX subdir with given date 'd' and time 't'
+/** This function creates a new MSX subdir 'msxName' (in 8.3 dir entry form)
+ * with given date 'd' and time 't'
  * in the subdir pointed at by 'sector' in the newly
  * created subdir the entries for '.' and '..' are created
  * returns: the first sector of the new subdir
  *          0 in case no directory could be created
  */
-int addMSXSubdir(const std::string& msxName, int t, int d, int sector)
+int addMSXSubdir(const MsxName& msxName, int t, int d, int sector)
 {
 	// returns the sector for the first cluster of this subdir
 	PhysDirEntry result = addEntryToDir(sector);
 	if (result.index >= NUM_OF_ENT) {
-		std::cout << "couldn't add entry" << msxName << '\n';
+		std::cout << "couldn't add entry" << msxName.view() << '\n';
 		return 0;
 	}
 	auto* dirEntry = reinterpret_cast<MSXDirEntry*>(
-		fsImage + SECTOR_SIZE * result.sector + 32 * result.index);
+		sectorData(result.sector) + 32 * result.index);
 	dirEntry->attrib = T_MSX_DIR;
 	dirEntry->time = t;
 	dirEntry->date = d;
-	memcpy(dirEntry, makeSimpleMSXFileName(msxName).c_str(), 11);
+	memcpy(dirEntry, msxName.data(), MsxName::SIZE);
 
 	// dirEntry->fileSize = fSize;
 	uint16_t curCl = 2;
@@ -607,9 +1087,9 @@ int addMSXSubdir(const std::string& msxName, int t, int d, int sector)
 	writeFAT(curCl, EOF_FAT);
 	int logicalSector = clusterToSector(curCl);
 	// clear this cluster
-	memset(fsImage + SECTOR_SIZE * logicalSector, 0, SECTOR_SIZE * sectorsPerCluster);
+	memset(sectorData(logicalSector), 0, SECTOR_SIZE * sectorsPerCluster);
 	// now add the '.' and '..' entries!!
-	dirEntry = reinterpret_cast<MSXDirEntry*>(fsImage + SECTOR_SIZE * logicalSector);
+	dirEntry = reinterpret_cast<MSXDirEntry*>(sectorData(logicalSector));
 	memset(dirEntry, 0, sizeof(MSXDirEntry));
 	memset(dirEntry, ' ', 11); // all spaces
 	memset(dirEntry, '.', 1);
@@ -640,32 +1120,244 @@ void makeFatTime(const struct tm mtim, int* dt)
 	dt[1] = mtim.tm_mday + ((mtim.tm_mon + 1) << 5) + ((mtim.tm_year + 1900 - 1980) << 9);
 }
 
-/** Add an MSXsubdir with the time properties from the HOST-OS subdir
+/** Compute the FAT time/date stamps for host time 'mtime', or for the fixed
+ * time from SOURCE_DATE_EPOCH (for reproducible images) when that's set
  */
-int addSubDirToDSK(const std::string& hostName, const std::string& msxName, int sector)
+void hostTimeToFat(time_t mtime, int* td)
 {
-	// compute time/date stamps
-	struct stat fst;
-	stat(hostName.c_str(), &fst);
-	struct tm mtim = *localtime(&(fst.st_mtime));
+	if (fixedTime) mtime = *fixedTime;
+	struct tm mtim = *localtime(&mtime);
+	makeFatTime(mtim, td);
+}
 
+/** Add an MSXsubdir with the modification time 'mtime' of the HOST-OS subdir
+ */
+int addSubDirToDSK(time_t mtime, const MsxName& msxName, int sector)
+{
 	int td[2];
-	makeFatTime(mtim, td);
+	hostTimeToFat(mtime, td);
 
 	return addMSXSubdir(msxName, td[0], td[1], sector);
 }
 
-/** This file alters the filecontent of a given file
+void makeTimeFromDE(struct tm* ptm, const int* td)
+{
+	ptm->tm_sec  = (td[0] & 0x1f) << 1;
+	ptm->tm_min  = (td[0] & 0x03e0) >> 5;
+	ptm->tm_hour = (td[0] & 0xf800) >> 11;
+	ptm->tm_mday = (td[1] & 0x1f);
+	ptm->tm_mon  = ((td[1] & 0x01e0) >> 5) - 1;
+	ptm->tm_year = ((td[1] & 0xfe00) >> 9) + 80;
+	ptm->tm_isdst = -1;
+}
+
+/** Convert the FAT time and date of a dir entry to a host timestamp
+ */
+time_t fatToHostTime(const MSXDirEntry* dirEntry)
+{
+	int td[2];
+	td[0] = dirEntry->time;
+	td[1] = dirEntry->date;
+	struct tm mTim;
+	makeTimeFromDE(&mTim, td);
+	return mktime(&mTim);
+}
+
+/** Set the entries from dirEntry to the timestamp of resultFile
+ */
+void changeTime(const std::string& resultFile, const MSXDirEntry* dirEntry)
+{
+	if (touchOption) return;
+
+	struct utimbuf uTim;
+	uTim.actime  = fatToHostTime(dirEntry);
+	uTim.modtime = uTim.actime;
+	utime(resultFile.c_str(), &uTim);
+}
+
+// A host file transfer queued for io_uring, see flushHostIo()
+struct HostFileJob {
+	std::string path;       // relative to 'dirFd'
+	std::string hostName;   // for messages
+	int dirFd;
+	MSXDirEntry* dirEntry;
+	std::vector<iovec> iov; // the file data in the image
+	size_t size;            // total size of 'iov'
+	bool write;             // extract to (true) or insert from (false) the host
+	int fd = -1;
+	int result = 0;
+};
+std::optional<IoRing> hostRing; // only engaged if io_uring can be used
+std::vector<HostFileJob> hostJobs;
+
+/** Add 'size' bytes at 'data' to 'iov', merged with the last buffer if
+ * they're adjacent in the image
+ */
+void appendIovec(std::vector<iovec>& iov, uint8_t* data, size_t size)
+{
+	if (!iov.empty() && static_cast<uint8_t*>(iov.back().iov_base) + iov.back().iov_len == data) {
+		iov.back().iov_len += size;
+	} else {
+		iov.push_back({data, size});
+	}
+}
+
+/** Release the FAT chain starting at 'cluster'
+ */
+void freeClusterChain(unsigned cluster)
+{
+	unsigned count = 0;
+	while (cluster >= 2 && cluster <= unsigned(maxCluster) && count++ < unsigned(maxCluster)) {
+		unsigned next = readFAT(cluster);
+		writeFAT(cluster, 0);
+		cluster = next;
+	}
+}
+
+/** Transfer the data of an opened job with blocking calls (for files that
+ * are too fragmented for a single readv/writev)
+ */
+int transferSync(const HostFileJob& job)
+{
+	size_t done = 0;
+	for (const auto& v : job.iov) {
+		ssize_t r = job.write ? pwrite(job.fd, v.iov_base, v.iov_len, done)
+		                      : pread (job.fd, v.iov_base, v.iov_len, done);
+		if (r < 0) return -errno;
+		done += r;
+		if (size_t(r) != v.iov_len) break;
+	}
+	return done;
+}
+
+/** Cut the file of an inserted job that turned out to be shorter than
+ * expected to 'size' bytes
+ */
+void truncateInsertedFile(MSXDirEntry* dirEntry, size_t size)
+{
+	dirEntry->size = size;
+	unsigned clusterSize = sectorsPerCluster * SECTOR_SIZE;
+	unsigned need = std::max<size_t>(1, (size + clusterSize - 1) / clusterSize);
+	unsigned cluster = dirEntry->startCluster;
+	for (unsigned i = 1; i < need; ++i) cluster = readFAT(cluster);
+	unsigned rest = readFAT(cluster);
+	writeFAT(cluster, EOF_FAT);
+	if (rest != EOF_FAT) freeClusterChain(rest);
+}
+
+/** Do all queued host file transfers: one submission opens all files, a
+ * second one transfers their data and closes them again
+ */
+void flushHostIo()
+{
+	if (hostJobs.empty()) return;
+
+	for (size_t i = 0; i < hostJobs.size(); ++i) {
+		const auto& job = hostJobs[i];
+		int flags = job.write ? (O_WRONLY | O_CREAT | O_TRUNC) : O_RDONLY;
+		hostRing->prepOpenAt(job.dirFd, job.path.c_str(), flags | O_CLOEXEC, 0666, i);
+	}
+	hostRing->submitAndWait([](uint64_t i, int res) { hostJobs[i].fd = res; });
+
+	for (size_t i = 0; i < hostJobs.size(); ++i) {
+		auto& job = hostJobs[i];
+		if (job.fd < 0) {
+			job.result = job.fd;
+		} else if (job.iov.size() > IOV_MAX) {
+			job.result = transferSync(job);
+			close(job.fd);
+		} else if (job.write) {
+			hostRing->prepWritev(job.fd, job.iov.data(), job.iov.size(), 2 * i, true);
+			hostRing->prepClose(job.fd, 2 * i + 1);
+		} else {
+			hostRing->prepReadv(job.fd, job.iov.data(), job.iov.size(), 2 * i, true);
+			hostRing->prepClose(job.fd, 2 * i + 1);
+		}
+	}
+	hostRing->submitAndWait([](uint64_t userData, int res) {
+		auto& job = hostJobs[userData / 2];
+		if ((userData & 1) == 0) {
+			job.result = res;
+		} else if (res == -ECANCELED) {
+			// short transfer broke the link
+			close(job.fd);
+		}
+	});
+
+	for (auto& job : hostJobs) {
+		if (job.write) {
+			if (job.fd < 0) {
+				CRITICAL_ERROR("Couldn't open file for writing!");
+			}
+			if (job.result != int(job.size)) {
+				std::cout << "Error while writing " << job.hostName << '\n';
+			}
+			// now change the access time
+			changeTime(job.hostName, job.dirEntry);
+		} else if (job.result != int(job.size)) {
+			if (job.result < 0) {
+				std::cout << job.hostName << ": " << strerror(-job.result) << '\n';
+			}
+			truncateInsertedFile(job.dirEntry, std::max(job.result, 0));
+		}
+	}
+	hostJobs.clear();
+}
+
+/** Queue a job, the queue is flushed when the ring is full
+ */
+void queueHostIo(HostFileJob&& job)
+{
+	hostJobs.push_back(std::move(job));
+	if (hostJobs.size() * 2 >= hostRing->capacity()) flushHostIo();
+}
+
+/** Queue reading host file 'name' (relative to 'dirFd') into newly
+ * allocated clusters for file entry 'msxDirEntry', its old clusters (if
+ * any) are freed first
+ */
+void queueFileInsert(int dirFd, const char* name, const std::string& hostName,
+                     MSXDirEntry* msxDirEntry, size_t fSize)
+{
+	if (msxDirEntry->startCluster) {
+		freeClusterChain(msxDirEntry->startCluster);
+		msxDirEntry->startCluster = 0;
+	}
+	HostFileJob job{name, hostName, dirFd, msxDirEntry, {}, 0, false};
+	size_t clusterSize = sectorsPerCluster * SECTOR_SIZE;
+	// same allocation order as alterFileInDSK()
+	unsigned prevCl = 0;
+	while (job.size < fSize) {
+		unsigned curCl = findFirstFreeCluster();
+		if (curCl > unsigned(maxCluster)) {
+			std::cout << "Fake disk image full: " << hostName << " truncated.\n";
+			break;
+		}
+		if (prevCl) {
+			writeFAT(prevCl, curCl);
+		} else {
+			msxDirEntry->startCluster = curCl;
+		}
+		writeFAT(curCl, EOF_FAT);
+		size_t chunk = std::min(fSize - job.size, clusterSize);
+		appendIovec(job.iov, sectorData(clusterToSector(curCl)), chunk);
+		job.size += chunk;
+		prevCl = curCl;
+	}
+	msxDirEntry->size = job.size;
+	if (job.size) queueHostIo(std::move(job));
+}
+
+/** This file alters the filecontent of a given file, the new content
+ * (fSize bytes) is read from 'file' directly into the allocated clusters
  * It only changes the file content (and the filesize in the msxDirEntry)
  * It doesn't changes timestamps nor filename, filetype etc.
- * Output: nothing useful yet
+ * returns: the number of bytes read from 'file', less than fSize when the
+ *          disk image is full
  */
-void alterFileInDSK(MSXDirEntry* msxDirEntry, const std::string& hostName)
+int alterFileInDSK(MSXDirEntry* msxDirEntry, FILE* file, int fSize, const std::string& hostName)
 {
 	bool needsNew = false;
-	struct stat fst;
-	stat(hostName.c_str(), &fst);
-	int fSize = fst.st_size;
 
 	PRT_DEBUG("AlterFileInDSK: filesize " << fSize);
 
@@ -681,12 +1373,10 @@ void alterFileInDSK(MSXDirEntry* msxDirEntry, const std::string& hostName)
 
 	int size = fSize;
 	int prevCl = 0;
-	// open file for reading
-	FILE* file = fopen(hostName.c_str(), "rb");
 
 	while (file && size && (curCl <= maxCluster)) {
 		int logicalSector = clusterToSector(curCl);
-		uint8_t* buf = fsImage + logicalSector * SECTOR_SIZE;
+		uint8_t* buf = sectorData(logicalSector);
 		for (int j = 0; (j < sectorsPerCluster) && size; ++j) {
 			PRT_DEBUG("AlterFileInDSK: relative sector " << j << " in cluster " << curCl);
 			size_t chunkSize = std::min(size, SECTOR_SIZE);
@@ -718,9 +1408,9 @@ void alterFileInDSK(MSXDirEntry* msxDirEntry, const std::string& hostName)
 		//} while((curCl <= maxCluster) && ReadFAT(curCl));
 		PRT_DEBUG("AlterFileInDSK: continuing at cluster " << curCl);
 	}
-	if (file) fclose(file);
 
-	if ((size == 0) && (curCl <= maxCluster)) {
+	// a file that exactly fills the disk ends without a next free cluster
+	if ((size == 0) && ((curCl <= maxCluster) || (prevCl && needsNew))) {
 		// TODO: check what an MSX does with filesize zero and fat allocation
 		if (prevCl == 0) {
 			prevCl = curCl;
@@ -746,120 +1436,511 @@ void alterFileInDSK(MSXDirEntry* msxDirEntry, const std::string& hostName)
 	}
 	// write (possibly truncated) file size
 	msxDirEntry->size = fSize - size;
+	return fSize - size;
 }
 
-/** Add file to the MSX disk in the subdir pointed to by 'sector'
- * returns: nothing useful yet :-)
+/** Replace the content of a given file with the content of host file
+ * 'hostName'
  */
-void addFileToDSK(const std::string& fullHostName, int sector, uint8_t dirEntryIndex)
+void alterFileInDSK(MSXDirEntry* msxDirEntry, const std::string& hostName)
+{
+	struct stat fst;
+	stat(hostName.c_str(), &fst);
+	// open file for reading
+	FILE* file = fopen(hostName.c_str(), "rb");
+	alterFileInDSK(msxDirEntry, file, fst.st_size, hostName);
+	if (file) fclose(file);
+}
+
+/** Create a new (still empty) file entry 'msxName' with modification time
+ * 'mtime' in the subdir pointed to by 'sector'
+ * returns: the new entry, or nullptr if it couldn't be added
+ */
+MSXDirEntry* addFileEntry(const MsxName& msxName, time_t mtime, int sector)
 {
-	auto [directory, hostName] = StringOp::splitOnLast(fullHostName, "/\\");
-	std::string msxName = makeSimpleMSXFileName(hostName);
-
-	// first find out if the filename already exists current dir
-	if (findEntryInDir(msxName, sector, dirEntryIndex)) {
-		PRT_VERBOSE("Preserving entry " << fullHostName);
-		return;
-	}
 	PhysDirEntry result = addEntryToDir(sector);
-	if (result.index >= NUM_OF_ENT) {
-		std::cout << "couldn't add entry" << fullHostName << '\n';
-		return;
-	}
+	if (result.index >= NUM_OF_ENT) return nullptr;
+
 	auto* dirEntry = reinterpret_cast<MSXDirEntry*>(
-		fsImage + SECTOR_SIZE * result.sector + 32 * result.index);
+		sectorData(result.sector) + 32 * result.index);
 	dirEntry->attrib = T_MSX_REG;
-
 	dirEntry->startCluster = 0;
-
-	PRT_VERBOSE(fullHostName << " \t-> \"" << msxName << '"');
-	memcpy(dirEntry, msxName.c_str(), 11);
+	memcpy(dirEntry, msxName.data(), MsxName::SIZE);
 
 	// compute time/date stamps
-	struct stat fst;
-	stat(fullHostName.c_str(), &fst);
-	struct tm mtim = *localtime(&(fst.st_mtime));
 	int td[2];
-
-	makeFatTime(mtim, td);
+	hostTimeToFat(mtime, td);
 	dirEntry->time = td[0];
 	dirEntry->date = td[1];
+	return dirEntry;
+}
+
+/** Add file 'name' (relative to the directory 'dirFd') with metadata 'fst'
+ * to the MSX disk in the subdir pointed to by 'sector', 'fullHostName' is
+ * only used in messages
+ * returns: nothing useful yet :-)
+ */
+void addFileToDSK(int dirFd, const char* name, const std::string& fullHostName,
+                  const struct stat& fst, int sector)
+{
+	// first find out if the filename already exists current dir, a name
+	// that's taken by another host file gets a unique NAME~N.EXT
+	bool exists;
+	MsxName msxName = msxNameFor(name, sector, exists);
+	if (exists) {
+		PRT_VERBOSE("Preserving entry " << fullHostName);
+		return;
+	}
+	auto* dirEntry = addFileEntry(msxName, fst.st_mtime, sector);
+	if (!dirEntry) {
+		std::cout << "couldn't add entry" << fullHostName << '\n';
+		return;
+	}
+	PRT_VERBOSE(fullHostName << " \t-> \"" << msxName.view() << '"');
 
-	alterFileInDSK(dirEntry, fullHostName);
+	if (hostRing && fst.st_size > 0 && S_ISREG(fst.st_mode)) {
+		queueFileInsert(dirFd, name, fullHostName, dirEntry, fst.st_size);
+		return;
+	}
+	int fd = openat(dirFd, name, O_RDONLY);
+	FILE* file = (fd >= 0) ? fdopen(fd, "rb") : nullptr;
+	alterFileInDSK(dirEntry, file, fst.st_size, fullHostName);
+	if (file) {
+		fclose(file);
+	} else if (fd >= 0) {
+		close(fd);
+	}
 }
 
-int checkStat(const std::string& name)
+void addFileToDSK(const std::string& fullHostName, int sector)
 {
 	struct stat fst;
-	stat(name.c_str(), &fst);
-
-	if (fst.st_mode & S_IFDIR) return 0; // it's a directory
+	if (stat(fullHostName.c_str(), &fst) != 0) {
+		std::cout << fullHostName << ": " << strerror(errno) << '\n';
+		return;
+	}
+	addFileToDSK(AT_FDCWD, fullHostName.c_str(), fullHostName, fst, sector);
+}
 
-	return 1; // if it's a file
+/** Find or add the MSX subdir for host directory 'name' in the subdir pointed
+ * to by 'sector', 'fullHostName' is only used in messages
+ * returns: the first sector of the subdir, 0 if it can't be used
+ */
+int addHostSubdir(const std::string& name, const std::string& fullHostName,
+                  time_t mtime, int sector, uint8_t dirEntryIndex)
+{
+	bool exists;
+	MsxName msxName = msxNameFor(name, sector, exists);
+	PRT_VERBOSE(fullHostName << " \t-> \"" << msxName.view() << '"');
+	int result = 0;
+	if (!exists) {
+		PRT_VERBOSE("Adding dir entry " << name);
+		result = addSubDirToDSK(mtime, msxName, sector); // used here to add file into fake dsk
+	} else if (auto* msxDirEntry = findEntryInDir(msxName, sector, dirEntryIndex)) {
+		if (msxDirEntry->attrib & T_MSX_DIR) {
+			PRT_VERBOSE("Dir entry " << name << " exists already");
+			result = subdirSector(msxDirEntry);
+			if (!result) std::cout << fullHostName << ": corrupt directory entry\n";
+		} else {
+			std::cout << fullHostName << ": a file with that name exists already\n";
+		}
+	}
+	if (result) enterSubdir(sector, result, name, msxName);
+	return result;
 }
 
-/** transfer directory and all its subdirectories to the MSX disk image
+/** transfer directory 'dirFd' and all its subdirectories to the MSX disk
+ * image, 'dirFd' is closed afterwards. All host access is relative to the
+ * directory fd and each entry is stat'ed only once, 'path' is the name of
+ * the directory (only used in messages, restored on return).
  */
-void recurseDirFill(const std::string& dirName, int sector, int dirEntryIndex)
+void recurseDirFill(int dirFd, std::string& path, int sector, int dirEntryIndex)
 {
-	PRT_DEBUG("Trying to read directory " << dirName);
+	PRT_DEBUG("Trying to read directory " << path);
 
-	DIR* dir = opendir(dirName.c_str());
+	DIR* dir = fdopendir(dirFd);
 	if (!dir) {
 		PRT_DEBUG("Not a FDC_DirAsDSK image");
-		// throw MSXException("Not a directory");
+		close(dirFd);
+		return;
 	}
+	size_t pathLen = path.size();
 	// read directory and fill the fake disk
-	struct dirent* d = readdir(dir);
-	while (d) {
-		std::string name(d->d_name);
+	while (struct dirent* d = readdir(dir)) {
+		const char* name = d->d_name;
 		PRT_DEBUG("reading name in dir: " << name);
-		std::string path = dirName + '/' + name;
-		if (checkStat(path)) { // true if a file
-			if (name.starts_with('.')) {
+		if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+		path += '/';
+		path += name;
+
+		// d_type (if known) avoids a stat for entries that are skipped anyway
+		if (d->d_type != DT_UNKNOWN && pathFilter.skips(path, d->d_type == DT_DIR)) {
+			PRT_DEBUG("Excluding " << path);
+		} else if (d->d_type == DT_REG && name[0] == '.') {
+			std::cout << name << ": ignored file which starts with a '.'\n";
+		} else if (d->d_type == DT_DIR && !doSubdirs) {
+			PRT_DEBUG("Skipping subdir: " << path);
+		} else if (struct stat fst; fstatat(dirfd(dir), name, &fst, 0) != 0) {
+			std::cout << path << ": " << strerror(errno) << '\n';
+		} else if (d->d_type == DT_UNKNOWN && pathFilter.skips(path, S_ISDIR(fst.st_mode))) {
+			PRT_DEBUG("Excluding " << path);
+		} else if (!S_ISDIR(fst.st_mode)) {
+			if (name[0] == '.') {
 				std::cout << name << ": ignored file which starts with a '.'\n";
 			} else {
-				addFileToDSK(path, sector, dirEntryIndex); // used here to add file into fake dsk
-			}
-		} else if (name != "." && name != "..") {
-			if (doSubdirs) {
-				std::string msxName = makeSimpleMSXFileName(name);
-				PRT_VERBOSE(path << " \t-> \"" << msxName << '"');
-				int result;
-				if (auto* msxDirEntry = findEntryInDir(msxName, sector, dirEntryIndex)) {
-					PRT_VERBOSE("Dir entry " << name << " exists already");
-					result = clusterToSector(msxDirEntry->startCluster);
-				} else {
-					PRT_VERBOSE("Adding dir entry " << name);
-					result = addSubDirToDSK(path, name, sector); // used here to add file into fake dsk
-				}
-				recurseDirFill(path, result, 0);
-			} else {
-				PRT_DEBUG("Skipping subdir: " << path);
+				addFileToDSK(dirfd(dir), name, path, fst, sector); // used here to add file into fake dsk
+			}
+		} else if (doSubdirs) {
+			int result = addHostSubdir(name, path, fst.st_mtime, sector, dirEntryIndex);
+			int subFd = (result > 0) ? openat(dirfd(dir), name, O_RDONLY | O_DIRECTORY) : -1;
+			if (subFd >= 0) {
+				recurseDirFill(subFd, path, result, 0);
 			}
+		} else {
+			PRT_DEBUG("Skipping subdir: " << path);
 		}
-		d = readdir(dir);
+		path.resize(pathLen);
 	}
+	// queued files are opened relative to this directory
+	flushHostIo();
 	closedir(dir);
 }
 
-/** Save the disk image from memory to disk
+void recurseDirFill(const std::string& dirName, int sector, int dirEntryIndex)
+{
+	int fd = open(dirName.c_str(), O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		PRT_DEBUG("Not a FDC_DirAsDSK image");
+		return;
+	}
+	std::string path = dirName;
+	recurseDirFill(fd, path, sector, dirEntryIndex);
+}
+
+/** Copy the first FAT over the other FAT copies, writeFAT() only
+ * updates the first one
+ */
+void syncFATCopies()
+{
+	const auto* boot = reinterpret_cast<const MSXBootSector*>(fsImage);
+	size_t fatSize = boot->sectorsFat * SECTOR_SIZE;
+	for (int i = 1; i < boot->nrFats; ++i) {
+		memcpy(fsImage + SECTOR_SIZE + i * fatSize, fsImage + SECTOR_SIZE, fatSize);
+	}
+}
+
+// Updates of an existing image are made crash safe with a journal: the
+// changed blocks are first written (and synced) to ARCHIVE.journal, only then
+// they're written in place. An interrupted update is completed by
+// replayJournal() the next time the image is read to be modified. Writing
+// and replaying a journal is done while holding an exclusive flock() on the
+// image, readers take a shared one. The journal layout:
+//   "MSXJRNL1", image size (8 bytes), number of extents (4 bytes)
+//   per extent: offset (8 bytes), length (4 bytes), data
+//   xxh64 of all of the above (8 bytes)
+// All numbers are little endian.
+static constexpr char JOURNAL_MAGIC[8] = {'M', 'S', 'X', 'J', 'R', 'N', 'L', '1'};
+static constexpr size_t JOURNAL_BLOCK = 4096;
+
+std::string journalName(const std::string& imageName)
+{
+	return imageName + ".journal";
+}
+
+/** Open the image and flock() it with 'operation' (LOCK_SH or LOCK_EX)
+ * returns: the fd that holds the lock (close it to unlock), -1 if the
+ *          image can't be opened
+ */
+int lockImage(const std::string& fileName, int operation)
+{
+	int fd = open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return -1;
+	while (flock(fd, operation) != 0 && errno == EINTR) {}
+	return fd;
+}
+
+/** Is the file described by 'a' still the same (and unmodified) in 'b'?
+ */
+bool sameFileState(const struct stat& a, const struct stat& b)
+{
+	return a.st_dev == b.st_dev && a.st_ino == b.st_ino && a.st_size == b.st_size &&
+	       a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec == b.st_mtim.tv_nsec &&
+	       a.st_ctim.tv_sec == b.st_ctim.tv_sec && a.st_ctim.tv_nsec == b.st_ctim.tv_nsec;
+}
+
+/** fsync() the directory containing 'path', so that a created, renamed or
+ * removed directory entry is durable
+ */
+void syncParentDir(const std::string& path)
+{
+	auto slash = path.rfind('/');
+	std::string dir = (slash == std::string::npos) ? "." : path.substr(0, slash + 1);
+	int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+	if (fd < 0) return;
+	fsync(fd);
+	close(fd);
+}
+
+/** Remember a hash per block of the just read image, so that
+ * writeImageToDisk() can find out which blocks were changed
+ */
+void hashImageBlocks()
+{
+	imageBlockHashes.clear();
+	for (size_t offset = 0; offset < dskImage.size(); offset += JOURNAL_BLOCK) {
+		size_t len = std::min(JOURNAL_BLOCK, dskImage.size() - offset);
+		imageBlockHashes.push_back(Hash::xxh64(dskImage.data() + offset, len));
+	}
+}
+
+struct JournalExtent {
+	uint64_t offset;
+	uint32_t length;
+};
+
+/** Write 'extents' of the image in place, the journal (if any) must already
+ * be synced
+ */
+bool applyExtents(const std::string& fileName, std::span<const JournalExtent> extents,
+                  std::span<const uint8_t* const> data)
+{
+	int fd = open(fileName.c_str(), O_WRONLY);
+	if (fd < 0) return false;
+	bool ok = true;
+	for (size_t i = 0; ok && i < extents.size(); ++i) {
+		ok = pwrite(fd, data[i], extents[i].length, extents[i].offset) ==
+		     ssize_t(extents[i].length);
+	}
+	ok = ok && fsync(fd) == 0;
+	close(fd);
+	return ok;
+}
+
+/** Complete an update that was interrupted after its journal was written,
+ * an incomplete journal means the image wasn't touched yet
+ * returns: false if the journal couldn't be applied (the image is then
+ *          in an unknown state)
  */
-void writeImageToDisk(const std::string& filename)
+bool replayJournal(const std::string& fileName)
 {
-	FILE* file = fopen(filename.c_str(), "wb");
+	std::string jName = journalName(fileName);
+	struct stat jst;
+	if (stat(jName.c_str(), &jst) != 0 || !S_ISREG(jst.st_mode)) return true;
+	// wait for an update that's still writing its journal
+	int lockFd = lockImage(fileName, LOCK_EX);
+	FILE* file = fopen(jName.c_str(), "rb");
 	if (!file) {
-		std::cout << "Couldn't open file for writing!\n";
-		return;
+		if (lockFd >= 0) close(lockFd);
+		return true;
+	}
+	std::vector<uint8_t> buf;
+	uint8_t tmp[64 * 1024];
+	while (size_t n = fread(tmp, 1, sizeof(tmp), file)) {
+		buf.insert(buf.end(), tmp, tmp + n);
 	}
-	fwrite(dskImage.data(), 1, dskImage.size(), file);
 	fclose(file);
+
+	std::vector<JournalExtent> extents;
+	std::vector<const uint8_t*> data;
+	bool valid = buf.size() >= 28 && memcmp(buf.data(), JOURNAL_MAGIC, 8) == 0 &&
+	             Endian::read_UA_L64(buf.data() + buf.size() - 8) ==
+	             Hash::xxh64(buf.data(), buf.size() - 8);
+	if (valid) {
+		size_t pos = 20;
+		uint32_t count = Endian::read_UA_L32(buf.data() + 16);
+		for (uint32_t i = 0; valid && i < count; ++i) {
+			valid = pos + 12 <= buf.size() - 8;
+			if (!valid) break;
+			JournalExtent e{Endian::read_UA_L64(buf.data() + pos),
+			                Endian::read_UA_L32(buf.data() + pos + 8)};
+			pos += 12;
+			valid = e.length <= buf.size() - 8 - pos;
+			extents.push_back(e);
+			data.push_back(buf.data() + pos);
+			pos += e.length;
+		}
+	}
+	struct stat st;
+	if (valid && (lockFd < 0 || fstat(lockFd, &st) != 0 ||
+	              uint64_t(st.st_size) != Endian::read_UA_L64(buf.data() + 8))) {
+		// not made for this image (e.g. the image was replaced), keep it
+		// for inspection, the next update overwrites it
+		std::cout << "Ignoring journal " << jName << ", it doesn't match the size of "
+		          << fileName << '\n';
+		if (lockFd >= 0) close(lockFd);
+		return true;
+	}
+	if (!valid) {
+		std::cout << "Discarding incomplete journal " << jName << ", "
+		          << fileName << " was not modified\n";
+	} else if (applyExtents(fileName, extents, data)) {
+		std::cout << "Completed interrupted update of " << fileName << '\n';
+	} else {
+		// the journal is kept for the next try
+		std::cout << "Couldn't replay journal " << jName << " on " << fileName << '\n';
+		if (lockFd >= 0) close(lockFd);
+		return false;
+	}
+	unlink(jName.c_str());
+	syncParentDir(fileName);
+	if (lockFd >= 0) close(lockFd);
+	return true;
 }
 
-void updateCreateDSK(const std::string& fileName)
+/** Find the blocks of the image that changed since it was read (merged
+ * into extents), 'data' gets the start of each extent in memory
+ */
+void changedExtents(std::vector<JournalExtent>& extents, std::vector<const uint8_t*>& data)
+{
+	for (size_t i = 0; i < imageBlockHashes.size(); ++i) {
+		uint64_t offset = i * JOURNAL_BLOCK;
+		auto len = uint32_t(std::min(JOURNAL_BLOCK, dskImage.size() - offset));
+		if (Hash::xxh64(dskImage.data() + offset, len) == imageBlockHashes[i]) continue;
+		if (!extents.empty() && extents.back().offset + extents.back().length == offset) {
+			extents.back().length += len;
+		} else {
+			extents.push_back({offset, len});
+			data.push_back(dskImage.data() + offset);
+		}
+	}
+}
+
+/** Write 'extents' of the image (with their 'data') to journal 'jName'
+ * returns: false if the journal couldn't be written (it's then removed)
+ */
+bool writeJournal(const std::string& jName, std::span<const JournalExtent> extents,
+                  std::span<const uint8_t* const> data)
+{
+	FILE* file = fopen(jName.c_str(), "wb");
+	if (!file) return false;
+	std::vector<uint8_t> header(20);
+	memcpy(header.data(), JOURNAL_MAGIC, 8);
+	Endian::write_UA_L64(header.data() + 8, dskImage.size());
+	Endian::write_UA_L32(header.data() + 16, uint32_t(extents.size()));
+	for (size_t i = 0; i < extents.size(); ++i) {
+		uint8_t ext[12];
+		Endian::write_UA_L64(ext, extents[i].offset);
+		Endian::write_UA_L32(ext + 8, extents[i].length);
+		header.insert(header.end(), ext, ext + 12);
+		header.insert(header.end(), data[i], data[i] + extents[i].length);
+	}
+	uint8_t trailer[8];
+	Endian::write_UA_L64(trailer, Hash::xxh64(header.data(), header.size()));
+	bool ok = fwrite(header.data(), 1, header.size(), file) == header.size() &&
+	          fwrite(trailer, 1, 8, file) == 8 &&
+	          fflush(file) == 0 && fsync(fileno(file)) == 0;
+	ok = (fclose(file) == 0) && ok;
+	if (!ok) unlink(jName.c_str());
+	return ok;
+}
+
+/** Write the changed blocks of the image, through the journal for a regular
+ * file. Devices, and images in a directory where the journal can't be
+ * created, are written directly (as before journals were used).
+ * returns: false if the image couldn't be written
+ */
+bool writeImageJournaled(const std::string& fileName)
+{
+	std::vector<JournalExtent> extents;
+	std::vector<const uint8_t*> data;
+	changedExtents(extents, data);
+	if (extents.empty()) return true;
+
+	int lockFd = lockImage(fileName, LOCK_EX);
+	if (lockFd < 0) return false;
+	std::string jName = journalName(fileName);
+	struct stat st;
+	if (fstat(lockFd, &st) != 0) {
+		close(lockFd);
+		return false;
+	}
+	if (S_ISREG(st.st_mode) && !sameFileState(imageFileStat, st)) {
+		// our blocks would be mixed with the other program's changes
+		std::cout << fileName << " was changed by another program since it was "
+		             "read, not writing it\n";
+		close(lockFd);
+		return false;
+	}
+	bool journaled = false;
+	if (S_ISREG(st.st_mode)) {
+		journaled = writeJournal(jName, extents, data);
+		if (journaled) {
+			syncParentDir(fileName);
+		} else {
+			std::cout << "Couldn't write the journal " << jName << ", writing "
+			          << fileName << " without it\n";
+		}
+	}
+
+	bool ok = applyExtents(fileName, extents, data);
+	if (!ok && journaled) {
+		// the journal is kept, it's replayed on the next run
+		CRITICAL_ERROR("Couldn't write " << fileName << ", the update will be "
+		               "completed from " << jName << " the next time it's used");
+	}
+	if (journaled) unlink(jName.c_str());
+	if (ok) fstat(lockFd, &imageFileStat); // a next write starts from here
+	close(lockFd);
+	return ok;
+}
+
+/** Write the disk image from memory to the file 'filename'
+ * A new image is written to a temporary file that then replaces the old one,
+ * changes to an existing image go through the journal
+ * returns: false if the image couldn't be written
+ */
+bool writeImageFile(const std::string& filename)
+{
+	if (!imageBlockHashes.empty() && imageBlockHashes.size() ==
+	    (dskImage.size() + JOURNAL_BLOCK - 1) / JOURNAL_BLOCK) {
+		if (writeImageJournaled(filename)) return true;
+		std::cout << "Couldn't write " << filename << '\n';
+		return false;
+	}
+	struct stat st;
+	bool exists = stat(filename.c_str(), &st) == 0;
+	if (exists && !S_ISREG(st.st_mode)) {
+		// a device, can't be replaced
+		FILE* file = fopen(filename.c_str(), "wb");
+		if (!file) {
+			std::cout << "Couldn't open file for writing!\n";
+			return false;
+		}
+		bool ok = fwrite(dskImage.data(), 1, dskImage.size(), file) == dskImage.size();
+		ok = (fclose(file) == 0) && ok;
+		if (!ok) std::cout << "Couldn't write " << filename << '\n';
+		return ok;
+	}
+	std::string tmpName = filename + ".tmp";
+	FILE* file = fopen(tmpName.c_str(), "wb");
+	if (!file) {
+		std::cout << "Couldn't open file for writing!\n";
+		return false;
+	}
+	if (exists) fchmod(fileno(file), st.st_mode & 07777);
+	bool ok = fwrite(dskImage.data(), 1, dskImage.size(), file) == dskImage.size() &&
+	          fflush(file) == 0 && fsync(fileno(file)) == 0;
+	ok = (fclose(file) == 0) && ok;
+	if (!ok || rename(tmpName.c_str(), filename.c_str()) != 0) {
+		unlink(tmpName.c_str());
+		std::cout << "Couldn't write " << filename << '\n';
+		return false;
+	}
+	syncParentDir(filename);
+	return true;
+}
+
+/** Save the disk image from memory to disk, after updating the FAT copies of
+ * the current partition
+ */
+bool writeImageToDisk(const std::string& filename)
 {
-	std::string msxName = makeSimpleMSXFileName(fileName);
+	syncFATCopies();
+	return writeImageFile(filename);
+}
 
+void updateCreateDSK(const std::string& fileName)
+{
 	PRT_DEBUG("trying to stat: " << fileName);
 	struct stat fst;
 	stat(fileName.c_str(), &fst);
@@ -870,23 +1951,17 @@ void updateCreateDSK(const std::string& fileName)
 			// put files in the directory to root
 			recurseDirFill(fileName, msxChrootSector, msxChrootStartIndex);
 		} else {
-			PRT_VERBOSE("./" << fileName << " \t-> \"" << msxName << '"');
-			int result;
-			if (auto* msxDirEntry = findEntryInDir(msxName, msxChrootSector, msxChrootStartIndex)) {
-				PRT_VERBOSE("Dir entry " << fileName << " exists already");
-				result = clusterToSector(msxDirEntry->startCluster);
-			} else {
-				PRT_VERBOSE("Adding dir entry " << fileName);
-				result = addSubDirToDSK(fileName, fileName, msxChrootSector);
-				// used here to add file into fake dsk
-			}
-			recurseDirFill(fileName, result, 0);
+			int result = addHostSubdir(fileName, "./" + fileName, fst.st_mtime,
+			                           msxChrootSector, msxChrootStartIndex);
+			if (result) recurseDirFill(fileName, result, 0);
 		}
 	} else {
 		// this should be a normal file
 		PRT_VERBOSE("Updating file " << fileName);
 		// addFileToDSK(fileName, MSXchrootSector, MSXchrootStartIndex); // used here to add file into fake dsk in root dir!!
 		// first find out if the filename already exists current dir
+		bool exists;
+		MsxName msxName = msxNameFor(fileName, msxChrootSector, exists);
 		MSXDirEntry* msxDirEntry = findEntryInDir(msxName, msxChrootSector, msxChrootStartIndex);
 		alterFileInDSK(msxDirEntry, fileName);
 	}
@@ -908,23 +1983,14 @@ void addCreateDSK(const std::string& fileName)
 			// put files in the directory to root
 			recurseDirFill(fileName, msxChrootSector, msxChrootStartIndex);
 		} else {
-			std::string msxName = makeSimpleMSXFileName(fileName);
-			PRT_VERBOSE("./" << fileName << " \t-> \"" << msxName << '"');
-			int result;
-			if (auto* msxDirEntry = findEntryInDir(msxName, msxChrootSector, msxChrootStartIndex)) {
-				PRT_VERBOSE("Dir entry " << fileName << " exists already ");
-				result = clusterToSector(msxDirEntry->startCluster);
-			} else {
-				PRT_VERBOSE("Adding dir entry " << fileName);
-				result = addSubDirToDSK(fileName, fileName, msxChrootSector);
-				// used here to add file into fake dsk
-			}
-			recurseDirFill(fileName, result, 0);
+			int result = addHostSubdir(fileName, "./" + fileName, fst.st_mtime,
+			                           msxChrootSector, msxChrootStartIndex);
+			if (result) recurseDirFill(fileName, result, 0);
 		}
 	} else {
 		// this should be a normal file
 		PRT_VERBOSE("Adding file " << fileName);
-		addFileToDSK(fileName, msxChrootSector, msxChrootStartIndex); // used here to add file into fake dsk in root dir!!
+		addFileToDSK(fileName, msxChrootSector); // used here to add file into fake dsk in root dir!!
 	}
 }
 
@@ -933,7 +1999,9 @@ void updateInDSK(std::string name, bool keep)
 	StringOp::trimRight(name, "/\\");
 
 	// first find the filename in the current 'root dir'
-	if (findEntryInDir(makeSimpleMSXFileName(name), rootDirStart, 0)) {
+	bool exists;
+	msxNameFor(name, msxChrootSector, exists, false);
+	if (exists) {
 		if (keep) {
 			PRT_VERBOSE("Preserving entry " << name);
 		} else {
@@ -946,354 +2014,3636 @@ void updateInDSK(std::string name, bool keep)
 	}
 }
 
-/** Create an empty disk image with correct boot sector,FAT etc.
+// A member of a tar stream, as read by readTarEntry()
+struct TarEntry {
+	std::string path;
+	uint64_t size = 0;
+	time_t mtime = 0;
+	char type = '0';
+};
+
+/** Parse a numeric tar header field, octal or (GNU) base-256
  */
-void createEmptyDSK(int nbSectors, bool dos2)
+uint64_t tarNumber(const char* field, size_t len)
 {
-	// First create structure for the fake disk
-	// Allocate dskImage in memory
-	dskImage.assign(nbSectors * SECTOR_SIZE, 0xE5);
-	fsImage = dskImage.data();
-
-	// Assign default boot disk to this instance
-	// give extra info on the boot sector
-	// and get global parameters from them (implicit readBootSector)
-	memcpy(fsImage, dos2 ? dos2BootBlock : dos1BootBlock, SECTOR_SIZE);
-	setBootSector(nbSectors);
-
-	// Assign default empty values to disk
-	memset(fsImage + SECTOR_SIZE, 0x00, rootDirEnd * SECTOR_SIZE);
-	// for some reason the first 3uint8_ts are used to indicate the end of a
-	// cluster, making the first available cluster nr 2 some sources say
-	// that this indicates the disk format and FAT[0]should 0xF7 for single
-	// sided disk, and 0xF9 for double sided disks
-	// TODO: check this :-)
-	// for now I simply repeat the media descriptor here
-	{
-		const auto* boot = reinterpret_cast<const MSXBootSector*>(fsImage);
-		fsImage[SECTOR_SIZE + 0] = boot->descriptor;
+	const auto* p = reinterpret_cast<const uint8_t*>(field);
+	uint64_t result = 0;
+	if (p[0] & 0x80) {
+		result = p[0] & 0x3F;
+		for (size_t i = 1; i < len; ++i) result = (result << 8) | p[i];
+		return result;
 	}
-	fsImage[SECTOR_SIZE + 1] = 0xFF;
-	fsImage[SECTOR_SIZE + 2] = 0xFF;
+	size_t i = 0;
+	while (i < len && (p[i] == ' ' || p[i] == '0')) ++i;
+	for (; i < len && p[i] >= '0' && p[i] <= '7'; ++i) {
+		result = (result << 3) | (p[i] - '0');
+	}
+	return result;
 }
 
-std::string condenseName(const MSXDirEntry* dirEntry)
+/** Read (and drop) 'size' bytes from 'file'
+ */
+void skipTarData(FILE* file, uint64_t size)
 {
-	char condensedName[8 + 1 + 3 + 1];
-	char* p = condensedName;
-	for (int i = 0; i < 8; ++i) {
-		if (dirEntry->filename[i] == ' ') {
-			i = 9;
-		} else {
-			*(p++) = tolower(dirEntry->filename[i]);
-		}
-	}
-	if (dirEntry->ext[0] != ' ' || dirEntry->ext[1] != ' ' || dirEntry->ext[2] != ' ') {
-		*(p++) = '.';
-		for (int i = 0; i < 3; ++i) {
-			*p = tolower(dirEntry->ext[i]);
-			if (*p == ' ') *p = char(0);
-			++p;
+	char buf[SECTOR_SIZE * 16];
+	while (size) {
+		size_t chunk = std::min<uint64_t>(size, sizeof(buf));
+		if (fread(buf, 1, chunk, file) != chunk) {
+			CRITICAL_ERROR("Unexpected end of tar stream");
 		}
+		size -= chunk;
 	}
-	*p = char(0);
-	return condensedName;
 }
 
-/**routine to make FSImage point to the correct part of dskImage
- * returns: true if successful, false if partition isn't valid
+/** Round up a tar member size to the 512 byte blocks it occupies
  */
-bool chPart(int chPartition)
+uint64_t tarBlocks(uint64_t size)
 {
-	if (memcmp(dskImage.data(), "T98HDDIMAGE.R0", 14) == 0) {
-		// 0x110 size of the header(long), cylinder(long),
-		// surface(uint16_t), sector(uint16_t), secsize(uint16_t)
-		PRT_DEBUG("T98header recognized");
-		int surf = getLE16(dskImage.data() + 0x110 + 8);
-		int sec = getLE16(dskImage.data() + 0x110 + 10);
-		int sSize = getLE16(dskImage.data() + 0x110 + 12);
+	return (size + 511) & ~uint64_t(511);
+}
 
-		const auto* p98 = reinterpret_cast<const PC98Part*>(
-			dskImage.data() + 0x400 + (chPartition * 16));
-		int sCyl = getLE16(p98->startCyl);
+/** Read the header of the next member in a tar stream. GNU long names and
+ * pax 'path' and 'mtime' records are merged into the returned entry, the
+ * member data itself is left in the stream.
+ * returns: false at the end of the archive
+ */
+bool readTarEntry(FILE* file, TarEntry& entry)
+{
+	std::optional<std::string> longPath;
+	std::optional<time_t> paxTime;
+	while (true) {
+		char h[512];
+		size_t n = fread(h, 1, sizeof(h), file);
+		if (n == 0) return false;
+		if (n != sizeof(h)) {
+			CRITICAL_ERROR("Unexpected end of tar stream");
+		}
+		if (std::all_of(h, h + sizeof(h), [](char c) { return c == 0; })) {
+			// end of archive marker, the second zero block is optional
+			return false;
+		}
+		unsigned sum = 0;
+		for (int i = 0; i < 512; ++i) {
+			sum += (i >= 148 && i < 156) ? ' ' : static_cast<uint8_t>(h[i]);
+		}
+		if (sum != tarNumber(h + 148, 8)) {
+			CRITICAL_ERROR("Not a tar stream or corrupt tar header");
+		}
 
-		fsImage = dskImage.data() + 0x200 + (sSize * sCyl * surf * sec);
-		readBootSector();
-		return true;
-	}
+		entry.type = h[156];
+		entry.size = tarNumber(h + 124, 12);
+		entry.mtime = tarNumber(h + 136, 12);
 
-	if (memcmp(dskImage.data(), "\353\376\220MSX_IDE ", 11) != 0) {
-		std::cout << "Not an idefdisk compatible 0 sector\n";
-		return false;
-	}
-	const auto* p = reinterpret_cast<const Partition*>(dskImage.data() + 14 + (30 - chPartition) * 16);
-	if (p->start4 == 0) {
-		return false;
-	}
-	fsImage = dskImage.data() + SECTOR_SIZE * p->start4;
-	readBootSector();
-	return true;
-}
+		if (entry.type == 'L' || entry.type == 'x') {
+			std::string data(entry.size, '\0');
+			if (fread(data.data(), 1, data.size(), file) != data.size()) {
+				CRITICAL_ERROR("Unexpected end of tar stream");
+			}
+			skipTarData(file, tarBlocks(entry.size) - entry.size);
+			if (entry.type == 'L') {
+				longPath = data.c_str();
+				continue;
+			}
+			// pax records: "<length> <key>=<value>\n"
+			std::string_view records = data;
+			while (!records.empty()) {
+				size_t len = strtoul(std::string(records.substr(0, 20)).c_str(), nullptr, 10);
+				if (len == 0 || len > records.size()) break;
+				std::string_view record = records.substr(0, len - 1);
+				records.remove_prefix(len);
+				record = StringOp::splitOnFirst(record, ' ').second;
+				auto [key, value] = StringOp::splitOnFirst(record, '=');
+				if (key == "path") {
+					longPath = std::string(value);
+				} else if (key == "mtime") {
+					paxTime = strtoll(std::string(value).c_str(), nullptr, 10);
+				}
+			}
+			continue;
+		}
+		if (entry.type == 'g') {
+			// global pax header, nothing of interest
+			skipTarData(file, tarBlocks(entry.size));
+			continue;
+		}
 
-/** Routine to get the first sector of a given dir name
- * input: correctly MSXformatted subdirectory name
- * returns: 0 if given directory not found
- */
-int findStartSectorOfDir(std::string_view dirName)
-{
-	std::string_view work = dirName;
-	std::string totalPath = ".";
-	int msxDirSector = msxChrootSector;
-	int msxDirStartIndex = msxChrootStartIndex;
-
-	while (!work.empty()) {
-		StringOp::trimLeft(work, "/\\");
-		auto [directory, rest] = StringOp::splitOnFirst(work, "/\\");
-		work = rest;
-		// find directory
-		std::string simple = makeSimpleMSXFileName(directory);
-		if (auto* msxDirEntry = findEntryInDir(simple, msxDirSector, msxDirStartIndex)) {
-			msxDirSector = clusterToSector(msxDirEntry->startCluster);
-			msxDirStartIndex = 2;
-			totalPath += '/';
-			totalPath += directory;
-			mkdir_ex(totalPath.c_str());
+		if (longPath) {
+			entry.path = *longPath;
 		} else {
-			PRT_VERBOSE("Couldn't find directory: " << dirName);
-			return 0;
+			std::string_view name(h, strnlen(h, 100));
+			std::string_view prefix(h + 345, strnlen(h + 345, 155));
+			if (memcmp(h + 257, "ustar", 5) == 0 && !prefix.empty()) {
+				entry.path = std::string(prefix) + '/' + std::string(name);
+			} else {
+				entry.path = name;
+			}
 		}
+		if (paxTime) entry.mtime = *paxTime;
+		if (entry.type == '1' || entry.type == '2') {
+			// (hard/sym)links have no data in the stream
+			entry.size = 0;
+		}
+		return true;
 	}
-	return msxDirSector;
 }
 
-// routine to update the global vars: MSXchrootSector, MSXchrootStartIndex
-void chroot(std::string_view newRootDir)
+/** Find (or create with time 't' and date 'd') the MSX subdir for the
+ * '/' separated path 'dirPath' relative to the current msx root dir, found
+ * subdirs are cached in 'dirSectors'
+ * returns: the first sector of the subdir, or -1 if it can't be used
+ */
+int addSubdirPath(std::string_view dirPath, int t, int d,
+                  std::unordered_map<std::string, int>& dirSectors)
 {
-	if (newRootDir.starts_with('/') || newRootDir.starts_with('\\')) {
-		// absolute path, reset msxChrootSector
-		msxChrootSector = rootDirStart;
-		StringOp::trimLeft(newRootDir, "/\\");
+	if (dirPath.empty()) return msxChrootSector;
+	if (auto it = dirSectors.find(std::string(dirPath)); it != dirSectors.end()) {
+		return it->second;
 	}
 
-	while (!newRootDir.empty()) {
-		auto [firstPart, lastPart] = StringOp::splitOnFirst(newRootDir, "/\\");
-		newRootDir = lastPart;
-		StringOp::trimLeft(newRootDir, "/\\");
-
-		// find firstPart directory or create it
-		std::string simple = makeSimpleMSXFileName(firstPart);
-		if (auto* msxDirEntry = findEntryInDir(simple, msxChrootSector, msxChrootStartIndex)) {
-			msxChrootSector = clusterToSector(msxDirEntry->startCluster);
-			msxChrootStartIndex = 2;
-		} else {
-			// creat new subdir
-			time_t now;
-			time(&now);
-			struct tm mtim = *localtime(&now);
-			int td[2];
-			makeFatTime(mtim, td);
+	auto [parentPath, name] = StringOp::splitOnLast(dirPath, '/');
+	int parent = addSubdirPath(parentPath, t, d, dirSectors);
+	if (parent < 0) return -1;
 
-			std::cout << "Create subdir\n";
-			msxChrootSector = addMSXSubdir(simple, td[0], td[1], msxChrootSector);
-			msxChrootStartIndex = 2;
-			if (msxChrootSector == 0) {
-				exit(0);
+	int result;
+	if (!doSubdirs) {
+		// like for host directories: its files go to the root
+		result = parentPath.empty() ? parent : -1;
+		if (result < 0) PRT_DEBUG("Skipping subdir: " << dirPath);
+	} else {
+		bool exists;
+		MsxName msxName = msxNameFor(name, parent, exists);
+		uint8_t index = (parent == msxChrootSector) ? msxChrootStartIndex : 0;
+		result = -1;
+		if (!exists) {
+			PRT_VERBOSE(dirPath << " \t-> \"" << msxName.view() << '"');
+			result = addMSXSubdir(msxName, t, d, parent);
+			if (result == 0) result = -1;
+		} else if (auto* msxDirEntry = findEntryInDir(msxName, parent, index)) {
+			if (msxDirEntry->attrib & T_MSX_DIR) {
+				PRT_VERBOSE("Dir entry " << dirPath << " exists already");
+				result = subdirSector(msxDirEntry);
+				if (!result) {
+					std::cout << dirPath << ": corrupt directory entry\n";
+					result = -1;
+				}
+			} else {
+				std::cout << dirPath << ": a file with that name exists already\n";
 			}
 		}
+		if (result >= 0) enterSubdir(parent, result, name, msxName);
+	}
+	dirSectors.emplace(dirPath, result);
+	return result;
+}
+
+/** Add (or with !keep also update) all files and directories from a tar
+ * stream, the file data is read straight into the allocated clusters
+ */
+void addTarStream(FILE* file, bool keep)
+{
+	std::unordered_map<std::string, int> dirSectors;
+	TarEntry entry;
+	while (readTarEntry(file, entry)) {
+		uint64_t dataSize = tarBlocks(entry.size);
+		int td[2];
+		hostTimeToFat(entry.mtime, td);
+
+		std::string_view path = entry.path;
+		while (path.starts_with("./") || path.starts_with('/')) {
+			path.remove_prefix(path.starts_with('/') ? 1 : 2);
+		}
+		StringOp::trimRight(path, '/');
+		if (path.empty() || path == "." ||
+		    pathFilter.skipsWithParents(path, entry.type == '5')) {
+			skipTarData(file, dataSize);
+			continue;
+		}
+
+		if (entry.type == '5') {
+			addSubdirPath(path, td[0], td[1], dirSectors);
+			skipTarData(file, dataSize);
+			continue;
+		}
+		if (entry.type != '0' && entry.type != '\0' && entry.type != '7') {
+			std::cout << path << ": ignored, not a regular file\n";
+			skipTarData(file, dataSize);
+			continue;
+		}
+
+		auto [dirPath, name] = StringOp::splitOnLast(path, '/');
+		int sector = addSubdirPath(dirPath, td[0], td[1], dirSectors);
+		if (sector < 0) {
+			skipTarData(file, dataSize);
+			continue;
+		}
+		if (name.starts_with('.')) {
+			std::cout << name << ": ignored file which starts with a '.'\n";
+			skipTarData(file, dataSize);
+			continue;
+		}
+
+		std::string hostName(path);
+		bool exists;
+		MsxName msxName = msxNameFor(name, sector, exists);
+		uint8_t index = (sector == msxChrootSector) ? msxChrootStartIndex : 0;
+		auto* dirEntry = exists ? findEntryInDir(msxName, sector, index) : nullptr;
+		if (dirEntry && ((dirEntry->attrib & T_MSX_DIR) || keep)) {
+			PRT_VERBOSE("Preserving entry " << hostName);
+			skipTarData(file, dataSize);
+			continue;
+		}
+		if (!dirEntry) {
+			dirEntry = addFileEntry(msxName, entry.mtime, sector);
+			if (!dirEntry) {
+				std::cout << "couldn't add entry" << hostName << '\n';
+				skipTarData(file, dataSize);
+				continue;
+			}
+		}
+		PRT_VERBOSE(hostName << " \t-> \"" << msxName.view() << '"');
+		int size = std::min<uint64_t>(entry.size, INT_MAX);
+		skipTarData(file, dataSize - alterFileInDSK(dirEntry, file, size, hostName));
+	}
+}
+
+// One line of a '--manifest' file, see readManifest()
+struct ManifestEntry {
+	std::string source;           // host file or directory
+	std::string dest;             // '/' separated path below the msx root dir
+	uint8_t attrib = 0;           // T_MSX_READ, T_MSX_HID, T_MSX_SYS, T_MSX_ARC
+	std::optional<time_t> mtime;  // instead of the host time
+};
+
+/** Read a manifest: one entry per line, with tab separated fields
+ *   SOURCE DEST [ATTRIBUTES [TIME]]
+ * ATTRIBUTES are the letters 'r', 'h', 's' and 'a' (or '-' for none), TIME
+ * is in seconds since 1970 (or '-' for the time of the host file). Empty
+ * lines and lines starting with '#' are skipped.
+ */
+std::vector<ManifestEntry> readManifest(const std::string& fileName)
+{
+	std::ifstream file(fileName);
+	if (!file) {
+		CRITICAL_ERROR("Couldn't open manifest " << fileName);
+	}
+	std::vector<ManifestEntry> result;
+	std::string line;
+	for (int lineNr = 1; std::getline(file, line); ++lineNr) {
+		if (line.empty() || line[0] == '#') continue;
+		auto fields = StringOp::split(line, '\t');
+		if (fields.size() < 2 || fields.size() > 4 || fields[0].empty()) {
+			CRITICAL_ERROR(fileName << ':' << lineNr << ": expected SOURCE<tab>DEST[<tab>ATTRIBUTES[<tab>TIME]]");
+		}
+		ManifestEntry entry;
+		entry.source = fields[0];
+		std::string_view dest = fields[1];
+		while (dest.starts_with("./") || dest.starts_with('/')) {
+			dest.remove_prefix(dest.starts_with('/') ? 1 : 2);
+		}
+		StringOp::trimRight(dest, '/');
+		if (dest == ".") dest = {};
+		entry.dest = dest;
+		if (fields.size() > 2 && fields[2] != "-") {
+			for (char c : fields[2]) {
+				switch (c) {
+				case 'r': entry.attrib |= T_MSX_READ; break;
+				case 'h': entry.attrib |= T_MSX_HID;  break;
+				case 's': entry.attrib |= T_MSX_SYS;  break;
+				case 'a': entry.attrib |= T_MSX_ARC;  break;
+				default:
+					CRITICAL_ERROR(fileName << ':' << lineNr << ": unknown attribute '" << c << '\'');
+				}
+			}
+		}
+		if (fields.size() > 3 && fields[3] != "-") {
+			std::string time(fields[3]);
+			char* end;
+			entry.mtime = time_t(strtoll(time.c_str(), &end, 10));
+			if (*end) {
+				CRITICAL_ERROR(fileName << ':' << lineNr << ": invalid time " << time);
+			}
+		}
+		result.push_back(std::move(entry));
+	}
+	return result;
+}
+
+/** Add (or with !keep also update) the entries of a manifest, in the order
+ * of the manifest. A directory is added with all its contents, an empty
+ * DEST then means the current msx root dir. An entry without SOURCE (not
+ * possible in a manifest file) only creates directory DEST.
+ */
+void addManifest(std::span<const ManifestEntry> manifest, bool keep)
+{
+	std::unordered_map<std::string, int> dirSectors;
+	for (const auto& entry : manifest) {
+		if (entry.source.empty()) {
+			int td[2];
+			makeFatTime(*localtime(&*entry.mtime), td);
+			addSubdirPath(entry.dest, td[0], td[1], dirSectors);
+			continue;
+		}
+		struct stat fst;
+		if (stat(entry.source.c_str(), &fst) != 0) {
+			std::cout << entry.source << ": " << strerror(errno) << '\n';
+			continue;
+		}
+		if (pathFilter.skipsWithParents(entry.source, S_ISDIR(fst.st_mode))) {
+			PRT_DEBUG("Excluding " << entry.source);
+			continue;
+		}
+		int td[2];
+		if (entry.mtime) {
+			makeFatTime(*localtime(&*entry.mtime), td);
+		} else {
+			hostTimeToFat(fst.st_mtime, td);
+		}
+
+		auto [dirPath, name] = StringOp::splitOnLast(entry.dest, '/');
+		if (S_ISDIR(fst.st_mode)) {
+			int sector = addSubdirPath(entry.dest, td[0], td[1], dirSectors);
+			if (sector < 0) continue;
+			if (doSubdirs && !entry.dest.empty()) {
+				int parent = addSubdirPath(dirPath, td[0], td[1], dirSectors);
+				bool exists;
+				MsxName msxName = msxNameFor(name, parent, exists, false);
+				uint8_t index = (parent == msxChrootSector) ? msxChrootStartIndex : 0;
+				if (auto* dirEntry = findEntryInDir(msxName, parent, index)) {
+					dirEntry->attrib = T_MSX_DIR | entry.attrib;
+				}
+			}
+			recurseDirFill(entry.source, sector, (sector == msxChrootSector) ? msxChrootStartIndex : 0);
+			continue;
+		}
+		if (name.empty() || name.starts_with('.')) {
+			std::cout << entry.source << ": invalid destination '" << entry.dest << "'\n";
+			continue;
+		}
+
+		int sector = addSubdirPath(dirPath, td[0], td[1], dirSectors);
+		if (sector < 0) continue;
+		bool exists;
+		MsxName msxName = msxNameFor(name, sector, exists);
+		uint8_t index = (sector == msxChrootSector) ? msxChrootStartIndex : 0;
+		auto* dirEntry = exists ? findEntryInDir(msxName, sector, index) : nullptr;
+		if (dirEntry && ((dirEntry->attrib & T_MSX_DIR) || keep)) {
+			PRT_VERBOSE("Preserving entry " << entry.dest);
+			continue;
+		}
+		if (dirEntry) {
+			// the new content gets new clusters, like in copyItems()
+			freeClusterChain(dirEntry->startCluster);
+			dirEntry->startCluster = 0;
+			dirEntry->size = 0;
+		} else {
+			dirEntry = addFileEntry(msxName, fst.st_mtime, sector);
+			if (!dirEntry) {
+				std::cout << "couldn't add entry" << entry.dest << '\n';
+				continue;
+			}
+		}
+		PRT_VERBOSE(entry.source << " \t-> \"" << msxName.view() << '"');
+		dirEntry->attrib = T_MSX_REG | entry.attrib;
+		dirEntry->time = td[0];
+		dirEntry->date = td[1];
+		if (hostRing && fst.st_size > 0 && S_ISREG(fst.st_mode)) {
+			queueFileInsert(AT_FDCWD, entry.source.c_str(), entry.source, dirEntry, fst.st_size);
+		} else {
+			alterFileInDSK(dirEntry, entry.source);
+		}
+	}
+}
+
+/** Create an empty disk image with correct boot sector,FAT etc.
+ */
+void createEmptyDSK(int nbSectors, bool dos2)
+{
+	// First create structure for the fake disk
+	// Allocate dskImage in memory
+	const GeometryProfile& profile = geometryForSize(nbSectors);
+	if (profile.fixedSize) nbSectors = profile.nbSectors;
+	dskImage.assign(size_t(nbSectors) * SECTOR_SIZE, 0xE5);
+	fsImage = dskImage.data();
+	imageBlockHashes.clear();
+
+	// Assign default boot disk to this instance
+	// give extra info on the boot sector
+	// and get global parameters from them (implicit readBootSector)
+	memcpy(fsImage, dos2 ? dos2BootBlock : dos1BootBlock, SECTOR_SIZE);
+	setBootSector(nbSectors);
+
+	// Assign default empty values to disk
+	memset(fsImage + SECTOR_SIZE, 0x00, rootDirEnd * SECTOR_SIZE);
+	// for some reason the first 3uint8_ts are used to indicate the end of a
+	// cluster, making the first available cluster nr 2 some sources say
+	// that this indicates the disk format and FAT[0]should 0xF7 for single
+	// sided disk, and 0xF9 for double sided disks
+	// TODO: check this :-)
+	// for now I simply repeat the media descriptor here
+	{
+		const auto* boot = reinterpret_cast<const MSXBootSector*>(fsImage);
+		fsImage[SECTOR_SIZE + 0] = boot->descriptor;
+	}
+	fsImage[SECTOR_SIZE + 1] = 0xFF;
+	fsImage[SECTOR_SIZE + 2] = 0xFF;
+	if (fat16) {
+		fsImage[SECTOR_SIZE + 3] = 0xFF;
+	}
+}
+
+/** Copy the 'size' bytes of file 'in' to 'out' (both at offset 0), sharing
+ * the data blocks (reflink) when the file system supports that
+ * returns: false on failure
+ */
+bool copyFileData(int in, int out, off_t size)
+{
+	bool ok = false;
+#ifdef FICLONE
+	ok = ioctl(out, FICLONE, in) == 0;
+#endif
+	off_t left = size;
+#ifdef __linux__
+	// in-kernel copy, can still share blocks on some file systems (NFS, ...)
+	while (!ok && left > 0) {
+		ssize_t n = copy_file_range(in, nullptr, out, nullptr, left, 0);
+		if (n <= 0) break;
+		left -= n;
+	}
+	ok = ok || left == 0;
+#endif
+	if (!ok) {
+		lseek(in, size - left, SEEK_SET);
+		lseek(out, size - left, SEEK_SET);
+		char buf[64 * 1024];
+		ssize_t n;
+		while ((n = read(in, buf, sizeof(buf))) > 0 && write(out, buf, n) == n) {
+			left -= n;
+		}
+		ok = left == 0;
+	}
+	return ok;
+}
+
+/** Copy file 'from' to 'to' (which is replaced atomically), sharing the data
+ * blocks with 'from' (reflink) when the file system supports that. A device
+ * 'to' can't be replaced, it's written in place (as in writeImageFile()).
+ * With 'expected' the copy fails if 'from' isn't in that state anymore, it's
+ * then also locked (as in readImageFile()) while it's copied.
+ * returns: false on failure, a regular file 'to' is then unchanged
+ */
+bool cloneFile(const std::string& from, const std::string& to, const struct stat* expected = nullptr)
+{
+	int in = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+	if (in < 0) return false;
+	if (expected) {
+		while (flock(in, LOCK_SH) != 0 && errno == EINTR) {}
+	}
+	struct stat st, toSt;
+	if (fstat(in, &st) != 0 || (expected && !sameFileState(*expected, st))) {
+		close(in);
+		return false;
+	}
+	if (stat(to.c_str(), &toSt) == 0 && !S_ISREG(toSt.st_mode)) {
+		int out = open(to.c_str(), O_WRONLY | O_CLOEXEC);
+		bool ok = out >= 0 && copyFileData(in, out, st.st_size);
+		if (out >= 0) ok = (close(out) == 0) && ok;
+		close(in);
+		return ok;
+	}
+	// a unique name, several processes can store the same file at once
+	std::string tmpName = to + ".XXXXXX";
+	int out = mkostemp(tmpName.data(), O_CLOEXEC);
+	if (out < 0) {
+		close(in);
+		return false;
+	}
+	mode_t mask = umask(0);
+	umask(mask);
+	fchmod(out, 0666 & ~mask);
+	bool ok = copyFileData(in, out, st.st_size) && fsync(out) == 0;
+	ok = (close(out) == 0) && ok;
+	close(in);
+	if (!ok || rename(tmpName.c_str(), to.c_str()) != 0) {
+		unlink(tmpName.c_str());
+		return false;
+	}
+	return true;
+}
+
+/** Create 'fileName' from the loaded image, which was read from 'base':
+ * the base is cloned (sharing its data blocks with the clone when the file
+ * system supports that) and only the blocks that changed are written to
+ * the clone before it replaces 'fileName'. The base must not have changed
+ * since it was read, the clone would then mix both versions.
+ */
+void writeImageFromBase(const std::string& base, const std::string& fileName)
+{
+	syncFATCopies();
+	std::string tmpName = fileName + ".new";
+	std::vector<JournalExtent> extents;
+	std::vector<const uint8_t*> data;
+	changedExtents(extents, data);
+	if (!cloneFile(base, tmpName, &imageFileStat)) {
+		struct stat st;
+		if (stat(base.c_str(), &st) == 0 && !sameFileState(imageFileStat, st)) {
+			CRITICAL_ERROR(base << " changed while " << fileName << " was made from it, "
+			               << fileName << " was not written");
+		}
+		CRITICAL_ERROR("Couldn't write " << fileName);
+	}
+	if (!applyExtents(tmpName, extents, data) || rename(tmpName.c_str(), fileName.c_str()) != 0) {
+		unlink(tmpName.c_str());
+		CRITICAL_ERROR("Couldn't write " << fileName);
+	}
+	syncParentDir(fileName);
+}
+
+/** Append a description of host file or directory 'name' (relative to
+ * 'dirFd') and, recursively, its contents to the cache key 'key'. Every
+ * entry adds its path, type, size and FAT time stamp. A file also adds its
+ * inode number and full resolution modification and change times (a file
+ * rewritten within the 2 seconds of a FAT time stamp), with a fixed time
+ * (SOURCE_DATE_EPOCH) its contents are hashed instead. Entries found
+ * in a directory ('filtered') are skipped as in recurseDirFill().
+ * returns: false if the tree couldn't be read completely
+ */
+bool appendTreeKey(int dirFd, const char* name, std::string& path, std::string& key,
+                   bool filtered = false)
+{
+	struct stat st;
+	if (fstatat(dirFd, name, &st, 0) != 0) return false;
+	if (filtered && pathFilter.skips(path, S_ISDIR(st.st_mode))) return true;
+	int td[2];
+	hostTimeToFat(st.st_mtime, td);
+	uint8_t rec[17];
+	rec[0] = S_ISDIR(st.st_mode) ? 'd' : 'f';
+	Endian::write_UA_L64(rec + 1, S_ISDIR(st.st_mode) ? 0 : st.st_size);
+	Endian::write_UA_L32(rec + 9, td[0]);
+	Endian::write_UA_L32(rec + 13, td[1]);
+	key += path;
+	key += '\0';
+	key.append(reinterpret_cast<const char*>(rec), sizeof(rec));
+
+	int fd = openat(dirFd, name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return false;
+	if (!S_ISDIR(st.st_mode)) {
+		if (fixedTime) {
+			std::vector<uint8_t> data(st.st_size);
+			bool ok = read(fd, data.data(), data.size()) == ssize_t(data.size());
+			close(fd);
+			if (!ok) return false;
+			Endian::write_UA_L64(rec, Hash::xxh64(data.data(), data.size()));
+			key.append(reinterpret_cast<const char*>(rec), 8);
+		} else {
+			close(fd);
+			uint8_t id[40];
+			Endian::write_UA_L64(id +  0, st.st_ino);
+			Endian::write_UA_L64(id +  8, st.st_mtim.tv_sec);
+			Endian::write_UA_L64(id + 16, st.st_mtim.tv_nsec);
+			Endian::write_UA_L64(id + 24, st.st_ctim.tv_sec);
+			Endian::write_UA_L64(id + 32, st.st_ctim.tv_nsec);
+			key.append(reinterpret_cast<const char*>(id), sizeof(id));
+		}
+		return true;
+	}
+
+	DIR* dir = fdopendir(fd);
+	if (!dir) {
+		close(fd);
+		return false;
+	}
+	// sorted, so the key doesn't depend on the directory order
+	std::vector<std::string> names;
+	while (struct dirent* d = readdir(dir)) {
+		if (strcmp(d->d_name, ".") != 0 && strcmp(d->d_name, "..") != 0) {
+			names.emplace_back(d->d_name);
+		}
+	}
+	std::sort(names.begin(), names.end());
+	size_t pathLen = path.size();
+	bool ok = true;
+	for (const auto& n : names) {
+		path += '/';
+		path += n;
+		ok = ok && appendTreeKey(dirfd(dir), n.c_str(), path, key, true);
+		path.resize(pathLen);
+	}
+	closedir(dir);
+	return ok;
+}
+
+/** The name (in the cache directory) of the image created from 'args' with
+ * the given options, empty if the image can't be cached (e.g. created from
+ * a tar stream)
+ */
+std::string imageCacheKey(std::span<const std::string> args, std::span<const ManifestEntry> manifest,
+                          int nbSectors, bool dos2, const std::string& msxDir, bool nameMap)
+{
+	std::string key = "msxtar image 1";
+	key += '\0';
+	const GeometryProfile& profile = geometryForSize(nbSectors);
+	if (profile.fixedSize) nbSectors = profile.nbSectors;
+	key += std::to_string(nbSectors) + (dos2 ? " dos2" : " dos1") +
+	       (nameMap ? " map" : "") + (fixedTime ? " fixed" : "");
+	key += '\0';
+	key += msxDir;
+	key += '\0';
+	for (const auto& arg : args) {
+		if (arg == "-") return {};
+		std::string path = arg;
+		if (!appendTreeKey(AT_FDCWD, arg.c_str(), path, key)) return {};
+	}
+	for (const auto& entry : manifest) {
+		key += entry.dest + '\0' + std::to_string(entry.attrib) + ' ' +
+		       (entry.mtime ? std::to_string(*entry.mtime) : "-") + '\0';
+		std::string path = entry.source;
+		if (!appendTreeKey(AT_FDCWD, entry.source.c_str(), path, key)) return {};
+	}
+	char hex[33];
+	snprintf(hex, sizeof(hex), "%016llx%016llx",
+	         static_cast<unsigned long long>(Hash::xxh64(key.data(), key.size(), 0)),
+	         static_cast<unsigned long long>(Hash::xxh64(key.data(), key.size(), 1)));
+	return hex;
+}
+
+// The host files for a new image and where they go, see gatherSpaceNeeds()
+struct SpaceNeeds {
+	struct File {
+		ManifestEntry entry; // DEST is relative to the root dir
+		uint64_t size;
+	};
+	struct Dir {
+		unsigned entries = 0;
+		time_t mtime = 0; // SOURCE_DATE_EPOCH already applied
+	};
+	std::vector<File> files;
+	std::unordered_map<std::string, Dir> dirs; // "" is the root dir
+	bool complete = true; // false if some sizes are unknown (tar stream)
+};
+
+/** Add the msx dir 'path' (and its parents) with time 'mtime' to 'needs'
+ */
+void planSubdir(SpaceNeeds& needs, const std::string& path, time_t mtime)
+{
+	if (path.empty() || needs.dirs.contains(path)) return;
+	std::string parent(StringOp::splitOnLast(path, '/').first);
+	planSubdir(needs, parent, mtime);
+	++needs.dirs[parent].entries;
+	needs.dirs[path].mtime = mtime;
+}
+
+void planFile(SpaceNeeds& needs, ManifestEntry&& entry, const struct stat& st)
+{
+	++needs.dirs[std::string(StringOp::splitOnLast(entry.dest, '/').first)].entries;
+	needs.files.push_back({std::move(entry), uint64_t(st.st_size)});
+}
+
+/** Add the contents of host directory 'name' (relative to 'dirFd') to msx
+ * dir 'dir', skipping the same entries as recurseDirFill()
+ */
+void planHostDir(SpaceNeeds& needs, int dirFd, const char* name, std::string& source, std::string& dir)
+{
+	int fd = openat(dirFd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	DIR* d = (fd >= 0) ? fdopendir(fd) : nullptr;
+	if (!d) {
+		if (fd >= 0) close(fd);
+		return;
+	}
+	size_t sourceLen = source.size();
+	size_t dirLen = dir.size();
+	while (struct dirent* e = readdir(d)) {
+		const char* n = e->d_name;
+		struct stat st;
+		if (strcmp(n, ".") == 0 || strcmp(n, "..") == 0 ||
+		    fstatat(dirfd(d), n, &st, 0) != 0) {
+			continue;
+		}
+		source += '/';
+		source += n;
+		if (pathFilter.skips(source, S_ISDIR(st.st_mode))) {
+			// excluded
+		} else if (!S_ISDIR(st.st_mode)) {
+			if (n[0] != '.') planFile(needs, {source, joinPath(dir, n), 0, {}}, st);
+		} else if (doSubdirs) {
+			dir = joinPath(dir, n);
+			planSubdir(needs, dir, fixedTime.value_or(st.st_mtime));
+			planHostDir(needs, dirfd(d), n, source, dir);
+			dir.resize(dirLen);
+		}
+		source.resize(sourceLen);
+	}
+	closedir(d);
+}
+
+/** Collect what creating an image from 'args' and 'manifest' in msx dir
+ * 'msxDir' needs, as addCreateDSK() and addManifest() would add them. Names
+ * that are added twice are counted twice, so it's an upper bound.
+ */
+SpaceNeeds gatherSpaceNeeds(std::span<const std::string> args, std::span<const ManifestEntry> manifest,
+                            std::string_view msxDir)
+{
+	SpaceNeeds needs;
+	needs.dirs[""];
+	std::string root;
+	while (!msxDir.empty()) {
+		StringOp::trimLeft(msxDir, "/\\");
+		auto [part, rest] = StringOp::splitOnFirst(msxDir, "/\\");
+		if (!part.empty()) {
+			root = joinPath(root, part);
+			planSubdir(needs, root, fixedTime.value_or(time(nullptr))); // as chroot() does
+		}
+		msxDir = rest;
+	}
+	auto dirFor = [&](std::string_view path) {
+		return doSubdirs ? joinPath(root, path) : root;
+	};
+
+	for (const auto& arg : args) {
+		struct stat st;
+		if (arg == "-") {
+			needs.complete = false;
+		} else if (stat(arg.c_str(), &st) != 0) {
+			continue;
+		} else if (S_ISDIR(st.st_mode)) {
+			std::string source = arg;
+			std::string dir = dirFor(StringOp::splitOnLast(arg, "/\\").second);
+			planSubdir(needs, dir, fixedTime.value_or(st.st_mtime));
+			planHostDir(needs, AT_FDCWD, arg.c_str(), source, dir);
+		} else {
+			planFile(needs, {arg, joinPath(root, StringOp::splitOnLast(arg, "/\\").second), 0, {}}, st);
+		}
+	}
+	for (const auto& entry : manifest) {
+		struct stat st;
+		if (stat(entry.source.c_str(), &st) != 0 ||
+		    pathFilter.skipsWithParents(entry.source, S_ISDIR(st.st_mode))) {
+			continue;
+		}
+		if (S_ISDIR(st.st_mode)) {
+			std::string source = entry.source;
+			std::string dir = dirFor(entry.dest);
+			planSubdir(needs, dir, entry.mtime.value_or(fixedTime.value_or(st.st_mtime)));
+			planHostDir(needs, AT_FDCWD, entry.source.c_str(), source, dir);
+		} else {
+			auto [dirPath, name] = StringOp::splitOnLast(entry.dest, '/');
+			std::string dir = dirFor(dirPath);
+			planSubdir(needs, dir, entry.mtime.value_or(fixedTime.value_or(st.st_mtime)));
+			ManifestEntry file = entry;
+			file.dest = joinPath(dir, name);
+			planFile(needs, std::move(file), st);
+		}
+	}
+	return needs;
+}
+
+/** The number of clusters of 'clusterSize' bytes that a file of 'size'
+ * bytes takes, even empty files get a cluster (see alterFileInDSK())
+ */
+uint64_t fileClusters(uint64_t size, uint64_t clusterSize)
+{
+	return std::max<uint64_t>(1, (size + clusterSize - 1) / clusterSize);
+}
+
+/** The number of clusters a subdir with 'entries' entries takes
+ */
+uint64_t dirClusters(unsigned entries, uint64_t clusterSize)
+{
+	uint64_t size = (entries + 2) * sizeof(MSXDirEntry); // plus '.' and '..'
+	return std::max<uint64_t>(1, (size + clusterSize - 1) / clusterSize);
+}
+
+// One candidate size of the size planner, see planImageSize()
+struct SizePlan {
+	FsLayout layout;
+	uint64_t clusters = 0; // needed for files and subdirs
+	uint64_t slack = 0;    // bytes in file clusters that aren't used
+	bool fits = false;
+};
+
+/** Evaluate 'needs' on a new image of (about) 'nbSectors' sectors
+ */
+SizePlan evaluateSize(const SpaceNeeds& needs, int nbSectors)
+{
+	SizePlan plan{layoutForSize(nbSectors)};
+	if (plan.layout.nbSectorsPerCluster == 0) return plan;
+	uint64_t clusterSize = plan.layout.nbSectorsPerCluster * SECTOR_SIZE;
+	for (const auto& file : needs.files) {
+		uint64_t n = fileClusters(file.size, clusterSize);
+		plan.clusters += n;
+		plan.slack += n * clusterSize - file.size;
+	}
+	for (const auto& [path, dir] : needs.dirs) {
+		if (!path.empty()) plan.clusters += dirClusters(dir.entries, clusterSize);
+	}
+	plan.fits = needs.dirs.at("").entries <= plan.layout.profile->nbDirEntry &&
+	            plan.clusters <= uint64_t(plan.layout.nbClusters());
+	return plan;
+}
+
+/** The smallest image of geometry profile 'i' that fits 'needs' (or the
+ * largest one of that profile if nothing fits)
+ */
+SizePlan planForProfile(const SpaceNeeds& needs, size_t i)
+{
+	const auto& profile = geometryProfiles[i];
+	if (profile.fixedSize) return evaluateSize(needs, profile.nbSectors);
+
+	int maxSectors = (i + 1 < std::size(geometryProfiles))
+	               ? geometryProfiles[i + 1].minSectors - 1
+	               : 64 * MAX_FAT16_CLUSTERS;
+	int nbSectors = profile.minSectors;
+	// the FAT (and for FAT16 the cluster) size depend on the image size,
+	// so grow the image until the clusters it would need fit
+	for (int tries = 0; tries < 16 && nbSectors < maxSectors; ++tries) {
+		SizePlan plan = evaluateSize(needs, nbSectors);
+		if (plan.fits) return plan;
+		if (needs.dirs.at("").entries > profile.nbDirEntry) break;
+		uint64_t want = plan.layout.dataStart() + plan.clusters * plan.layout.nbSectorsPerCluster;
+		nbSectors = int(std::clamp<uint64_t>(want, nbSectors + 1, maxSectors));
+	}
+	return evaluateSize(needs, maxSectors);
+}
+
+/** Print the candidate sizes for 'needs' (when 'print' is set) and choose
+ * the smallest one that fits, or check the size given with --size
+ * returns: the number of sectors for the image
+ */
+int planImageSize(const SpaceNeeds& needs, std::optional<int> nbSectors, bool print)
+{
+	std::vector<SizePlan> plans;
+	for (size_t i = 0; i < std::size(geometryProfiles); ++i) {
+		plans.push_back(planForProfile(needs, i));
+	}
+	const SizePlan* chosen = nullptr;
+	if (nbSectors) {
+		plans.push_back(evaluateSize(needs, *nbSectors));
+		chosen = &plans.back();
+	} else {
+		for (const auto& plan : plans) {
+			if (plan.fits && (!chosen || plan.layout.nbSectors < chosen->layout.nbSectors)) {
+				chosen = &plan;
+			}
+		}
+	}
+
+	if (print) {
+		std::cout << "  profile  size     sectors  cluster  root     clusters         slack    free\n";
+		for (const auto& plan : plans) {
+			const auto& layout = plan.layout;
+			std::cout << (&plan == chosen ? "* " : "  ") << std::left
+			          << std::setw(9) << layout.profile->name
+			          << std::setw(9) << (std::to_string(layout.nbSectors / 2) + 'K')
+			          << std::right << std::setw(7) << layout.nbSectors << "  ";
+			if (layout.nbSectorsPerCluster == 0) {
+				std::cout << "too large\n";
+				continue;
+			}
+			uint64_t clusterSize = layout.nbSectorsPerCluster * SECTOR_SIZE;
+			int64_t freeClusters = int64_t(layout.nbClusters()) - int64_t(plan.clusters);
+			std::cout << std::setw(7) << clusterSize << "  " << std::left
+			          << std::setw(9) << (std::to_string(needs.dirs.at("").entries) + '/' +
+			                              std::to_string(layout.profile->nbDirEntry))
+			          << std::setw(17) << (std::to_string(plan.clusters) + '/' +
+			                               std::to_string(layout.nbClusters()))
+			          << std::setw(9) << (std::to_string(plan.slack / 1024) + 'K')
+			          << (plan.fits ? std::to_string(freeClusters * int64_t(clusterSize) / 1024) + 'K' : "doesn't fit")
+			          << std::right << '\n';
+		}
+	}
+	if (!chosen) {
+		CRITICAL_ERROR("The files don't fit in any image size");
+	}
+	if (!chosen->fits) {
+		std::cout << "The files don't fit in an image of " << chosen->layout.nbSectors << " sectors\n";
+	}
+	return chosen->layout.nbSectors;
+}
+
+// One disk of a multi-volume set, see packVolumes()
+struct Volume {
+	std::vector<size_t> files;                      // indices in SpaceNeeds::files
+	std::unordered_map<std::string, unsigned> dirs; // entries per msx dir
+	uint64_t clusters = 0;
+};
+
+/** Add the files 'unit' (indices in needs.files) and directory 'dir' (if
+ * not null) to 'volume', creating their directories on it when needed
+ * returns: false if they don't fit in 'layout', 'volume' is then unchanged
+ */
+bool addToVolume(Volume& volume, const SpaceNeeds& needs, std::span<const size_t> unit,
+                 const FsLayout& layout, const std::string* dir = nullptr)
+{
+	uint64_t clusterSize = layout.nbSectorsPerCluster * SECTOR_SIZE;
+	uint64_t clusters = volume.clusters;
+	std::unordered_map<std::string, unsigned> changed; // new entry counts
+	auto entries = [&](const std::string& dir) -> unsigned* {
+		if (auto it = changed.find(dir); it != changed.end()) return &it->second;
+		auto it = volume.dirs.find(dir);
+		return (it == volume.dirs.end()) ? nullptr : &(changed[dir] = it->second);
+	};
+	auto addEntry = [&](auto& self, const std::string& path) -> void {
+		unsigned* count = entries(path);
+		if (!count) {
+			// not yet on this disk
+			self(self, std::string(StringOp::splitOnLast(path, '/').first));
+			count = &(changed[path] = 0);
+			clusters += dirClusters(0, clusterSize);
+		}
+		if (!path.empty()) clusters -= dirClusters(*count, clusterSize);
+		++*count;
+		if (!path.empty()) clusters += dirClusters(*count, clusterSize);
+	};
+
+	for (size_t i : unit) {
+		const auto& file = needs.files[i];
+		addEntry(addEntry, std::string(StringOp::splitOnLast(file.entry.dest, '/').first));
+		clusters += fileClusters(file.size, clusterSize);
+	}
+	if (dir && !entries(*dir)) {
+		addEntry(addEntry, std::string(StringOp::splitOnLast(*dir, '/').first));
+		changed[*dir] = 0;
+		clusters += dirClusters(0, clusterSize);
+	}
+	unsigned rootEntries = entries("") ? *entries("") : 0;
+	if (clusters > uint64_t(layout.nbClusters()) || rootEntries > layout.profile->nbDirEntry) {
+		return false;
+	}
+	for (auto& [dir, count] : changed) volume.dirs[dir] = count;
+	volume.clusters = clusters;
+	volume.files.insert(volume.files.end(), unit.begin(), unit.end());
+	return true;
+}
+
+/** Split the files of 'needs' over as few disks with layout 'layout' as
+ * possible (first fit, largest first). With 'keepDirs' the files of a
+ * directory (including its subdirs) stay on one disk, unless they don't
+ * fit on a single disk, then its subdirs are tried separately.
+ */
+std::vector<Volume> packVolumes(const SpaceNeeds& needs, const FsLayout& layout, bool keepDirs)
+{
+	std::vector<std::vector<size_t>> units;
+	if (keepDirs) {
+		std::unordered_map<std::string, std::vector<size_t>> filesIn;
+		std::unordered_map<std::string, std::vector<std::string>> subdirs;
+		for (size_t i = 0; i < needs.files.size(); ++i) {
+			filesIn[std::string(StringOp::splitOnLast(needs.files[i].entry.dest, '/').first)].push_back(i);
+		}
+		for (const auto& [path, dir] : needs.dirs) {
+			if (!path.empty()) subdirs[std::string(StringOp::splitOnLast(path, '/').first)].push_back(path);
+		}
+		auto collect = [&](auto& self, const std::string& dir, std::vector<size_t>& result) -> void {
+			auto& files = filesIn[dir];
+			result.insert(result.end(), files.begin(), files.end());
+			for (const auto& sub : subdirs[dir]) self(self, sub, result);
+		};
+		auto split = [&](auto& self, const std::string& dir) -> void {
+			if (!dir.empty()) {
+				std::vector<size_t> all;
+				collect(collect, dir, all);
+				Volume empty{{}, {{"", 0}}};
+				if (all.empty() || addToVolume(empty, needs, all, layout)) {
+					if (!all.empty()) units.push_back(std::move(all));
+					return;
+				}
+			}
+			for (size_t i : filesIn[dir]) units.push_back({i});
+			for (const auto& sub : subdirs[dir]) self(self, sub);
+		};
+		split(split, "");
+	} else {
+		for (size_t i = 0; i < needs.files.size(); ++i) units.push_back({i});
+	}
+
+	uint64_t clusterSize = layout.nbSectorsPerCluster * SECTOR_SIZE;
+	auto unitClusters = [&](const std::vector<size_t>& unit) {
+		uint64_t result = 0;
+		for (size_t i : unit) result += fileClusters(needs.files[i].size, clusterSize);
+		return result;
+	};
+	std::vector<std::pair<uint64_t, size_t>> order; // (clusters, unit)
+	for (size_t u = 0; u < units.size(); ++u) order.emplace_back(unitClusters(units[u]), u);
+	std::ranges::sort(order, [](const auto& a, const auto& b) {
+		return a.first != b.first ? a.first > b.first : a.second < b.second;
+	});
+
+	std::vector<Volume> volumes;
+	for (auto [clusters, u] : order) {
+		bool placed = false;
+		for (auto& volume : volumes) {
+			if (volume.clusters + clusters > uint64_t(layout.nbClusters())) continue;
+			if (addToVolume(volume, needs, units[u], layout)) {
+				placed = true;
+				break;
+			}
+		}
+		if (!placed) {
+			auto& volume = volumes.emplace_back(Volume{{}, {{"", 0}}});
+			if (!addToVolume(volume, needs, units[u], layout)) {
+				CRITICAL_ERROR(needs.files[units[u].front()].entry.source << " doesn't fit on a single disk");
+			}
+		}
+	}
+
+	// directories without files also have to go somewhere
+	std::vector<std::string> emptyDirs;
+	for (const auto& [path, dir] : needs.dirs) {
+		if (std::ranges::none_of(volumes, [&](const Volume& v) { return v.dirs.contains(path); })) {
+			emptyDirs.push_back(path);
+		}
+	}
+	std::ranges::sort(emptyDirs);
+	for (const auto& path : emptyDirs) {
+		if (std::ranges::any_of(volumes, [&](const Volume& v) { return v.dirs.contains(path); })) {
+			continue; // created as parent of an earlier one
+		}
+		if (std::ranges::none_of(volumes, [&](Volume& v) { return addToVolume(v, needs, {}, layout, &path); })) {
+			addToVolume(volumes.emplace_back(Volume{{}, {{"", 0}}}), needs, {}, layout, &path);
+		}
+	}
+	for (auto& volume : volumes) std::ranges::sort(volume.files);
+	return volumes;
+}
+
+/** The name of volume 'n' (counting from 1) of a set named 'fileName', the
+ * number goes before the extension: disk.dsk -> disk1.dsk
+ */
+std::string volumeName(std::string_view fileName, int n)
+{
+	size_t dot = fileName.rfind('.');
+	size_t slash = fileName.find_last_of("/\\");
+	if (dot == std::string_view::npos || (slash != std::string_view::npos && dot < slash)) {
+		dot = fileName.size();
+	}
+	return std::string(fileName.substr(0, dot)) + std::to_string(n) + std::string(fileName.substr(dot));
+}
+
+/** Create the images of a multi-volume set, named after 'fileName' (and
+ * their name maps after 'nameMap', if not empty)
+ * returns: false if an image couldn't be written
+ */
+bool writeVolumes(const SpaceNeeds& needs, std::span<const Volume> volumes, int nbSectors, bool dos2,
+                  const std::string& fileName, const std::string& nameMap)
+{
+	for (size_t v = 0; v < volumes.size(); ++v) {
+		const auto& volume = volumes[v];
+		dirNames.clear();
+		hostToMsxName.clear();
+		msxToHostName.clear();
+		createEmptyDSK(nbSectors, dos2);
+		msxChrootStartIndex = 0;
+
+		// the directories first (parents before their subdirs), then the files
+		std::vector<std::string> dirs;
+		for (const auto& [path, count] : volume.dirs) {
+			if (!path.empty()) dirs.push_back(path);
+		}
+		std::ranges::sort(dirs);
+		std::vector<ManifestEntry> entries;
+		for (auto& dir : dirs) {
+			time_t mtime = needs.dirs.at(dir).mtime;
+			entries.push_back({"", std::move(dir), 0, mtime});
+		}
+		for (size_t i : volume.files) entries.push_back(needs.files[i].entry);
+		addManifest(entries, true);
+		flushHostIo();
+
+		std::string name = volumeName(fileName, v + 1);
+		PRT_VERBOSE(name << ": " << volume.files.size() << " files, "
+		            << volume.clusters << " clusters used");
+		if (!writeImageToDisk(name)) return false;
+		if (!nameMap.empty()) writeNameMap(volumeName(nameMap, v + 1));
+	}
+	return true;
+}
+
+/** Is the loaded image a partitioned HD image (IDEFDISK or T98)?
+ */
+bool isHDImage()
+{
+	return dskImage.size() >= SECTOR_SIZE &&
+	       (memcmp(dskImage.data(), "T98HDDIMAGE.R0", 14) == 0 ||
+	        memcmp(dskImage.data(), "\353\376\220MSX_IDE ", 11) == 0);
+}
+
+/** Find the start of the given partition in dskImage
+ * returns: pointer to the partition boot sector, nullptr if the partition
+ *          isn't valid or lies outside the image
+ */
+uint8_t* findPartition(int chPartition)
+{
+	// 64-bit, partitions can start beyond 4GB in large HD/CF card images
+	uint64_t offset;
+	if (memcmp(dskImage.data(), "T98HDDIMAGE.R0", 14) == 0) {
+		if (dskImage.size() < 0x400 + 31 * 16) return nullptr;
+		// 0x110 size of the header(long), cylinder(long),
+		// surface(uint16_t), sector(uint16_t), secsize(uint16_t)
+		PRT_DEBUG("T98header recognized");
+		int surf = getLE16(dskImage.data() + 0x110 + 8);
+		int sec = getLE16(dskImage.data() + 0x110 + 10);
+		int sSize = getLE16(dskImage.data() + 0x110 + 12);
+
+		const auto* p98 = reinterpret_cast<const PC98Part*>(
+			dskImage.data() + 0x400 + (chPartition * 16));
+		int sCyl = getLE16(p98->startCyl);
+
+		offset = 0x200 + uint64_t(sSize) * sCyl * surf * sec;
+	} else {
+		if (memcmp(dskImage.data(), "\353\376\220MSX_IDE ", 11) != 0) {
+			std::cout << "Not an idefdisk compatible 0 sector\n";
+			return nullptr;
+		}
+		const auto* p = reinterpret_cast<const Partition*>(dskImage.data() + 14 + (30 - chPartition) * 16);
+		if (p->start4 == 0) {
+			return nullptr;
+		}
+		offset = uint64_t(SECTOR_SIZE) * p->start4;
+	}
+	if (offset + SECTOR_SIZE > dskImage.size()) {
+		PRT_DEBUG("Partition " << chPartition << " lies outside the image");
+		return nullptr;
+	}
+	return dskImage.data() + offset;
+}
+
+/**routine to make FSImage point to the correct part of dskImage
+ * returns: true if successful, false if partition isn't valid
+ */
+bool chPart(int chPartition)
+{
+	uint8_t* partition = findPartition(chPartition);
+	if (!partition) {
+		return false;
+	}
+	fsImage = partition;
+	readBootSector();
+	if (availableSectors() <= uint64_t(rootDirEnd)) {
+		// not even the FATs and the root directory are in the image
+		PRT_DEBUG("Partition " << chPartition << " is truncated");
+		return false;
+	}
+	return true;
+}
+
+// routine to update the global vars: MSXchrootSector, MSXchrootStartIndex
+void chroot(std::string_view newRootDir)
+{
+	if (newRootDir.starts_with('/') || newRootDir.starts_with('\\')) {
+		// absolute path, reset msxChrootSector
+		msxChrootSector = rootDirStart;
+		StringOp::trimLeft(newRootDir, "/\\");
+	}
+
+	while (!newRootDir.empty()) {
+		auto [firstPart, lastPart] = StringOp::splitOnFirst(newRootDir, "/\\");
+		newRootDir = lastPart;
+		StringOp::trimLeft(newRootDir, "/\\");
+
+		// find firstPart directory or create it
+		MsxName simple = MsxName::fromHost(firstPart);
+		if (auto* msxDirEntry = findEntryInDir(simple, msxChrootSector, msxChrootStartIndex)) {
+			msxChrootSector = subdirSector(msxDirEntry);
+			msxChrootStartIndex = 2;
+			if (msxChrootSector == 0) {
+				CRITICAL_ERROR("Corrupt directory entry " << firstPart);
+			}
+		} else {
+			// creat new subdir
+			int td[2];
+			hostTimeToFat(time(nullptr), td);
+
+			std::cout << "Create subdir\n";
+			msxChrootSector = addMSXSubdir(simple, td[0], td[1], msxChrootSector);
+			msxChrootStartIndex = 2;
+			if (msxChrootSector == 0) {
+				exit(0);
+			}
+		}
+	}
+}
+
+// A file to extract, see finishExtraction()
+struct ExtractFile {
+	std::string hostName;
+	const MSXDirEntry* dirEntry;
+	std::vector<iovec> extents; // the file data in the image, in file order
+	size_t size;                // total size of 'extents'
+};
+std::vector<ExtractFile> extractFiles;
+// extracted directories, in walk order (parents before their subdirs), their
+// times are set by finishExtraction()
+std::vector<std::pair<std::string, const MSXDirEntry*>> extractDirs;
+
+/** Add extracting the file 'dirEntry' to 'resultFile' to the plan, only its
+ * extents are looked up now, finishExtraction() reads and writes the data
+ */
+void fileExtract(const std::string& resultFile, const MSXDirEntry* dirEntry)
+{
+	ExtractFile file{resultFile, dirEntry, {}, 0};
+	withClusterMath([&](auto math) {
+		long size = dirEntry->size;
+		unsigned cluster = dirEntry->startCluster;
+		int sector = (cluster >= 2 && cluster <= unsigned(maxCluster)) ? math.toSector(cluster) : 0;
+		while (size && sector) {
+			auto saveSize = (size > SECTOR_SIZE ? SECTOR_SIZE : size);
+			appendIovec(file.extents, sectorData(sector), saveSize);
+			file.size += saveSize;
+			size -= saveSize;
+			sector = math.nextSector(sector);
+		}
+		if (sector == 0 && size != 0) {
+			std::cout << "no more sectors for file but file not ended ???\n";
+		}
+	});
+	extractFiles.push_back(std::move(file));
+}
+
+/** Write the planned files with blocking calls, in a single pass over the
+ * image in ascending order: every extent is written at its offset in its
+ * file when its turn comes. At most MAX_OPEN files are open at the same
+ * time, a file is closed (and gets its time) after its last extent.
+ * returns: false if a file couldn't be written, the other files are still
+ *          extracted
+ */
+bool extractFilesInImageOrder()
+{
+	struct Piece {
+		const uint8_t* data;
+		size_t size;
+		off_t offset;  // in the host file
+		uint32_t file; // index in extractFiles
+	};
+	std::vector<Piece> pieces;
+	std::vector<uint32_t> piecesLeft(extractFiles.size());
+	for (uint32_t i = 0; i < extractFiles.size(); ++i) {
+		off_t offset = 0;
+		for (const auto& v : extractFiles[i].extents) {
+			pieces.push_back({static_cast<const uint8_t*>(v.iov_base), v.iov_len, offset, i});
+			offset += v.iov_len;
+		}
+		piecesLeft[i] = uint32_t(extractFiles[i].extents.size());
+	}
+	std::ranges::stable_sort(pieces, std::less<>(), &Piece::data);
+
+	constexpr size_t MAX_OPEN = 64;
+	std::vector<int> fds(extractFiles.size(), -1);
+	std::vector<bool> created(extractFiles.size());
+	std::vector<bool> failed(extractFiles.size());
+	std::deque<uint32_t> openFiles; // oldest first, may hold closed files
+	bool ok = true;
+	auto openFile = [&](uint32_t i) {
+		const auto& name = extractFiles[i].hostName;
+		while (openFiles.size() >= MAX_OPEN) {
+			uint32_t oldest = openFiles.front();
+			openFiles.pop_front();
+			if (fds[oldest] >= 0) {
+				close(fds[oldest]);
+				fds[oldest] = -1;
+			}
+		}
+		int flags = created[i] ? O_WRONLY : (O_WRONLY | O_CREAT | O_TRUNC);
+		fds[i] = open(name.c_str(), flags | O_CLOEXEC, 0666);
+		if (fds[i] < 0) {
+			std::cout << "Couldn't open " << name << " for writing: " << strerror(errno) << '\n';
+			failed[i] = true;
+			ok = false;
+			return;
+		}
+		created[i] = true;
+		openFiles.push_back(i);
+	};
+	auto finishFile = [&](uint32_t i) {
+		if (fds[i] >= 0) {
+			close(fds[i]);
+			fds[i] = -1;
+		}
+		if (!failed[i]) changeTime(extractFiles[i].hostName, extractFiles[i].dirEntry);
+	};
+
+	// empty files have nothing to read
+	for (uint32_t i = 0; i < extractFiles.size(); ++i) {
+		if (piecesLeft[i] == 0) {
+			openFile(i);
+			finishFile(i);
+		}
+	}
+	dskImage.adviseSequential();
+	for (const auto& p : pieces) {
+		uint32_t i = p.file;
+		if (!failed[i] && fds[i] < 0) openFile(i);
+		if (!failed[i] && pwrite(fds[i], p.data, p.size, p.offset) != ssize_t(p.size)) {
+			std::cout << "Error while writing " << extractFiles[i].hostName << '\n';
+			failed[i] = true;
+			ok = false;
+		}
+		if (--piecesLeft[i] == 0) finishFile(i);
+	}
+	return ok;
+}
+
+/** Complete an extraction: write the planned files so that the image is
+ * read in (mostly) ascending order instead of in directory order, which
+ * turns the reads from a slow backing store into one sequential pass (the
+ * image of a read-only command is mapped, not read up front, see
+ * readImageFile()). With io_uring the files are queued in the order of
+ * their first cluster. Directory times are set last, deepest first, because
+ * creating the files in them changes those times again.
+ * returns: false if a file couldn't be written
+ */
+bool finishExtraction()
+{
+	bool ok = true;
+	if (hostRing) {
+		auto firstData = [](const ExtractFile& f) -> const void* {
+			return f.extents.empty() ? nullptr : f.extents.front().iov_base;
+		};
+		std::ranges::stable_sort(extractFiles, std::less<>(), firstData);
+		dskImage.adviseSequential();
+		for (auto& f : extractFiles) {
+			queueHostIo({f.hostName, f.hostName, AT_FDCWD, const_cast<MSXDirEntry*>(f.dirEntry),
+			             std::move(f.extents), f.size, true});
+		}
+		flushHostIo();
+	} else {
+		ok = extractFilesInImageOrder();
+	}
+	extractFiles.clear();
+
+	for (auto it = extractDirs.rbegin(); it != extractDirs.rend(); ++it) {
+		changeTime(it->first, it->second);
+	}
+	extractDirs.clear();
+	return ok;
+}
+
+/** Call 'visit(path, dirEntry)' for every entry in the directory starting
+ * at 'sector' and (recursively) in its subdirectories, except for '.' and
+ * '..' and volume labels. Subdirectories are only entered when 'visit'
+ * returns true for them. 'path' is used as scratch buffer, 'visit' may use
+ * it as well but must leave it unchanged.
+ */
+template<typename Visit>
+void walkDir(std::string& path, int sector, Visit&& visit, int depth = 0)
+{
+	size_t pathLen = path.size();
+	withClusterMath([&](auto math) {
+		// protect against cyclic directory chains in corrupt images
+		int sectorsLeft = (maxCluster + 1) * sectorsPerCluster;
+		while (sector != 0 && sectorsLeft--) {
+			auto* entries = reinterpret_cast<MSXDirEntry*>(sectorData(sector));
+			for (int i = 0; i < NUM_OF_ENT; ++i) {
+				MSXDirEntry* dirEntry = &entries[i];
+				uint8_t first = dirEntry->filename[0];
+				if (first == 0xe5 || first == 0x00 || first == '.' ||
+				    (dirEntry->attrib & T_MSX_VOL)) {
+					continue;
+				}
+				if (pathLen) path += '/';
+				path += condenseName(dirEntry);
+				unsigned cluster = dirEntry->startCluster;
+				if (visit(path, dirEntry) &&
+				    (dirEntry->attrib & T_MSX_DIR) && depth < 64 &&
+				    cluster >= 2 && cluster <= unsigned(maxCluster)) {
+					walkDir(path, math.toSector(cluster), visit, depth + 1);
+				}
+				path.resize(pathLen);
+			}
+			sector = math.nextSector(sector);
+		}
+	});
+}
+
+/** Call 'func(data, size)' for each cluster sized chunk of a file, in file
+ * order, directly on the image data
+ * returns: false if the cluster chain ends before the end of the file
+ */
+template<typename Func>
+bool forEachFileChunk(const MSXDirEntry* dirEntry, Func&& func)
+{
+	size_t size = dirEntry->size;
+	withClusterMath([&](auto math) {
+		size_t clusterSize = math.clusterSize();
+		unsigned cluster = dirEntry->startCluster;
+		unsigned count = 0;
+		while (size && cluster >= 2 && cluster <= unsigned(maxCluster) &&
+		       count++ < unsigned(maxCluster)) {
+			size_t chunk = std::min(size, clusterSize);
+			func(sectorData(math.toSector(cluster)), chunk);
+			size -= chunk;
+			cluster = readFAT(cluster);
+		}
+	});
+	return size == 0;
+}
+
+/** Append the contents of a file to 'buf'
+ * returns: false if the cluster chain ends before the end of the file
+ */
+bool readFileData(const MSXDirEntry* dirEntry, std::vector<uint8_t>& buf)
+{
+	return forEachFileChunk(dirEntry, [&](const uint8_t* data, size_t size) {
+		buf.insert(buf.end(), data, data + size);
+	});
+}
+
+/** Count the clusters in the FAT chain starting at 'cluster', corrupt
+ * (cyclic) chains are cut off at the number of clusters on the disk
+ */
+unsigned countClusters(unsigned cluster)
+{
+	unsigned count = 0;
+	while (cluster >= 2 && cluster <= unsigned(maxCluster) &&
+	       count < unsigned(maxCluster)) {
+		++count;
+		cluster = readFAT(cluster);
+	}
+	return count;
+}
+
+/** Write a string field, quoted/escaped as needed for the list format
+ */
+void writeListField(std::string_view str)
+{
+	static constexpr char hex[] = "0123456789abcdef";
+	switch (listFormat) {
+	case ListFormat::NDJSON:
+		listOutput.write('"');
+		for (char c : str) {
+			auto u = uint8_t(c);
+			if (c == '"' || c == '\\') {
+				listOutput.write('\\');
+				listOutput.write(c);
+			} else if (u < 0x20 || u >= 0x7f) {
+				// also escape bytes that would make the line invalid UTF-8
+				listOutput.write("\\u00");
+				listOutput.write(hex[u >> 4]);
+				listOutput.write(hex[u & 15]);
+			} else {
+				listOutput.write(c);
+			}
+		}
+		listOutput.write('"');
+		break;
+	case ListFormat::CSV:
+		listOutput.write('"');
+		for (char c : str) {
+			if (c == '"') listOutput.write('"');
+			listOutput.write(c);
+		}
+		listOutput.write('"');
+		break;
+	case ListFormat::TSV:
+		for (char c : str) {
+			switch (c) {
+			case '\t': listOutput.write("\\t"); break;
+			case '\n': listOutput.write("\\n"); break;
+			case '\r': listOutput.write("\\r"); break;
+			case '\\': listOutput.write("\\\\"); break;
+			default:   listOutput.write(c); break;
+			}
+		}
+		break;
+	case ListFormat::TEXT:
+		listOutput.write(str);
+		break;
+	}
+}
+
+/** Print the column names for the CSV and TSV list formats
+ */
+void printListHeader()
+{
+	if (listFormat == ListFormat::CSV) {
+		listOutput.write("partition,path,name,attrib,size,time,cluster,clusters\n");
+	} else if (listFormat == ListFormat::TSV) {
+		listOutput.write("partition\tpath\tname\tattrib\tsize\ttime\tcluster\tclusters\n");
+	}
+}
+
+/** Print one dir entry in a machine readable list format
+ */
+void printListEntry(std::string_view path, const MSXDirEntry* dirEntry)
+{
+	path.remove_prefix(std::min(listPathSkip, path.size()));
+
+	// the 8.3 name as stored on disk, e.g. "COMMAND2.COM"
+	char name[8 + 1 + 3];
+	int len = 0;
+	for (int i = 0; i < 8 && dirEntry->filename[i] != ' '; ++i) {
+		name[len++] = dirEntry->filename[i];
+	}
+	if (dirEntry->ext[0] != ' ') {
+		name[len++] = '.';
+		for (int i = 0; i < 3 && dirEntry->ext[i] != ' '; ++i) {
+			name[len++] = dirEntry->ext[i];
+		}
+	}
+
+	unsigned clusters = countClusters(dirEntry->startCluster);
+	unsigned time = dirEntry->time;
+	unsigned date = dirEntry->date;
+
+	char sep = (listFormat == ListFormat::CSV) ? ',' : '\t';
+	bool json = listFormat == ListFormat::NDJSON;
+	auto key = [&](std::string_view jsonKey) {
+		if (json) {
+			listOutput.write(jsonKey);
+		} else {
+			listOutput.write(sep);
+		}
+	};
+
+	if (json) listOutput.write("{\"partition\":");
+	if (currentPartition >= 0) {
+		listOutput.writeUInt(currentPartition);
+	} else if (json) {
+		listOutput.write("null");
+	}
+	key(",\"path\":");
+	writeListField(path);
+	key(",\"name\":");
+	writeListField(std::string_view(name, len));
+	key(",\"attrib\":");
+	listOutput.writeUInt(dirEntry->attrib);
+	key(",\"size\":");
+	listOutput.writeUInt((dirEntry->attrib & T_MSX_DIR) ? 0 : uint32_t(dirEntry->size));
+	key(",\"time\":");
+	if (json) listOutput.write('"');
+	listOutput.writeUInt(((date & 0xfe00) >> 9) + 1980, 4);
+	listOutput.write('-');
+	listOutput.writeUInt((date & 0x01e0) >> 5, 2);
+	listOutput.write('-');
+	listOutput.writeUInt(date & 0x1f, 2);
+	listOutput.write('T');
+	listOutput.writeUInt((time & 0xf800) >> 11, 2);
+	listOutput.write(':');
+	listOutput.writeUInt((time & 0x03e0) >> 5, 2);
+	listOutput.write(':');
+	listOutput.writeUInt((time & 0x1f) << 1, 2);
+	if (json) listOutput.write('"');
+	key(",\"cluster\":");
+	listOutput.writeUInt(dirEntry->startCluster);
+	key(",\"clusters\":");
+	listOutput.writeUInt(clusters);
+	listOutput.write(json ? "}\n" : "\n");
+}
+
+/** List and/or extract a single dir entry, for a directory only the
+ * directory itself is created, not its contents (nor its time, see
+ * finishExtraction())
+ */
+void extractEntry(const std::string& fullName, const MSXDirEntry* dirEntry)
+{
+	if (listFormat != ListFormat::TEXT) {
+		if (verboseOption) printListEntry(fullName, dirEntry);
+	} else {
+		int td[2];
+		td[0] = dirEntry->time;
+		td[1] = dirEntry->date;
+
+		tm mTim;
+		makeTimeFromDE(&mTim, td);
+
+		char tsBuf[80];
+		snprintf(tsBuf, sizeof(tsBuf), "%04d/%02d/%02d %02d:%02d:%02d",
+		        mTim.tm_year + 1900, mTim.tm_mon + 1, mTim.tm_mday,
+		        mTim.tm_hour, mTim.tm_min, mTim.tm_sec);
+
+		char osBuf[256];
+		if (dirEntry->attrib & T_MSX_DIR) {
+			sprintf(osBuf, "%-32s %s %12s", fullName.c_str(), tsBuf, "<dir>");
+		} else {
+			sprintf(osBuf, "%-32s %s %12d", fullName.c_str(), tsBuf, uint32_t(dirEntry->size));
+		}
+		PRT_VERBOSE(osBuf);
+	}
+
+	if (!doExtract) return;
+	const std::string& hostName = hostPathFor(fullName);
+	if (dirEntry->attrib & T_MSX_DIR) {
+		mkdir_ex(hostName.c_str());
+		extractDirs.emplace_back(hostName, dirEntry);
+	} else {
+		fileExtract(hostName, dirEntry);
+	}
+}
+
+/** Walk a directory (and its subdirs) listing and/or extracting all entries
+ * 'path' is used as a scratch buffer, it's restored on return
+ */
+void recurseDirExtract(std::string& path, int sector)
+{
+	walkDir(path, sector, [](const std::string& fullName, const MSXDirEntry* dirEntry) {
+		if (pathFilter.skips(fullName, dirEntry->attrib & T_MSX_DIR)) return false;
+		extractEntry(fullName, dirEntry);
+		return true;
+	});
+}
+
+void recurseDirExtract(std::string_view dirName, int sector)
+{
+	std::string path(dirName);
+	recurseDirExtract(path, sector);
+}
+
+/** Read the disk image file into memory
+ * returns: false if the file couldn't be read
+ */
+bool readImageFile(const std::string& fileName)
+{
+	// only commands that modify the image complete interrupted updates
+	if (trackImageChanges && !replayJournal(fileName)) return false;
+	if (!trackImageChanges) {
+		struct stat jst;
+		std::string jName = journalName(fileName);
+		if (stat(jName.c_str(), &jst) == 0 && S_ISREG(jst.st_mode)) {
+			std::cout << "Warning: " << fileName << " has an unfinished update ("
+			          << jName << "), it may be inconsistent until a command "
+			             "that modifies it completes the update\n";
+		}
+	}
+
+	// open file for reading
+	PRT_DEBUG("open file for reading: " << fileName);
+	FILE* file = fopen(fileName.c_str(), "rb");
+	if (!file) {
+		return false;
+	}
+	// don't read while an update is written in place
+	while (flock(fileno(file), LOCK_SH) != 0 && errno == EINTR) {}
+	struct stat& fst = imageFileStat;
+	if (fstat(fileno(file), &fst) != 0) {
+		fclose(file);
+		return false;
+	}
+	size_t fsize = fst.st_size;
+
+	// an image that isn't modified is mapped, it's then only read where
+	// (and in the order) it's used; the mapping keeps the lock
+	if (!trackImageChanges) {
+		int fd = dup(fileno(file));
+		if (fd >= 0 && dskImage.map(fd, fsize)) {
+			fclose(file);
+			fsImage = dskImage.data();
+			imageBlockHashes.clear();
+			return true;
+		}
+		if (fd >= 0) close(fd);
+	}
+	dskImage.clear();
+	dskImage.resize(fsize);
+	fsImage = dskImage.data();
+
+	bool ok = fread(dskImage.data(), 1, fsize, file) == fsize;
+	fclose(file);
+	imageBlockHashes.clear();
+	if (ok && trackImageChanges) hashImageBlocks();
+	return ok;
+}
+
+void readDSK(const std::string& fileName)
+{
+	// First read the disk image into memory
+	if (!readImageFile(fileName)) {
+		CRITICAL_ERROR("Couldn't read " << fileName);
+	}
+
+	// Assuming normal disk image means reading boot sector
+	if (!msxPartOption) {
+		if (isHDImage()) {
+			CRITICAL_ERROR("Please specify a partition to use!");
+		}
+		readBootSector();
+	}
+}
+
+/** All path arguments of an extract/list command, compiled once so that
+ * they can be matched during a single walk over the directory tree.
+ * Arguments without wildcards (the common case when thousands of files are
+ * selected) are looked up in hash sets, only the real patterns are globbed.
+ */
+struct PathMatcher {
+	struct Pattern {
+		std::string arg;                // as given on the command line
+		std::string pattern;            // normalized, components joined by '/'
+		std::vector<std::string> parts; // the components
+		int matches = 0;
+	};
+	std::vector<Pattern> patterns;
+	int unmatched = 0; // patterns without matches
+
+	explicit PathMatcher(std::span<const std::string> args)
+	{
+		for (const auto& arg : args) {
+			Pattern p;
+			p.arg = arg;
+			std::string work = arg;
+			std::replace(work.begin(), work.end(), '\\', '/');
+			std::string_view rest = work;
+			while (!rest.empty()) {
+				StringOp::trimLeft(rest, '/');
+				auto [part, tail] = StringOp::splitOnFirst(rest, '/');
+				rest = tail;
+				if (part.empty() || part == ".") continue;
+				p.parts.push_back(normalize(part));
+				if (!p.pattern.empty()) p.pattern += '/';
+				p.pattern += p.parts.back();
+			}
+			size_t i = patterns.size();
+			if (Glob::hasWildcards(p.pattern)) {
+				globs.push_back(i);
+			} else {
+				std::string key = upper(p.pattern);
+				for (auto slash = key.find('/'); slash != std::string::npos;
+				     slash = key.find('/', slash + 1)) {
+					literalParents.insert(key.substr(0, slash));
+				}
+				literals[std::move(key)].push_back(i);
+			}
+			patterns.push_back(std::move(p));
+		}
+		unmatched = int(patterns.size());
+	}
+
+	// Names without wildcards are matched in their 8.3 form (like before
+	// wildcards were supported), so a long host name finds its MSX file
+	[[nodiscard]] static std::string normalize(std::string_view part)
+	{
+		if (Glob::hasWildcards(part)) return std::string(part);
+		return std::string(MsxName::fromHost(part).condensed());
+	}
+
+	// Lookup key, matching is case insensitive (as in Glob)
+	[[nodiscard]] static std::string upper(std::string_view path)
+	{
+		std::string result(path);
+		for (auto& c : result) c = char(toupper(static_cast<unsigned char>(c)));
+		return result;
+	}
+
+	// Is 'path' (or one of its parents) selected?
+	bool matches(std::string_view path)
+	{
+		bool result = false;
+		auto count = [&](Pattern& p) {
+			if (p.matches++ == 0) --unmatched;
+			result = true;
+		};
+		if (!literals.empty()) {
+			if (auto it = literals.find(upper(path)); it != literals.end()) {
+				for (size_t i : it->second) count(patterns[i]);
+			}
+		}
+		for (size_t i : globs) {
+			if (Glob::match(patterns[i].pattern, path)) count(patterns[i]);
+		}
+		return result;
+	}
+
+	// Is 'path' named without wildcards in one of the arguments (itself or
+	// as one of the parent directories)?
+	[[nodiscard]] bool isLiteral(std::string_view path) const
+	{
+		if (literals.empty()) return false;
+		std::string key = upper(path);
+		return literals.contains(key) || literalParents.contains(key);
+	}
+
+	// Can a selected entry be found below the directory 'dirPath'?
+	[[nodiscard]] bool mayContain(std::string_view dirPath) const
+	{
+		if (!literalParents.empty() && literalParents.contains(upper(dirPath))) return true;
+		for (size_t g : globs) {
+			const auto& p = patterns[g];
+			std::string_view rest = dirPath;
+			size_t i = 0;
+			bool ok = true;
+			while (ok && !rest.empty()) {
+				auto [comp, tail] = StringOp::splitOnFirst(rest, '/');
+				rest = tail;
+				if (i == p.parts.size()) {
+					ok = false;
+				} else if (p.parts[i].find("**") != std::string::npos) {
+					return true;
+				} else {
+					ok = Glob::match(p.parts[i++], comp);
+				}
+			}
+			if (ok && i < p.parts.size()) return true;
+		}
+		return false;
+	}
+
+private:
+	std::unordered_map<std::string, std::vector<size_t>> literals; // upper(pattern) -> patterns
+	std::unordered_set<std::string> literalParents; // upper() of their parent dirs
+	std::vector<size_t> globs; // patterns with wildcards
+};
+
+/** Create the host directories leading to 'path', for a selection these
+ * parent directories aren't extracted themselves
+ */
+void createParentDirs(std::string& path)
+{
+	static std::string lastParent;
+	auto parent = StringOp::splitOnLast(path, '/').first;
+	if (parent.empty() || parent == lastParent) return;
+	lastParent = parent;
+	for (size_t pos = path.find('/'); pos != std::string::npos; pos = path.find('/', pos + 1)) {
+		path[pos] = '\0';
+		mkdir_ex(path.c_str());
+		path[pos] = '/';
+	}
+}
+
+/** Call 'func(path, dirEntry)' for all entries selected by 'args' (and
+ * everything below selected directories), or for all entries below the
+ * current msx root dir if 'args' is empty. All arguments are handled in a
+ * single walk over the directory tree. All entries are filtered with
+ * pathFilter, except the ones named literally (without wildcards) in 'args'.
+ */
+template<typename Func>
+void forEachSelectedEntry(std::span<const std::string> args, std::string& path, Func&& func)
+{
+	auto all = [&](std::string& fullName, const MSXDirEntry* dirEntry) {
+		if (pathFilter.skips(fullName, dirEntry->attrib & T_MSX_DIR)) return false;
+		func(fullName, dirEntry);
+		return true;
+	};
+	if (args.empty()) {
+		walkDir(path, msxChrootSector, all);
+		return;
+	}
+	size_t pathLen = path.size();
+	PathMatcher matcher(args);
+	auto relativeName = [&](std::string_view fullName) {
+		return fullName.substr(std::min(fullName.size(), pathLen ? pathLen + 1 : 0));
+	};
+	// inside a selected dir, only to find arguments that are also selected
+	// by it (e.g. 'dir dir/file'), so that they aren't reported as missing
+	auto below = [&](std::string& fullName, const MSXDirEntry* dirEntry) {
+		if (!all(fullName, dirEntry)) return false;
+		if (matcher.unmatched) matcher.matches(relativeName(fullName));
+		return true;
+	};
+	walkDir(path, msxChrootSector, [&](std::string& fullName, const MSXDirEntry* dirEntry) {
+		std::string_view relative = relativeName(fullName);
+		bool isDir = dirEntry->attrib & T_MSX_DIR;
+		if (!matcher.isLiteral(relative) && pathFilter.skips(fullName, isDir)) return false;
+		if (matcher.matches(relative)) {
+			func(fullName, dirEntry);
+			if (isDir) {
+				walkDir(fullName, subdirSector(dirEntry), below);
+			}
+			return false;
+		}
+		return matcher.mayContain(relative);
+	});
+	for (const auto& p : matcher.patterns) {
+		if (p.matches == 0) {
+			std::cerr << "Couldn't find " << p.arg << '\n';
+		}
+	}
+}
+
+void doSpecifiedExtraction(std::span<const std::string> args)
+{
+	std::string path;
+	forEachSelectedEntry(args, path, [](std::string& fullName, const MSXDirEntry* dirEntry) {
+		if (doExtract) {
+			std::string hostName = hostPathFor(fullName);
+			createParentDirs(hostName);
+		}
+		extractEntry(fullName, dirEntry);
+	});
+}
+
+/** Fill a tar header field with a zero padded, NUL terminated octal number
+ */
+void tarOctal(char* field, size_t len, uint64_t val)
+{
+	field[--len] = '\0';
+	while (len--) {
+		field[len] = char('0' + (val & 7));
+		val >>= 3;
+	}
+}
+
+/** Write a POSIX ustar header for 'name'
+ * returns: false if the name doesn't fit in the header
+ */
+bool writeTarHeader(OutputBuffer& out, std::string_view name, char type,
+                    uint64_t size, time_t mtime, unsigned mode)
+{
+	char h[512] = {};
+	// names longer than 100 characters are split over 'prefix' and 'name'
+	std::string_view prefix;
+	if (name.size() > 100) {
+		size_t pos = name.find('/', name.size() - 101);
+		if (pos == std::string_view::npos || pos > 155) return false;
+		prefix = name.substr(0, pos);
+		name = name.substr(pos + 1);
+	}
+	memcpy(h +   0, name.data(), name.size());
+	tarOctal(h + 100,  8, mode);
+	tarOctal(h + 108,  8, 0); // uid
+	tarOctal(h + 116,  8, 0); // gid
+	tarOctal(h + 124, 12, size);
+	tarOctal(h + 136, 12, std::max<time_t>(mtime, 0));
+	memset  (h + 148, ' ', 8); // checksum is computed with spaces here
+	h[156] = type;
+	memcpy(h + 257, "ustar", 6);
+	memcpy(h + 263, "00", 2);
+	memcpy(h + 345, prefix.data(), prefix.size());
+	unsigned sum = 0;
+	for (char c : h) sum += uint8_t(c);
+	tarOctal(h + 148, 7, sum);
+	h[155] = ' ';
+	out.write(h, sizeof(h));
+	return true;
+}
+
+/** Write one (selected) entry to the tar stream, file data is copied
+ * straight from the clusters in the image
+ */
+void exportTarEntry(OutputBuffer& out, std::string& name, const MSXDirEntry* dirEntry)
+{
+	if (verboseOption) std::cerr << name << '\n';
+	time_t mtime = fatToHostTime(dirEntry);
+	if (dirEntry->attrib & T_MSX_DIR) {
+		name += '/';
+		bool ok = writeTarHeader(out, name, '5', 0, mtime, 0755);
+		name.pop_back();
+		if (!ok) std::cerr << name << ": name too long for tar, skipped\n";
+		return;
+	}
+	uint32_t size = dirEntry->size;
+	unsigned mode = (dirEntry->attrib & T_MSX_READ) ? 0444 : 0644;
+	if (!writeTarHeader(out, name, '0', size, mtime, mode)) {
+		std::cerr << name << ": name too long for tar, skipped\n";
+		return;
+	}
+	uint64_t written = 0;
+	if (!forEachFileChunk(dirEntry, [&](const uint8_t* data, size_t len) {
+		out.write(data, len);
+		written += len;
+	})) {
+		std::cerr << name << ": no more sectors for file but file not ended, padded with zeros\n";
+	}
+	// pad the data (and a possibly truncated file) up to the 512 byte block
+	static constexpr char zeros[512] = {};
+	uint64_t total = (uint64_t(size) + 511) & ~uint64_t(511);
+	while (written < total) {
+		size_t len = std::min<uint64_t>(total - written, sizeof(zeros));
+		out.write(zeros, len);
+		written += len;
+	}
+}
+
+/** Write the selected entries of the current partition as tar stream,
+ * all names get 'prefix' prepended
+ */
+void exportTar(OutputBuffer& out, std::span<const std::string> args, std::string prefix)
+{
+	forEachSelectedEntry(args, prefix, [&](std::string& name, const MSXDirEntry* dirEntry) {
+		exportTarEntry(out, name, dirEntry);
+	});
+}
+
+/** Terminate the tar stream
+ */
+void endTar(OutputBuffer& out)
+{
+	static constexpr char zeros[2 * 512] = {};
+	out.write(zeros, sizeof(zeros));
+	out.flush();
+}
+// A file or directory collected from the source image by collectCopyItems()
+struct CopyItem {
+	std::string path; // relative to the root of the source image
+	MSXDirEntry entry;
+	std::vector<uint8_t> data;
+};
+
+/** Collect (a copy of) the entries selected by 'args' and their file data
+ * from the current image/partition
+ */
+std::vector<CopyItem> collectCopyItems(std::span<const std::string> args)
+{
+	std::vector<CopyItem> items;
+	std::string path;
+	forEachSelectedEntry(args, path, [&](std::string& fullName, const MSXDirEntry* dirEntry) {
+		CopyItem& item = items.emplace_back(fullName, *dirEntry);
+		if (!(item.entry.attrib & T_MSX_DIR)) {
+			item.data.reserve(dirEntry->size);
+			if (!readFileData(dirEntry, item.data)) {
+				std::cout << fullName << ": cluster chain too short, file truncated\n";
+				item.entry.size = item.data.size();
+			}
+		}
+	});
+	return items;
+}
+
+/** Allocate a chain of 'count' clusters. The first free run that is large
+ * enough is used, searching from 'hint' onwards, if there is no such run the
+ * free clusters are used in order.
+ * returns: the first cluster of the chain, or 0 if the disk is full
+ */
+unsigned allocateClusters(unsigned count, unsigned& hint)
+{
+	unsigned first = 0;
+	for (int pass = 0; pass < 2 && !first; ++pass) {
+		unsigned start = pass ? 2 : hint;
+		unsigned end = pass ? hint : unsigned(maxCluster) + 1;
+		unsigned run = 0;
+		for (unsigned cl = start; cl < end; ++cl) {
+			run = readFAT(cl) ? 0 : run + 1;
+			if (run == count) {
+				first = cl + 1 - count;
+				break;
+			}
+		}
+	}
+	std::vector<unsigned> chain;
+	chain.reserve(count);
+	if (first) {
+		for (unsigned i = 0; i < count; ++i) chain.push_back(first + i);
+	} else {
+		for (unsigned cl = 2; cl <= unsigned(maxCluster) && chain.size() < count; ++cl) {
+			if (!readFAT(cl)) chain.push_back(cl);
+		}
+		if (chain.size() < count) return 0;
+	}
+	for (unsigned i = 0; i + 1 < count; ++i) {
+		writeFAT(chain[i], chain[i + 1]);
+	}
+	writeFAT(chain.back(), EOF_FAT);
+	hint = chain.back() + 1;
+	return chain.front();
+}
+
+/** Write collected entries to the current image/partition, below the current
+ * msx root dir. Timestamps and attributes are preserved, existing files are
+ * only overwritten when 'keep' is false.
+ */
+void copyItems(std::span<const CopyItem> items, bool keep)
+{
+	std::unordered_map<std::string, int> dirSectors;
+	unsigned hint = 2;
+	size_t clusterSize = sectorsPerCluster * SECTOR_SIZE;
+	for (const auto& item : items) {
+		const MSXDirEntry& src = item.entry;
+		auto [dirPath, name] = StringOp::splitOnLast(item.path, '/');
+		int sector = addSubdirPath(dirPath, src.time, src.date, dirSectors);
+		if (sector < 0) continue;
+		MsxName msxName = MsxName::fromRaw(src.filename);
+		uint8_t index = (sector == msxChrootSector) ? msxChrootStartIndex : 0;
+
+		if (src.attrib & T_MSX_DIR) {
+			if (addSubdirPath(item.path, src.time, src.date, dirSectors) >= 0) {
+				if (auto* dirEntry = findEntryInDir(msxName, sector, index)) {
+					dirEntry->attrib = src.attrib;
+				}
+			}
+			continue;
+		}
+
+		bool exists;
+		msxName = chooseMSXName(msxName, item.path, sector, exists);
+		auto* dirEntry = exists ? findEntryInDir(msxName, sector, index) : nullptr;
+		if (dirEntry && ((dirEntry->attrib & T_MSX_DIR) || keep)) {
+			PRT_VERBOSE("Preserving entry " << item.path);
+			continue;
+		}
+		if (dirEntry) {
+			freeClusterChain(dirEntry->startCluster);
+		} else {
+			PhysDirEntry result = addEntryToDir(sector);
+			if (result.index >= NUM_OF_ENT) {
+				std::cout << "couldn't add entry" << item.path << '\n';
+				continue;
+			}
+			dirEntry = reinterpret_cast<MSXDirEntry*>(
+				sectorData(result.sector) + 32 * result.index);
+		}
+		PRT_VERBOSE(item.path);
+		MSXDirEntry entry = src;
+		memcpy(&entry, msxName.data(), 11);
+
+		unsigned count = (item.data.size() + clusterSize - 1) / clusterSize;
+		unsigned first = count ? allocateClusters(count, hint) : 0;
+		*dirEntry = entry;
+		dirEntry->startCluster = first;
+		if (count && !first) {
+			std::cout << "Disk image full: " << item.path << " not copied\n";
+			dirEntry->filename[0] = 0xE5;
+			continue;
+		}
+		size_t offset = 0;
+		for (unsigned cl = first; offset < item.data.size(); cl = readFAT(cl)) {
+			size_t chunk = std::min(clusterSize, item.data.size() - offset);
+			memcpy(sectorData(clusterToSector(cl)), item.data.data() + offset, chunk);
+			offset += chunk;
+		}
+	}
+}
+
+/** State shared by the file system checks done for '--verify'
+ */
+struct VerifyState {
+	std::string image;
+	int partition = -1;          // -1 for a plain disk image
+	bool repair = false;
+	std::vector<uint32_t> owner; // per cluster: id of the chain using it, 0 if unused
+	std::vector<uint16_t> chain; // the (valid part of the) last walked chain
+	uint32_t chainId = 0;
+	std::string path;            // entry currently being checked
+	bool modified = false;       // the current partition needs to be written back
+	int problems = 0;
+	int unrepaired = 0;
+	int unreadable = 0;
+};
+
+/** Report a problem as one tab separated line:
+ *   image  partition  check  path  cluster  detail
+ */
+void reportProblem(VerifyState& v, std::string_view check, unsigned cluster,
+                   std::string_view detail, bool repaired)
+{
+	++v.problems;
+	if (repaired) {
+		v.modified = true;
+	} else {
+		++v.unrepaired;
+	}
+	std::cout << v.image << '\t';
+	if (v.partition < 0) {
+		std::cout << '-';
+	} else {
+		std::cout << v.partition;
+	}
+	std::cout << '\t' << check
+	          << '\t' << (v.path.empty() ? "/" : v.path)
+	          << '\t' << cluster
+	          << '\t' << detail << (repaired ? " repaired" : "") << '\n';
+}
+
+/** Sanity check the boot sector before readBootSector() starts using it
+ * returns: nullptr if OK, otherwise a short description of the problem
+ */
+const char* checkBootSector()
+{
+	uint64_t available = availableSectors();
+	if (available == 0) return "no_boot_sector";
+
+	const auto* boot = reinterpret_cast<const MSXBootSector*>(fsImage);
+	unsigned nbSectors = boot->nrSectors;
+	if (nbSectors == 0) {
+		nbSectors = Endian::read_UA_L32(fsImage + BOOT_LARGE_SECTORS);
+	}
+	unsigned spc = boot->spCluster;
+	if (boot->bpSector != SECTOR_SIZE) return "bytes_per_sector";
+	if (spc == 0 || (spc & (spc - 1)) != 0) return "sectors_per_cluster";
+	if (boot->nrFats == 0 || boot->sectorsFat == 0) return "fat_size";
+	if (boot->dirEntries == 0 || (boot->dirEntries % NUM_OF_ENT) != 0) return "root_entries";
+	unsigned dataStart = 1 + boot->nrFats * boot->sectorsFat + boot->dirEntries / NUM_OF_ENT;
+	if (nbSectors < dataStart + spc) return "too_few_sectors";
+	if (nbSectors > available) return "image_truncated";
+	return nullptr;
+}
+
+enum class ChainEnd { END, OUT_OF_RANGE, FREE, CYCLIC, CROSS_LINKED };
+
+/** Follow the FAT chain starting at 'cluster' and claim its clusters for a
+ * new chain id. Stops at the end of the chain or at the first problem,
+ * 'bad' is then the offending cluster. The valid part is left in v.chain.
+ */
+ChainEnd walkChain(VerifyState& v, unsigned cluster, unsigned& bad)
+{
+	v.chain.clear();
+	++v.chainId;
+	while (true) {
+		bad = cluster;
+		if (cluster < 2 || cluster > unsigned(maxCluster)) return ChainEnd::OUT_OF_RANGE;
+		if (v.owner[cluster] == v.chainId) return ChainEnd::CYCLIC;
+		if (v.owner[cluster] != 0) return ChainEnd::CROSS_LINKED;
+		v.owner[cluster] = v.chainId;
+		v.chain.push_back(cluster);
+		unsigned next = readFAT(cluster);
+		if (next == EOF_FAT) return ChainEnd::END;
+		if (next == 0) return ChainEnd::FREE;
+		cluster = next;
+	}
+}
+
+/** Walk the chain of a dir entry, on problems it is cut off after the last
+ * valid cluster when repairing
+ * returns: false if the entry has no usable cluster at all
+ */
+bool checkChain(VerifyState& v, MSXDirEntry& entry)
+{
+	unsigned bad;
+	ChainEnd end = walkChain(v, entry.startCluster, bad);
+	if (end == ChainEnd::END) return true;
+
+	const char* check = "";
+	switch (end) {
+	case ChainEnd::OUT_OF_RANGE: check = "out_of_range"; break;
+	case ChainEnd::FREE:         check = "free_in_chain"; break;
+	case ChainEnd::CYCLIC:       check = "cyclic_chain"; break;
+	case ChainEnd::CROSS_LINKED: check = "cross_linked"; break;
+	case ChainEnd::END:          break;
+	}
+	if (v.repair) {
+		if (v.chain.empty()) {
+			entry.startCluster = 0;
+		} else {
+			writeFAT(v.chain.back(), EOF_FAT);
+		}
+	}
+	reportProblem(v, check, bad, "after " + std::to_string(v.chain.size()) + " clusters", v.repair);
+	return !v.chain.empty();
+}
+
+/** Compare the file size with the length of its cluster chain
+ */
+void checkFile(VerifyState& v, MSXDirEntry& entry)
+{
+	v.chain.clear();
+	if (entry.startCluster != 0) {
+		checkChain(v, entry);
+	}
+	uint64_t clusterSize = sectorsPerCluster * SECTOR_SIZE;
+	uint32_t size = entry.size;
+	size_t have = v.chain.size();
+	size_t needed = (size + clusterSize - 1) / clusterSize;
+	// msxtar itself allocates one cluster for empty files, MSX-DOS none
+	if (size == 0 && have == 1) needed = 1;
+	if (have == needed) return;
+
+	unsigned start = entry.startCluster;
+	if (v.repair) {
+		if (have > needed) {
+			// release the clusters beyond the end of the file
+			if (needed == 0) {
+				entry.startCluster = 0;
+			} else {
+				writeFAT(v.chain[needed - 1], EOF_FAT);
+			}
+			for (size_t i = needed; i < have; ++i) {
+				writeFAT(v.chain[i], 0);
+				v.owner[v.chain[i]] = 0;
+			}
+		} else {
+			entry.size = have * clusterSize;
+		}
+	}
+	reportProblem(v, "size_mismatch", start,
+	              "size=" + std::to_string(size) + " clusters=" + std::to_string(have),
+	              v.repair);
+}
+
+/** Check the '.' or '..' entry at the start of a subdirectory
+ */
+void checkDotEntry(VerifyState& v, MSXDirEntry& entry, const char* name, unsigned cluster)
+{
+	if (memcmp(entry.filename, name, 11) == 0 && (entry.attrib & T_MSX_DIR) &&
+	    entry.startCluster == cluster) {
+		return;
+	}
+	// only rewrite the entry if that doesn't destroy some other entry
+	bool canRepair = v.repair &&
+		(memcmp(entry.filename, name, 11) == 0 ||
+		 entry.filename[0] == 0x00 || entry.filename[0] == 0xe5);
+	if (canRepair) {
+		memcpy(entry.filename, name, 11);
+		entry.attrib = T_MSX_DIR;
+		entry.startCluster = cluster;
+	}
+	reportProblem(v, name[1] == '.' ? "bad_dotdot" : "bad_dot",
+	              cluster, "", canRepair);
+}
+
+/** Check a directory and everything below it, 'cluster' is 0 for the root
+ * directory, otherwise v.chain must hold the chain of this directory
+ */
+void checkDirectory(VerifyState& v, unsigned cluster, unsigned parentCluster, int depth)
+{
+	std::vector<int> sectors;
+	if (cluster == 0) {
+		for (int s = rootDirStart; s <= rootDirEnd; ++s) {
+			sectors.push_back(s);
+		}
+	} else {
+		for (auto cl : v.chain) {
+			for (int j = 0; j < sectorsPerCluster; ++j) {
+				sectors.push_back(clusterToSector(cl) + j);
+			}
+		}
+		auto* dots = reinterpret_cast<MSXDirEntry*>(sectorData(sectors[0]));
+		checkDotEntry(v, dots[0], ".          ", cluster);
+		checkDotEntry(v, dots[1], "..         ", parentCluster);
+	}
+	if (depth > 64) {
+		reportProblem(v, "too_deep", cluster, "", false);
+		return;
+	}
+
+	size_t pathLen = v.path.size();
+	for (int sector : sectors) {
+		auto* entries = reinterpret_cast<MSXDirEntry*>(sectorData(sector));
+		for (int i = 0; i < NUM_OF_ENT; ++i) {
+			MSXDirEntry& entry = entries[i];
+			if (entry.filename[0] == 0x00 || entry.filename[0] == 0xe5 ||
+			    entry.filename[0] == '.' || (entry.attrib & T_MSX_VOL)) {
+				continue;
+			}
+			v.path += '/';
+			v.path += condenseName(&entry);
+			if (!(entry.attrib & T_MSX_DIR)) {
+				checkFile(v, entry);
+			} else if (entry.startCluster == 0) {
+				if (v.repair) entry.filename[0] = 0xe5;
+				reportProblem(v, "out_of_range", 0, "directory without clusters", v.repair);
+			} else if (checkChain(v, entry)) {
+				checkDirectory(v, entry.startCluster, cluster, depth + 1);
+			} else if (v.repair) {
+				// nothing left of this directory
+				entry.filename[0] = 0xe5;
+			}
+			v.path.resize(pathLen);
+		}
+	}
+}
+
+/** Report (and free) runs of allocated clusters not used by any entry
+ */
+void checkLostClusters(VerifyState& v)
+{
+	uint16_t badCluster = fat16 ? 0xFFF7 : 0x0FF7;
+	auto isLost = [&](unsigned cl) {
+		uint16_t val = readFAT(cl);
+		return val != 0 && val != badCluster && v.owner[cl] == 0;
+	};
+	v.path.clear();
+	unsigned cl = 2;
+	while (cl <= unsigned(maxCluster)) {
+		if (!isLost(cl)) {
+			++cl;
+			continue;
+		}
+		unsigned first = cl;
+		while (cl <= unsigned(maxCluster) && isLost(cl)) {
+			if (v.repair) writeFAT(cl, 0);
+			++cl;
+		}
+		reportProblem(v, "lost_clusters", first,
+		              "count=" + std::to_string(cl - first), v.repair);
+	}
+}
+
+/** Check if all FAT copies are identical, they're synced when writing
+ */
+void checkFATCopies(VerifyState& v)
+{
+	const auto* boot = reinterpret_cast<const MSXBootSector*>(fsImage);
+	size_t fatSize = boot->sectorsFat * SECTOR_SIZE;
+	for (int i = 1; i < boot->nrFats; ++i) {
+		if (memcmp(fsImage + SECTOR_SIZE, fsImage + SECTOR_SIZE + i * fatSize, fatSize) != 0) {
+			reportProblem(v, "fat_copy_mismatch", 0,
+			              "copy=" + std::to_string(i), v.repair);
+		}
+	}
+}
+
+/** Check the file system that fsImage points to
+ */
+void verifyPartition(VerifyState& v)
+{
+	v.path.clear();
+	if (const char* problem = checkBootSector()) {
+		reportProblem(v, "bad_boot_sector", 0, problem, false);
+		return;
+	}
+	readBootSector();
+
+	v.owner.assign(maxCluster + 1, 0);
+	v.chainId = 0;
+	bool modified = v.modified;
+	v.modified = false;
+	checkFATCopies(v); // before any repair touches the first FAT
+	checkDirectory(v, 0, 0, 0);
+	checkLostClusters(v);
+	if (v.modified) {
+		syncFATCopies();
+	}
+	v.modified |= modified;
+}
+
+/** Check all partitions in the given image, repaired images are written back
+ */
+void verifyImage(VerifyState& v, const std::string& fileName)
+{
+	v.image = fileName;
+	v.partition = -1;
+	v.modified = false;
+	v.path.clear();
+	int problems = v.problems;
+
+	if (!readImageFile(fileName)) {
+		++v.unreadable;
+		reportProblem(v, "unreadable", 0, "", false);
+		return;
+	}
+	if (isHDImage()) {
+		for (int partition = 0; partition < 31; ++partition) {
+			if (uint8_t* start = findPartition(partition)) {
+				fsImage = start;
+				v.partition = partition;
+				verifyPartition(v);
+			}
+		}
+		v.partition = -1;
+	} else {
+		fsImage = dskImage.data();
+		verifyPartition(v);
+	}
+	if (v.modified && !writeImageToDisk(fileName)) {
+		// none of the repairs were saved
+		v.unrepaired += v.problems - problems;
+	}
+	if (v.problems == problems) {
+		std::cout << fileName << "\t-\tok\t/\t0\t\n";
+	}
+}
+
+/** Verify (and possibly repair) a list of images
+ * returns: an fsck-like exit status, 0 if everything was clean, 1 if
+ *          problems were repaired, 4 if problems remain, 8 if an image
+ *          couldn't be read
+ */
+int verifyImages(std::span<const std::string> images, bool repair)
+{
+	VerifyState v;
+	v.repair = repair;
+	trackImageChanges = repair;
+	for (const auto& image : images) {
+		verifyImage(v, image);
+	}
+	int status = 0;
+	if (v.problems > v.unrepaired) status |= 1;
+	if (v.unrepaired) status |= 4;
+	if (v.unreadable) status |= 8;
+	return status;
+}
+
+/** Catalog of the contents of one image, used to answer queries without
+ * opening the image itself
+ */
+struct CatalogEntry {
+	uint32_t pathOffset; // in CatalogImage::paths
+	uint16_t pathLen;
+	uint8_t partition;   // 0xff for a plain disk image
+	uint8_t attrib;
+	uint16_t time;
+	uint16_t date;
+	uint16_t cluster;
+	uint32_t size;
+	uint64_t hash;       // XXH64 of the file contents, 0 for directories
+};
+struct CatalogImage {
+	std::string image;
+	// the image this catalog was made for
+	uint64_t size = 0;
+	int64_t mtime = 0;
+	uint64_t hash = 0;   // XXH64 of the whole image
+	std::string paths;   // pool with the paths of all entries
+	std::vector<CatalogEntry> entries;
+};
+
+/* A catalog file holds any number of CatalogImage records, all numbers are
+ * little endian:
+ *   "MSXTARC1"
+ *   per image:
+ *     u16 name length, name, u64 size, s64 mtime, u64 hash,
+ *     u32 number of entries, u32 size of the path pool, path pool,
+ *     per entry: u32 path offset, u16 path length, u8 partition, u8 attrib,
+ *                u16 time, u16 date, u16 start cluster, u32 size, u64 hash
+ */
+static constexpr char CATALOG_MAGIC[8] = {'M', 'S', 'X', 'T', 'A', 'R', 'C', '1'};
+static constexpr size_t CATALOG_ENTRY_SIZE = 26;
+
+/** Read a catalog file
+ * returns: the images in the catalog, empty if the file doesn't exist or
+ *          is corrupt (it will then be rebuilt)
+ */
+std::vector<CatalogImage> readCatalog(const std::string& fileName)
+{
+	std::vector<CatalogImage> result;
+	FILE* file = fopen(fileName.c_str(), "rb");
+	if (!file) return result;
+	std::vector<uint8_t> data;
+	uint8_t buf[65536];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), file)) > 0) {
+		data.insert(data.end(), buf, buf + n);
+	}
+	fclose(file);
+
+	const uint8_t* p = data.data();
+	const uint8_t* end = p + data.size();
+	auto have = [&](size_t len) { return size_t(end - p) >= len; };
+	if (!have(8) || memcmp(p, CATALOG_MAGIC, 8) != 0) {
+		PRT_DEBUG("Ignoring invalid catalog " << fileName);
+		return result;
+	}
+	p += 8;
+	while (p != end) {
+		CatalogImage cat;
+		if (!have(2)) return {};
+		size_t nameLen = Endian::read_UA_L16(p); p += 2;
+		if (!have(nameLen + 24 + 8)) return {};
+		cat.image.assign(reinterpret_cast<const char*>(p), nameLen); p += nameLen;
+		cat.size  = Endian::read_UA_L64(p); p += 8;
+		cat.mtime = Endian::read_UA_L64(p); p += 8;
+		cat.hash  = Endian::read_UA_L64(p); p += 8;
+		size_t nbEntries = Endian::read_UA_L32(p); p += 4;
+		size_t poolSize  = Endian::read_UA_L32(p); p += 4;
+		if (!have(poolSize) || !have(poolSize + nbEntries * CATALOG_ENTRY_SIZE)) return {};
+		cat.paths.assign(reinterpret_cast<const char*>(p), poolSize); p += poolSize;
+		cat.entries.resize(nbEntries);
+		for (auto& e : cat.entries) {
+			e.pathOffset = Endian::read_UA_L32(p +  0);
+			e.pathLen    = Endian::read_UA_L16(p +  4);
+			e.partition  = p[6];
+			e.attrib     = p[7];
+			e.time       = Endian::read_UA_L16(p +  8);
+			e.date       = Endian::read_UA_L16(p + 10);
+			e.cluster    = Endian::read_UA_L16(p + 12);
+			e.size       = Endian::read_UA_L32(p + 14);
+			e.hash       = Endian::read_UA_L64(p + 18);
+			p += CATALOG_ENTRY_SIZE;
+			if (size_t(e.pathOffset) + e.pathLen > poolSize) return {};
+		}
+		result.push_back(std::move(cat));
+	}
+	return result;
+}
+
+/** Write a catalog file, via a temporary file so a crash never leaves a
+ * half written catalog behind
+ */
+void writeCatalog(const std::string& fileName, std::span<const CatalogImage> catalog)
+{
+	std::vector<uint8_t> data(CATALOG_MAGIC, CATALOG_MAGIC + 8);
+	for (const auto& cat : catalog) {
+		size_t pos = data.size();
+		size_t len = 2 + cat.image.size() + 32 + cat.paths.size() +
+		             cat.entries.size() * CATALOG_ENTRY_SIZE;
+		data.resize(pos + len);
+		uint8_t* p = data.data() + pos;
+		Endian::write_UA_L16(p, cat.image.size()); p += 2;
+		memcpy(p, cat.image.data(), cat.image.size()); p += cat.image.size();
+		Endian::write_UA_L64(p, cat.size);  p += 8;
+		Endian::write_UA_L64(p, cat.mtime); p += 8;
+		Endian::write_UA_L64(p, cat.hash);  p += 8;
+		Endian::write_UA_L32(p, cat.entries.size()); p += 4;
+		Endian::write_UA_L32(p, cat.paths.size());   p += 4;
+		memcpy(p, cat.paths.data(), cat.paths.size()); p += cat.paths.size();
+		for (const auto& e : cat.entries) {
+			Endian::write_UA_L32(p +  0, e.pathOffset);
+			Endian::write_UA_L16(p +  4, e.pathLen);
+			p[6] = e.partition;
+			p[7] = e.attrib;
+			Endian::write_UA_L16(p +  8, e.time);
+			Endian::write_UA_L16(p + 10, e.date);
+			Endian::write_UA_L16(p + 12, e.cluster);
+			Endian::write_UA_L32(p + 14, e.size);
+			Endian::write_UA_L64(p + 18, e.hash);
+			p += CATALOG_ENTRY_SIZE;
+		}
+	}
+	std::string tmpName = fileName + ".tmp";
+	FILE* file = fopen(tmpName.c_str(), "wb");
+	if (!file) {
+		std::cout << "Couldn't open " << tmpName << " for writing!\n";
+		return;
+	}
+	bool ok = fwrite(data.data(), 1, data.size(), file) == data.size();
+	ok &= fclose(file) == 0;
+	if (!ok || rename(tmpName.c_str(), fileName.c_str()) != 0) {
+		std::cout << "Couldn't write catalog " << fileName << '\n';
+		remove(tmpName.c_str());
+	}
+}
+
+/** (Re)build the catalog entries by reading the image
+ * returns: false if the image couldn't be read
+ */
+bool indexImage(CatalogImage& cat)
+{
+	PRT_VERBOSE("Indexing " << cat.image);
+	cat.paths.clear();
+	cat.entries.clear();
+	if (!readImageFile(cat.image)) return false;
+	cat.size = dskImage.size();
+	cat.hash = Hash::xxh64(dskImage.data(), dskImage.size());
+
+	std::vector<uint8_t> data;
+	std::string path;
+	auto indexPartition = [&](uint8_t partition) {
+		if (checkBootSector()) return; // not a usable file system
+		readBootSector();
+		walkDir(path, rootDirStart, [&](std::string_view entryPath, const MSXDirEntry* dirEntry) {
+			CatalogEntry e;
+			e.pathOffset = cat.paths.size();
+			e.pathLen = entryPath.size();
+			e.partition = partition;
+			e.attrib = dirEntry->attrib;
+			e.time = dirEntry->time;
+			e.date = dirEntry->date;
+			e.cluster = dirEntry->startCluster;
+			e.size = (dirEntry->attrib & T_MSX_DIR) ? 0 : uint32_t(dirEntry->size);
+			e.hash = 0;
+			if (!(dirEntry->attrib & T_MSX_DIR)) {
+				data.clear();
+				readFileData(dirEntry, data);
+				e.hash = Hash::xxh64(data.data(), data.size());
+			}
+			cat.paths += entryPath;
+			cat.entries.push_back(e);
+			return true;
+		});
+	};
+	if (isHDImage()) {
+		for (int partition = 0; partition < 31; ++partition) {
+			if (uint8_t* start = findPartition(partition)) {
+				fsImage = start;
+				indexPartition(partition);
+			}
+		}
+	} else {
+		fsImage = dskImage.data();
+		indexPartition(0xff);
+	}
+	return true;
+}
+
+/** Make sure the catalog matches the current image, the image is only read
+ * when its size or modification time changed
+ * returns: false if the image no longer exists
+ */
+bool refreshCatalogImage(CatalogImage& cat, bool& changed)
+{
+	struct stat fst;
+	if (stat(cat.image.c_str(), &fst) != 0) {
+		changed = true;
+		return false;
+	}
+	if (uint64_t(fst.st_size) == cat.size && int64_t(fst.st_mtime) == cat.mtime) {
+		return true;
+	}
+	changed = true;
+	if (uint64_t(fst.st_size) == cat.size && !cat.entries.empty() && readImageFile(cat.image) &&
+	    Hash::xxh64(dskImage.data(), dskImage.size()) == cat.hash) {
+		// only touched, contents didn't change
+		cat.mtime = fst.st_mtime;
+		return true;
+	}
+	cat.mtime = fst.st_mtime;
+	return indexImage(cat);
+}
+
+/** Load a catalog and bring it up to date for the given images, or for all
+ * images in the catalog when 'images' is empty
+ * returns: the images in the catalog, stale entries are rebuilt, entries for
+ *          images that no longer exist are dropped
+ */
+std::vector<CatalogImage> loadCatalog(const std::string& catalogName,
+                                      std::span<const std::string> images)
+{
+	auto catalog = readCatalog(catalogName);
+	bool changed = false;
+	for (const auto& image : images) {
+		if (std::none_of(catalog.begin(), catalog.end(),
+		                 [&](const CatalogImage& c) { return c.image == image; })) {
+			CatalogImage cat;
+			cat.image = image;
+			cat.size = uint64_t(-1); // force indexing
+			catalog.push_back(std::move(cat));
+		}
+	}
+	std::erase_if(catalog, [&](CatalogImage& cat) {
+		bool wanted = images.empty() ||
+		              std::find(images.begin(), images.end(), cat.image) != images.end();
+		if (!wanted) return false;
+		if (refreshCatalogImage(cat, changed)) return false;
+		std::cout << "Couldn't read " << cat.image << ", removed from catalog\n";
+		return true;
+	});
+	if (changed) {
+		writeCatalog(catalogName, catalog);
+	}
+	return catalog;
+}
+
+/** Print all catalog entries matching the query, one tab separated line
+ * per entry: image, partition, path, size, hash
+ * A query is either 'hash:<hex>' or a (wildcard) pattern. A pattern with a
+ * '/' is matched against the full path, otherwise only against the name.
+ * returns: the number of matching entries
+ */
+int queryCatalog(std::span<const CatalogImage> catalog, std::string_view query)
+{
+	std::optional<uint64_t> hash;
+	if (query.starts_with("hash:")) {
+		hash = strtoull(std::string(query.substr(5)).c_str(), nullptr, 16);
+	}
+	bool fullPath = query.find('/') != std::string_view::npos;
+	StringOp::trimLeft(query, '/');
+
+	int matches = 0;
+	for (const auto& cat : catalog) {
+		for (const auto& e : cat.entries) {
+			std::string_view path(cat.paths.data() + e.pathOffset, e.pathLen);
+			bool match;
+			if (hash) {
+				match = !(e.attrib & T_MSX_DIR) && e.hash == *hash;
+			} else {
+				std::string_view name = fullPath ? path : StringOp::splitOnLast(path, '/').second;
+				match = Glob::match(query, name);
+			}
+			if (!match) continue;
+			++matches;
+			listOutput.write(cat.image);
+			listOutput.write('\t');
+			if (e.partition == 0xff) {
+				listOutput.write('-');
+			} else {
+				listOutput.writeUInt(e.partition);
+			}
+			listOutput.write('\t');
+			listOutput.write(path);
+			if (e.attrib & T_MSX_DIR) listOutput.write('/');
+			listOutput.write('\t');
+			listOutput.writeUInt(e.size);
+			listOutput.write('\t');
+			listOutput.writeHex(e.hash, 16);
+			listOutput.write('\n');
+		}
+	}
+	listOutput.flush();
+	return matches;
+}
+
+/** Handle --index and --query. Without '--catalog' every image gets its own
+ * catalog file next to it (the image name with '.msxcat' appended)
+ * returns: exit code, for queries 1 if nothing matched
+ */
+int doCatalog(const std::string& catalogName, std::span<const std::string> images,
+              const std::optional<std::string>& query)
+{
+	int matches = 0;
+	if (!catalogName.empty()) {
+		auto catalog = loadCatalog(catalogName, images);
+		if (query) matches = queryCatalog(catalog, *query);
+	} else {
+		for (const auto& image : images) {
+			auto catalog = loadCatalog(image + ".msxcat", std::span{&image, 1});
+			if (query) matches += queryCatalog(catalog, *query);
+		}
+	}
+	return (query && matches == 0) ? 1 : 0;
+}
+
+// A file or directory of the original image, see diffImages()
+struct DiffEntry {
+	MSXDirEntry entry;
+	uint64_t chainHash; // XXH64 of the clusters of the FAT chain
+	bool seen = false;  // also present in the new image
+};
+
+/** Hash the list of clusters in the FAT chain starting at 'cluster', to
+ * notice files that were moved without changing their dir entry
+ */
+uint64_t chainHash(unsigned cluster)
+{
+	std::vector<uint16_t> chain;
+	while (cluster >= 2 && cluster <= unsigned(maxCluster) &&
+	       chain.size() < size_t(maxCluster)) {
+		chain.push_back(uint16_t(cluster));
+		cluster = readFAT(cluster);
+	}
+	return Hash::xxh64(chain.data(), chain.size() * sizeof(uint16_t));
+}
+
+/** Does the FAT chain starting at 'cluster' contain a changed sector?
+ * 'dirty' has a flag per sector of the whole image
+ */
+bool chainIsDirty(unsigned cluster, const std::vector<bool>& dirty)
+{
+	size_t fsSector = (fsImage - dskImage.data()) / SECTOR_SIZE;
+	unsigned count = 0;
+	while (cluster >= 2 && cluster <= unsigned(maxCluster) && count++ < unsigned(maxCluster)) {
+		size_t sector = fsSector + clusterToSector(cluster);
+		for (int i = 0; i < sectorsPerCluster; ++i) {
+			if (sector + i < dirty.size() && dirty[sector + i]) return true;
+		}
+		cluster = readFAT(cluster);
+	}
+	return false;
+}
+
+/** Collect the entries of the file system that fsImage points to, paths
+ * start with 'prefix'
+ */
+void collectDiffEntries(std::string_view prefix, std::vector<std::string>& order,
+                        std::unordered_map<std::string, DiffEntry>& entries)
+{
+	if (checkBootSector()) return;
+	readBootSector();
+	std::string path(prefix);
+	walkDir(path, rootDirStart, [&](const std::string& p, const MSXDirEntry* dirEntry) {
+		order.push_back(p);
+		entries[p] = {*dirEntry, chainHash(dirEntry->startCluster)};
+		return true;
+	});
+}
+
+/** Compare the file system that fsImage points to with the entries of the
+ * original image, print a line per added (A), modified (M) or deleted (D)
+ * file
+ * returns: the number of printed lines
+ */
+int diffEntries(std::string_view prefix, const std::vector<std::string>& order,
+                std::unordered_map<std::string, DiffEntry>& entries,
+                const std::vector<bool>& dirty)
+{
+	int changes = 0;
+	auto report = [&](char what, std::string_view path, const MSXDirEntry& dirEntry) {
+		std::cout << what << '\t' << path << ((dirEntry.attrib & T_MSX_DIR) ? "/\n" : "\n");
+		++changes;
+	};
+	if (!checkBootSector()) {
+		readBootSector();
+		std::string path(prefix);
+		walkDir(path, rootDirStart, [&](const std::string& p, const MSXDirEntry* dirEntry) {
+			auto it = entries.find(p);
+			if (it == entries.end()) {
+				report('A', p, *dirEntry);
+				return true;
+			}
+			DiffEntry& old = it->second;
+			old.seen = true;
+			if (!(dirEntry->attrib & T_MSX_DIR) &&
+			    (memcmp(&old.entry, dirEntry, sizeof(MSXDirEntry)) != 0 ||
+			     old.chainHash != chainHash(dirEntry->startCluster) ||
+			     chainIsDirty(dirEntry->startCluster, dirty))) {
+				report('M', p, *dirEntry);
+			}
+			return true;
+		});
+	}
+	for (const auto& p : order) {
+		if (!entries[p].seen) report('D', p, entries[p].entry);
+	}
+	return changes;
+}
+
+/* A patch file made by '--diff --patch=FILE' holds the changed sectors of
+ * an image, all numbers are little endian:
+ *   "MSXPTCH1"
+ *   u64 size and u64 XXH64 of the original image
+ *   u64 size and u64 XXH64 of the new image
+ *   u32 number of extents
+ *   per extent: u64 offset, u32 length, data
+ *   u64 XXH64 of all of the above
+ */
+static constexpr char PATCH_MAGIC[8] = {'M', 'S', 'X', 'P', 'T', 'C', 'H', '1'};
+static constexpr size_t PATCH_HEADER_SIZE = 8 + 32 + 4;
+
+/** Write the sectors of dskImage that are marked in 'dirty' as a patch
+ * for an image with the given size and hash
+ */
+void writePatch(const std::string& fileName, uint64_t oldSize, uint64_t oldHash,
+                const std::vector<bool>& dirty)
+{
+	std::vector<JournalExtent> extents;
+	for (size_t sector = 0; sector < dirty.size(); ++sector) {
+		if (!dirty[sector]) continue;
+		uint64_t offset = uint64_t(sector) * SECTOR_SIZE;
+		auto len = uint32_t(std::min<uint64_t>(SECTOR_SIZE, dskImage.size() - offset));
+		if (!extents.empty() && extents.back().offset + extents.back().length == offset &&
+		    extents.back().length < (1u << 30)) {
+			extents.back().length += len;
+		} else {
+			extents.push_back({offset, len});
+		}
+	}
+
+	std::vector<uint8_t> data(PATCH_HEADER_SIZE);
+	memcpy(data.data(), PATCH_MAGIC, 8);
+	Endian::write_UA_L64(data.data() +  8, oldSize);
+	Endian::write_UA_L64(data.data() + 16, oldHash);
+	Endian::write_UA_L64(data.data() + 24, dskImage.size());
+	Endian::write_UA_L64(data.data() + 32, Hash::xxh64(dskImage.data(), dskImage.size()));
+	Endian::write_UA_L32(data.data() + 40, uint32_t(extents.size()));
+	for (const auto& e : extents) {
+		uint8_t ext[12];
+		Endian::write_UA_L64(ext, e.offset);
+		Endian::write_UA_L32(ext + 8, e.length);
+		data.insert(data.end(), ext, ext + 12);
+		data.insert(data.end(), dskImage.data() + e.offset, dskImage.data() + e.offset + e.length);
+	}
+	uint8_t trailer[8];
+	Endian::write_UA_L64(trailer, Hash::xxh64(data.data(), data.size()));
+	data.insert(data.end(), trailer, trailer + 8);
+
+	std::string tmpName = fileName + ".tmp";
+	FILE* file = fopen(tmpName.c_str(), "wb");
+	if (!file) {
+		CRITICAL_ERROR("Couldn't open " << tmpName << " for writing!");
+	}
+	bool ok = fwrite(data.data(), 1, data.size(), file) == data.size();
+	ok &= fclose(file) == 0;
+	if (!ok || rename(tmpName.c_str(), fileName.c_str()) != 0) {
+		remove(tmpName.c_str());
+		CRITICAL_ERROR("Couldn't write patch " << fileName);
+	}
+	PRT_VERBOSE("Wrote " << extents.size() << " extents (" << data.size()
+	            << " bytes) to " << fileName);
+}
+
+/** Compare two images sector by sector and print the files that changed,
+ * optionally write the changed sectors to a patch file
+ * returns: exit code, 0 if the images are equal, 1 if they differ
+ */
+int diffImages(std::span<const std::string> images, const std::string& patchName)
+{
+	if (images.size() != 2) {
+		CRITICAL_ERROR("--diff needs two images: the original and the new one");
+	}
+	if (!readImageFile(images[0])) {
+		CRITICAL_ERROR("Couldn't read " << images[0]);
+	}
+	ImageData oldImage;
+	std::swap(oldImage, dskImage);
+	if (!readImageFile(images[1])) {
+		CRITICAL_ERROR("Couldn't read " << images[1]);
+	}
+
+	// both images are in memory, comparing is cheaper than hashing
+	size_t nbSectors = (dskImage.size() + SECTOR_SIZE - 1) / SECTOR_SIZE;
+	std::vector<bool> dirty(nbSectors, true);
+	size_t common = std::min(oldImage.size(), dskImage.size());
+	size_t nbDirty = nbSectors;
+	for (size_t offset = 0; offset < common; offset += SECTOR_SIZE) {
+		size_t len = std::min<size_t>(SECTOR_SIZE, common - offset);
+		if (memcmp(oldImage.data() + offset, dskImage.data() + offset, len) == 0 &&
+		    (offset + len < common || oldImage.size() == dskImage.size())) {
+			dirty[offset / SECTOR_SIZE] = false;
+			--nbDirty;
+		}
+	}
+
+	// map the changed sectors to files, per partition for HD images
+	int changes = 0;
+	bool hdImage = isHDImage();
+	auto fsStart = [&](int partition) -> uint8_t* {
+		if (isHDImage() != hdImage) return nullptr;
+		return hdImage ? findPartition(partition) : dskImage.data();
+	};
+	auto diffPartition = [&](int partition, std::string_view prefix) {
+		std::vector<std::string> order;
+		std::unordered_map<std::string, DiffEntry> entries;
+		std::swap(oldImage, dskImage);
+		if (uint8_t* start = fsStart(partition)) {
+			fsImage = start;
+			collectDiffEntries(prefix, order, entries);
+		}
+		std::swap(oldImage, dskImage);
+		uint8_t* start = fsStart(partition);
+		if (!start && order.empty()) return;
+		// without a file system everything of the old one was deleted
+		fsImage = start ? start : dskImage.data() + dskImage.size();
+		changes += diffEntries(prefix, order, entries, dirty);
+	};
+	if (hdImage) {
+		for (int partition = 0; partition < 31; ++partition) {
+			char p[40];
+			sprintf(p, "PARTITION%02i", partition);
+			diffPartition(partition, p);
+		}
+	} else {
+		diffPartition(-1, "");
+	}
+	PRT_VERBOSE(nbDirty << " of " << nbSectors << " sectors differ, "
+	            << changes << " changed files and directories");
+
+	if (!patchName.empty()) {
+		writePatch(patchName, oldImage.size(), Hash::xxh64(oldImage.data(), oldImage.size()), dirty);
+	}
+	return (nbDirty == 0) ? 0 : 1;
+}
+
+/** Apply a patch made by diffImages() to an image, the image must be
+ * the original image of the patch (or already be patched)
+ * returns: false if the patched image couldn't be written
+ */
+bool applyPatch(const std::string& patchName, const std::string& fileName)
+{
+	FILE* file = fopen(patchName.c_str(), "rb");
+	if (!file) {
+		CRITICAL_ERROR("Couldn't read " << patchName);
+	}
+	std::vector<uint8_t> buf;
+	uint8_t tmp[64 * 1024];
+	while (size_t n = fread(tmp, 1, sizeof(tmp), file)) {
+		buf.insert(buf.end(), tmp, tmp + n);
+	}
+	fclose(file);
+	if (buf.size() < PATCH_HEADER_SIZE + 8 || memcmp(buf.data(), PATCH_MAGIC, 8) != 0 ||
+	    Endian::read_UA_L64(buf.data() + buf.size() - 8) !=
+	    Hash::xxh64(buf.data(), buf.size() - 8)) {
+		CRITICAL_ERROR(patchName << " is not a valid patch");
+	}
+	uint64_t oldSize = Endian::read_UA_L64(buf.data() +  8);
+	uint64_t oldHash = Endian::read_UA_L64(buf.data() + 16);
+	uint64_t newSize = Endian::read_UA_L64(buf.data() + 24);
+	uint64_t newHash = Endian::read_UA_L64(buf.data() + 32);
+	uint32_t count   = Endian::read_UA_L32(buf.data() + 40);
+
+	trackImageChanges = true;
+	if (!readImageFile(fileName)) {
+		CRITICAL_ERROR("Couldn't read " << fileName);
+	}
+	uint64_t hash = Hash::xxh64(dskImage.data(), dskImage.size());
+	if (dskImage.size() == newSize && hash == newHash) {
+		std::cout << fileName << " is already patched\n";
+		return true;
+	}
+	if (dskImage.size() != oldSize || hash != oldHash) {
+		CRITICAL_ERROR(fileName << " is not the image " << patchName << " was made for");
+	}
+	if (newSize != oldSize) {
+		// the journal can't change the size, write the whole image instead
+		imageBlockHashes.clear();
+		dskImage.resize(newSize);
+	}
+	size_t pos = PATCH_HEADER_SIZE;
+	size_t end = buf.size() - 8;
+	for (uint32_t i = 0; i < count; ++i) {
+		if (end - pos < 12) {
+			CRITICAL_ERROR(patchName << " is not a valid patch");
+		}
+		uint64_t offset = Endian::read_UA_L64(buf.data() + pos);
+		uint32_t length = Endian::read_UA_L32(buf.data() + pos + 8);
+		pos += 12;
+		if (length > end - pos || offset > newSize || length > newSize - offset) {
+			CRITICAL_ERROR(patchName << " is not a valid patch");
+		}
+		memcpy(dskImage.data() + offset, buf.data() + pos, length);
+		pos += length;
+	}
+	if (Hash::xxh64(dskImage.data(), dskImage.size()) != newHash) {
+		CRITICAL_ERROR("Patching " << fileName << " failed, the image was not modified");
+	}
+	if (!writeImageFile(fileName)) return false;
+	PRT_VERBOSE("Applied " << count << " extents to " << fileName);
+	return true;
+}
+
+/** The bytes to search for with --grep, 'hex:HEX' gives them as hex digits
+ */
+std::string grepPattern(std::string_view arg)
+{
+	if (!arg.starts_with("hex:")) return std::string(arg);
+	arg.remove_prefix(4);
+	if (arg.empty() || (arg.size() % 2) != 0 ||
+	    arg.find_first_not_of("0123456789abcdefABCDEF") != std::string_view::npos) {
+		CRITICAL_ERROR("Invalid hex pattern: " << arg);
+	}
+	std::string result;
+	for (size_t i = 0; i < arg.size(); i += 2) {
+		result += char(std::stoi(std::string(arg.substr(i, 2)), nullptr, 16));
+	}
+	return result;
+}
+
+/** Search the contents of all files in an image, 'out' gets a tab separated
+ * line (image, path, offset) per occurrence
+ * returns: the number of occurrences, -1 if the image couldn't be read
+ */
+int grepImage(const std::string& fileName, ChunkSearch& search, std::string& out)
+{
+	if (!readImageFile(fileName)) {
+		out += "Couldn't read " + fileName + '\n';
+		return -1;
+	}
+	int matches = 0;
+	auto grepPartition = [&](std::string_view prefix) {
+		if (checkBootSector()) return;
+		readBootSector();
+		std::string path(prefix);
+		walkDir(path, rootDirStart, [&](const std::string& p, const MSXDirEntry* dirEntry) {
+			if (dirEntry->attrib & T_MSX_DIR) return true;
+			search.reset();
+			forEachFileChunk(dirEntry, [&](const uint8_t* data, size_t size) {
+				search.feed(data, size, [&](uint64_t offset) {
+					out += fileName + '\t' + p + '\t' + std::to_string(offset) + '\n';
+					++matches;
+				});
+			});
+			return true;
+		});
+	};
+	if (isHDImage()) {
+		for (int partition = 0; partition < 31; ++partition) {
+			if (uint8_t* start = findPartition(partition)) {
+				char p[40];
+				sprintf(p, "PARTITION%02i", partition);
+				fsImage = start;
+				grepPartition(p);
+			}
+		}
+	} else {
+		fsImage = dskImage.data();
+		grepPartition("");
+	}
+	return matches;
+}
+
+/** Search the files in many images, each image is searched by a separate
+ * process (the image state is global), the output stays in image order
+ * returns: exit code as for grep: 0 if found, 1 if not, 2 if an image
+ *          couldn't be read
+ */
+int grepImages(std::span<const std::string> images, std::string_view pattern)
+{
+	ChunkSearch search(grepPattern(pattern));
+	if (search.size() == 0) {
+		CRITICAL_ERROR("Empty search pattern");
+	}
+	bool found = false;
+	bool unreadable = false;
+	auto addResult = [&](int matches) {
+		found |= matches > 0;
+		unreadable |= matches < 0;
+	};
+
+	size_t jobs = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+	if (jobs == 1 || images.size() == 1) {
+		for (const auto& image : images) {
+			std::string out;
+			addResult(grepImage(image, search, out));
+			std::cout << out << std::flush;
+		}
+		return found ? 0 : (unreadable ? 2 : 1);
+	}
+
+	struct Worker {
+		pid_t pid = -1;
+		int fd = -1;
+	};
+	std::vector<Worker> workers(images.size());
+	std::cout.flush(); // don't let the workers inherit buffered output
+	auto startWorker = [&](size_t i) {
+		int fds[2];
+		if (pipe(fds) != 0) return;
+		pid_t pid = fork();
+		if (pid == 0) {
+			close(fds[0]);
+			std::string out;
+			int matches = grepImage(images[i], search, out);
+			for (size_t pos = 0; pos < out.size();) {
+				ssize_t n = write(fds[1], out.data() + pos, out.size() - pos);
+				if (n <= 0) break;
+				pos += n;
+			}
+			_exit(matches > 0 ? 0 : (matches < 0 ? 2 : 1));
+		}
+		close(fds[1]);
+		if (pid < 0) {
+			close(fds[0]);
+			return;
+		}
+		workers[i] = {pid, fds[0]};
+	};
+
+	size_t started = 0;
+	for (size_t i = 0; i < images.size(); ++i) {
+		while (started < images.size() && started < i + jobs) startWorker(started++);
+		Worker& w = workers[i];
+		if (w.pid < 0) {
+			// couldn't start a process, search it here
+			std::string out;
+			addResult(grepImage(images[i], search, out));
+			std::cout << out << std::flush;
+			continue;
+		}
+		char buf[65536];
+		ssize_t n;
+		while ((n = read(w.fd, buf, sizeof(buf))) != 0) {
+			if (n < 0) {
+				if (errno == EINTR) continue;
+				break;
+			}
+			std::cout.write(buf, n);
+		}
+		std::cout.flush();
+		close(w.fd);
+		int status = 0;
+		while (waitpid(w.pid, &status, 0) < 0 && errno == EINTR) {}
+		int code = WIFEXITED(status) ? WEXITSTATUS(status) : 2;
+		addResult(code == 0 ? 1 : (code == 1 ? 0 : -1));
+	}
+	return found ? 0 : (unreadable ? 2 : 1);
+}
+
+// An image kept in memory by the daemon mode (--serve). The contents of the
+// image that is being worked on are swapped into the global 'dskImage'.
+struct ServedImage {
+	ImageData data;
+	std::vector<uint64_t> blockHashes; // see writeImageToDisk()
+	struct stat fileStat;              // to notice changes by other programs
+	bool dirty = false;                // has changes that aren't written yet
+	// per partition (-1 for a plain image): upper case path -> offset of
+	// the dir entry in 'data', built on first use, dropped on any change
+	std::unordered_map<int, std::unordered_map<std::string, size_t>> index;
+};
+std::unordered_map<std::string, ServedImage> servedImages;
+
+// A connection to the daemon, 'in' holds (partial) requests that were not
+// handled yet, 'out' the responses that were not sent yet
+struct ServeClient {
+	int fd;
+	std::string in;
+	std::string out;
+};
+
+volatile sig_atomic_t stopServing = 0;
+
+std::string upperCase(std::string_view str)
+{
+	std::string result(str);
+	for (auto& c : result) c = char(toupper(static_cast<unsigned char>(c)));
+	return result;
+}
+
+/** Get the image 'fileName' from the cache, (re)reading it when it isn't
+ * cached yet or was changed on disk. An image with unwritten changes that
+ * was also changed on disk by another program can't be used anymore, both
+ * versions are kept as they are.
+ * returns: nullptr with 'problem' set if the image can't be used
+ */
+ServedImage* getServedImage(const std::string& fileName, const char*& problem)
+{
+	problem = "can't read image";
+	struct stat st;
+	if (stat(fileName.c_str(), &st) != 0) return nullptr;
+	auto it = servedImages.find(fileName);
+	if (it != servedImages.end()) {
+		if (sameFileState(it->second.fileStat, st)) return &it->second;
+		if (it->second.dirty) {
+			problem = "image changed on disk, unwritten changes conflict";
+			return nullptr;
+		}
+		servedImages.erase(it);
 	}
+	trackImageChanges = true;
+	if (!readImageFile(fileName)) return nullptr;
+	ServedImage& img = servedImages[fileName];
+	img.data = std::move(dskImage);
+	img.blockHashes = std::move(imageBlockHashes);
+	img.fileStat = imageFileStat; // after a possible journal replay
+	return &img;
 }
 
-void makeTimeFromDE(struct tm* ptm, const int* td)
+/** Swap the contents of a served image in and out of 'dskImage'
+ */
+void swapServedImage(ServedImage& img)
 {
-	ptm->tm_sec  = (td[0] & 0x1f) << 1;
-	ptm->tm_min  = (td[0] & 0x03e0) >> 5;
-	ptm->tm_hour = (td[0] & 0xf800) >> 11;
-	ptm->tm_mday = (td[1] & 0x1f);
-	ptm->tm_mon  = (td[1] & 0x01e0) >> 5;
-	ptm->tm_year = ((td[1] & 0xfe00) >> 9) + 80;
+	std::swap(dskImage, img.data);
+	std::swap(imageBlockHashes, img.blockHashes);
+	std::swap(imageFileStat, img.fileStat);
+	fsImage = dskImage.data();
 }
 
-/** Set the entries from dirEntry to the timestamp of resultFile
+/** Write the changes of a served image to disk (through the journal)
+ * returns: false if the image couldn't be written, it then stays dirty
+ *          (compared to what is on disk) so the next flush tries again
  */
-void changeTime(const std::string& resultFile, const MSXDirEntry* dirEntry)
+bool flushServedImage(const std::string& fileName, ServedImage& img)
 {
-	if (touchOption) return;
-
-	int td[2];
-	td[0] = dirEntry->time;
-	td[1] = dirEntry->date;
-
-	struct tm mTim;
-	struct utimbuf uTim;
-	makeTimeFromDE(&mTim, td);
-
-	uTim.actime  = mktime(&mTim);
-	uTim.modtime = mktime(&mTim);
-	utime(resultFile.c_str(), &uTim);
+	if (!img.dirty) return true;
+	swapServedImage(img);
+	bool ok = writeImageFile(fileName);
+	if (ok) hashImageBlocks();
+	swapServedImage(img);
+	if (!ok) return false;
+	img.dirty = false;
+	return true;
 }
 
-void fileExtract(const std::string& resultFile, const MSXDirEntry* dirEntry)
+bool flushServedImages()
 {
-	long size = dirEntry->size;
-	int sector = clusterToSector(dirEntry->startCluster);
+	bool ok = true;
+	for (auto& [name, img] : servedImages) {
+		ok &= flushServedImage(name, img);
+	}
+	return ok;
+}
 
-	FILE* file = fopen(resultFile.c_str(), "wb");
-	if (!file) {
-		CRITICAL_ERROR("Couldn't open file for writing!");
+/** Find the dir entry for (condensed, relative to the root directory) 'path'
+ * in the partition that's swapped in, using the path index
+ */
+MSXDirEntry* findServedEntry(ServedImage& img, int partition, std::string_view path)
+{
+	auto [it, inserted] = img.index.try_emplace(partition);
+	auto& index = it->second;
+	if (inserted) {
+		std::string scratch;
+		walkDir(scratch, rootDirStart, [&](const std::string& p, MSXDirEntry* dirEntry) {
+			index.emplace(upperCase(p), reinterpret_cast<uint8_t*>(dirEntry) - dskImage.data());
+			return true;
+		});
 	}
-	while (size && sector) {
-		uint8_t* buf = fsImage + SECTOR_SIZE * sector;
-		auto saveSize = (size > SECTOR_SIZE ? SECTOR_SIZE : size);
-		fwrite(buf, 1, saveSize, file);
-		size -= saveSize;
-		sector = getNextSector(sector);
+	StringOp::trimLeft(path, '/');
+	StringOp::trimRight(path, '/');
+	auto found = index.find(upperCase(path));
+	return (found == index.end()) ? nullptr
+	     : reinterpret_cast<MSXDirEntry*>(dskImage.data() + found->second);
+}
+
+/** Add (or replace) file 'path' with contents 'data' in the partition that's
+ * swapped in, missing directories are created. For 'update' an existing file
+ * is kept when it's not older than 'mtime'.
+ * returns: an error message, empty on success
+ */
+std::string writeServedFile(std::string_view path, std::string_view data, time_t mtime,
+                            bool update)
+{
+	StringOp::trimLeft(path, '/');
+	int td[2];
+	hostTimeToFat(mtime, td);
+
+	std::unordered_map<std::string, int> dirSectors;
+	auto [dirPath, name] = StringOp::splitOnLast(path, '/');
+	int sector = addSubdirPath(dirPath, td[0], td[1], dirSectors);
+	if (sector < 0) return "can't create directory";
+	if (name.empty()) return "no file name";
+
+	bool exists;
+	MsxName msxName = msxNameFor(name, sector, exists);
+	auto* dirEntry = exists ? findEntryInDir(msxName, sector, 0) : nullptr;
+	if (dirEntry && (dirEntry->attrib & T_MSX_DIR)) return "is a directory";
+	if (dirEntry && update && fatToHostTime(dirEntry) >= mtime) return "";
+	if (!dirEntry) {
+		dirEntry = addFileEntry(msxName, mtime, sector);
+		if (!dirEntry) return "directory full";
 	}
-	if (sector == 0 && size != 0) {
-		std::cout << "no more sectors for file but file not ended ???\n";
+	dirEntry->time = td[0];
+	dirEntry->date = td[1];
+
+	FILE* file = nullptr;
+	if (!data.empty()) {
+		file = fmemopen(const_cast<char*>(data.data()), data.size(), "rb");
+		if (!file) return "out of memory";
 	}
-	fclose(file);
-	// now change the access time
-	changeTime(resultFile, dirEntry);
+	int written = alterFileInDSK(dirEntry, file, int(data.size()), std::string(path));
+	if (file) fclose(file);
+	syncFATCopies();
+	return (size_t(written) == data.size()) ? "" : "disk full, file truncated";
 }
 
-void recurseDirExtract(std::string_view dirName, int sector, int dirEntryIndex)
+/** Handle one request, the response is appended to 'out'
+ * returns: false if the request isn't complete yet (write/update data)
+ */
+bool handleServeRequest(std::string_view request, std::string_view& rest, std::string& out)
 {
-	int i = dirEntryIndex;
-	do {
-		const auto* dirEntry = reinterpret_cast<const MSXDirEntry*>(
-			(fsImage + SECTOR_SIZE * sector) + 32 * i);
-		if (dirEntry->filename[0] != 0xe5 &&
-		    dirEntry->filename[0] != 0x00) {
-			std::string filename = condenseName(dirEntry);
-			std::string fullName = !dirName.empty()
-			                     ? std::string(dirName) + '/' + filename
-			                     : filename;
-			int td[2];
-			td[0] = dirEntry->time;
-			td[1] = dirEntry->date;
+	auto fields = StringOp::split(request, '\t');
+	auto reply = [&](std::string_view payload) {
+		out += "ok " + std::to_string(payload.size()) + '\n';
+		out += payload;
+	};
+	auto error = [&](std::string_view message) {
+		out += "error ";
+		out += message;
+		out += '\n';
+	};
 
-			tm mTim;
-			makeTimeFromDE(&mTim, td);
+	std::string_view cmd = fields[0];
+	if (cmd == "flush" || cmd == "close") {
+		bool ok = true;
+		if (fields.size() == 1) {
+			ok = flushServedImages();
+			if (cmd == "close" && ok) servedImages.clear();
+		} else if (auto it = servedImages.find(std::string(fields[1])); it != servedImages.end()) {
+			ok = flushServedImage(it->first, it->second);
+			if (cmd == "close" && ok) servedImages.erase(it);
+		}
+		if (ok) reply(""); else error("couldn't write the image");
+		return true;
+	}
 
-			char tsBuf[32];
-			sprintf(tsBuf, "%04d/%02d/%02d %02d:%02d:%02d",
-			        mTim.tm_year + 1900, mTim.tm_mon, mTim.tm_mday,
-			        mTim.tm_hour, mTim.tm_min, mTim.tm_sec);
+	bool isWrite = cmd == "write" || cmd == "update";
+	if (fields.size() < (isWrite ? 5 : 4) ||
+	    !(isWrite || cmd == "list" || cmd == "stat" || cmd == "read")) {
+		error("bad request");
+		return true;
+	}
+	std::string_view data;
+	if (isWrite) {
+		size_t size = strtoull(std::string(fields[4]).c_str(), nullptr, 10);
+		if (rest.size() < size) return false;
+		data = rest.substr(0, size);
+		rest.remove_prefix(size);
+	}
 
-			char osBuf[256];
-			if (dirEntry->attrib & T_MSX_DIR) {
-				sprintf(osBuf, "%-32s %s %12s", fullName.c_str(), tsBuf, "<dir>");
+	std::string imageName(fields[1]);
+	const char* problem;
+	ServedImage* img = getServedImage(imageName, problem);
+	if (!img) {
+		error(problem);
+		return true;
+	}
+	swapServedImage(*img);
+	int partition = -1;
+	uint8_t* start = nullptr;
+	if (fields[2] == "-") {
+		if (!isHDImage()) start = dskImage.data();
+	} else {
+		partition = atoi(std::string(fields[2]).c_str());
+		if (isHDImage()) start = findPartition(partition);
+	}
+	if (!start) {
+		swapServedImage(*img);
+		error("no such partition");
+		return true;
+	}
+	fsImage = start;
+	if (checkBootSector()) {
+		swapServedImage(*img);
+		error("not an MSX image");
+		return true;
+	}
+	readBootSector();
+	msxChrootSector = rootDirStart;
+	msxChrootStartIndex = 0;
+	currentPartition = partition;
+	// names chosen for another image (or partition) don't apply to this one
+	dirNames.clear();
+	hostToMsxName.clear();
+	msxToHostName.clear();
+
+	std::string_view path = fields[3];
+	if (isWrite) {
+		time_t mtime = (fields.size() > 5) ? time_t(strtoll(std::string(fields[5]).c_str(), nullptr, 10))
+		                                   : time(nullptr);
+		std::string result = writeServedFile(path, data, mtime, cmd == "update");
+		img->dirty = true;
+		img->index.clear();
+		if (result.empty()) reply(""); else error(result);
+	} else {
+		MSXDirEntry* dirEntry = nullptr;
+		bool root = path.find_first_not_of('/') == std::string_view::npos;
+		if (!root) dirEntry = findServedEntry(*img, partition, path);
+		if (!root && !dirEntry) {
+			error("no such file");
+		} else if (cmd == "read") {
+			std::string contents;
+			if (root || (dirEntry->attrib & T_MSX_DIR)) {
+				error("is a directory");
+			} else if (!forEachFileChunk(dirEntry, [&](const uint8_t* p, size_t len) {
+					contents.append(reinterpret_cast<const char*>(p), len);
+				})) {
+				error("broken cluster chain");
 			} else {
-				sprintf(osBuf, "%-32s %s %12d", fullName.c_str(), tsBuf, uint32_t(dirEntry->size));
-			}
-			PRT_VERBOSE(osBuf);
-
-			if (doExtract && dirEntry->attrib != T_MSX_DIR) {
-				fileExtract(fullName, dirEntry);
+				reply(contents);
 			}
-			if (dirEntry->attrib == T_MSX_DIR) {
-				mkdir_ex(fullName.c_str());
-				// now change the access time
-				changeTime(fullName, dirEntry);
-				recurseDirExtract(
-				        fullName,
-				        clusterToSector(dirEntry->startCluster),
-				        2); // read subdir and skip entries for '.' and '..'
-			}
-		}
-		++i;
-		++dirEntry;
-		if (i == NUM_OF_ENT) {
-			if (sector <= rootDirEnd) {
-				++sector;
-				if (sector > rootDirEnd) {
-					sector = 0;
-				}
+		} else if (cmd == "stat" && root) {
+			error("is the root directory");
+		} else {
+			// 'stat' and 'list' answer in the tsv list format
+			char* buf = nullptr;
+			size_t len = 0;
+			FILE* mem = open_memstream(&buf, &len);
+			listOutput.setFile(mem);
+			StringOp::trimLeft(path, '/');
+			StringOp::trimRight(path, '/');
+			std::string p(path);
+			if (cmd == "stat") {
+				printListEntry(p, dirEntry);
+			} else if (root || (dirEntry->attrib & T_MSX_DIR)) {
+				walkDir(p, root ? rootDirStart : subdirSector(dirEntry),
+				        [](const std::string& entryPath, MSXDirEntry* entry) {
+					printListEntry(entryPath, entry);
+					return false;
+				});
 			} else {
-				sector = getNextSector(sector);
+				printListEntry(p, dirEntry);
 			}
-			i = 0;
-			dirEntry = reinterpret_cast<const MSXDirEntry*>(fsImage + SECTOR_SIZE * sector);
+			listOutput.setFile(stdout);
+			fclose(mem);
+			reply(std::string_view(buf, len));
+			free(buf);
 		}
-	} while (sector != 0);
+	}
+	swapServedImage(*img);
+	return true;
 }
 
-void readDSK(const std::string& fileName)
+void onStopSignal(int /*signal*/)
 {
-	// First read the disk image into memory
-
-	PRT_DEBUG("trying to stat: " << fileName);
-	struct stat fst;
-	stat(fileName.c_str(), &fst);
-	size_t fsize = fst.st_size;
-
-	dskImage.resize(fsize);
-	fsImage = dskImage.data();
-
-	// open file for reading
-	PRT_DEBUG("open file for reading: " << fileName);
-	FILE* file = fopen(fileName.c_str(), "rb");
-	if (!file) {
-		CRITICAL_ERROR("Couldn't open " << fileName << " for reading!");
-	}
-	if (fread(dskImage.data(), 1, fsize, file) != fsize) {
-		CRITICAL_ERROR("Error while reading from " << fileName);
-	}
-
-	// Assuming normal disk image means reading boot sector
-	if (!msxPartOption) {
-		if (memcmp(dskImage.data(), "T98HDDIMAGE.R0", 14) == 0 ||
-		    memcmp(dskImage.data(), "\353\376\220MSX_IDE ", 11) == 0) {
-			CRITICAL_ERROR("Please specify a partition to use!");
-		}
-		readBootSector();
-	}
+	stopServing = 1;
 }
 
-void doSpecifiedExtraction(const std::string& fullName)
+/** Daemon mode: answer requests for (many) images over Unix socket
+ * 'socketName', images stay in memory between requests. Each request is a
+ * line of tab separated fields, see displayUsage(). Changes are written to
+ * disk on a 'flush' request, after 2 seconds without requests and when the
+ * daemon is stopped (SIGINT/SIGTERM).
+ */
+int serve(const std::string& socketName)
 {
-	std::string_view work = fullName;
-	StringOp::trimLeft(work, "/\\");
-
-	int msxDirSector = msxChrootSector;
-	int msxDirStartIndex = msxChrootStartIndex;
-
-	// now resolv directory if needed
-	auto [directory, file] = StringOp::splitOnLast(work, "/\\");
-	if (!directory.empty()) {
-		msxDirSector = findStartSectorOfDir(directory);
-		if (msxDirSector == 0) {
-			std::cout << "Couldn't find " << work << '\n';
-			return;
-		}
+	int listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (listenFd < 0 || socketName.size() >= sizeof(addr.sun_path)) {
+		CRITICAL_ERROR("Can't create socket " << socketName);
 	}
-
-	MSXDirEntry* msxDirEntry = findEntryInDir(
-		makeSimpleMSXFileName(file), msxDirSector, msxDirStartIndex);
-	if (!msxDirEntry) return;
-
-	if (doExtract && msxDirEntry->attrib != T_MSX_DIR) {
-		PRT_VERBOSE(fullName);
-		fileExtract(fullName, msxDirEntry);
+	memcpy(addr.sun_path, socketName.c_str(), socketName.size() + 1);
+	struct stat st;
+	if (stat(socketName.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+		unlink(socketName.c_str()); // left behind by an earlier run
 	}
-	if (msxDirEntry->attrib == T_MSX_DIR) {
-		recurseDirExtract(file,
-		                  clusterToSector(msxDirEntry->startCluster),
-		                  2); // read subdir and skip entries for '.' and '..'
+	if (bind(listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+	    listen(listenFd, 16) != 0) {
+		CRITICAL_ERROR("Can't listen on " << socketName << ": " << strerror(errno));
 	}
-}
-
-void doSpecifiedExtraction(std::span<const std::string> args)
-{
-	if (args.empty()) {
-		// extract all
-		recurseDirExtract("", msxChrootSector, msxChrootStartIndex);
-	} else {
-		// extract only specified files/directories
-		for (const auto& arg : args) {
-			doSpecifiedExtraction(arg);
+	signal(SIGPIPE, SIG_IGN);
+	struct sigaction sa = {};
+	sa.sa_handler = onStopSignal;
+	sigaction(SIGINT, &sa, nullptr);
+	sigaction(SIGTERM, &sa, nullptr);
+	listFormat = ListFormat::TSV;
+
+	std::vector<ServeClient> clients;
+	std::vector<pollfd> fds;
+	while (!stopServing) {
+		fds.assign(1, pollfd{listenFd, POLLIN, 0});
+		for (const auto& c : clients) {
+			fds.push_back({c.fd, short(c.out.empty() ? POLLIN : POLLOUT), 0});
+		}
+		bool dirty = std::ranges::any_of(servedImages, [](const auto& i) { return i.second.dirty; });
+		int n = poll(fds.data(), fds.size(), dirty ? 2000 : -1);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		if (n == 0) {
+			flushServedImages(); // idle
+			continue;
+		}
+		for (size_t i = clients.size(); i-- > 0;) {
+			auto& c = clients[i];
+			short revents = fds[i + 1].revents;
+			bool closed = false;
+			if (revents & POLLOUT) {
+				ssize_t w = send(c.fd, c.out.data(), c.out.size(), MSG_NOSIGNAL);
+				if (w > 0) c.out.erase(0, w);
+				closed = w < 0;
+			} else if (revents & (POLLIN | POLLHUP | POLLERR)) {
+				char buf[64 * 1024];
+				ssize_t r = recv(c.fd, buf, sizeof(buf), 0);
+				closed = r <= 0;
+				if (r > 0) c.in.append(buf, r);
+			}
+			// handle all complete requests
+			std::string_view in = c.in;
+			while (!closed) {
+				auto eol = in.find('\n');
+				if (eol == std::string_view::npos) break;
+				std::string_view rest = in.substr(eol + 1);
+				if (!handleServeRequest(in.substr(0, eol), rest, c.out)) break;
+				in = rest;
+			}
+			c.in.erase(0, c.in.size() - in.size());
+			if (closed) {
+				close(c.fd);
+				clients.erase(clients.begin() + i);
+			}
+		}
+		if (fds[0].revents & POLLIN) {
+			int fd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+			if (fd >= 0) clients.push_back({fd, {}, {}});
 		}
 	}
+	bool ok = flushServedImages();
+	for (const auto& c : clients) close(c.fd);
+	close(listenFd);
+	unlink(socketName.c_str());
+	return ok ? 0 : 1;
 }
 
 void displayUsage(std::string_view programName)
@@ -1301,7 +5651,7 @@ void displayUsage(std::string_view programName)
 	std::cout <<
 		"`msxtar' saves many files together into a single disk image to be used by\n"
 		"emulators like openMSX, and can restore individual files from the archive.\n"
-		"This tool supports single-sided, double-sized and IDE HD images (only FAT12)\n"
+		"This tool supports single-sided, double-sized and IDE HD images (FAT12 and FAT16)\n"
 		"\n"
 		"Usage: " << programName << " [OPTION]... [FILE]...\n"
 		"\n"
@@ -1309,6 +5659,7 @@ void displayUsage(std::string_view programName)
 		"  " << programName << " -cf disk.dsk foo bar  # Create a disk image from files/directories foo and bar.\n"
 		"  " << programName << " -tvf disk.dsk         # List all files in disk.dsk verbosely.\n"
 		"  " << programName << " -xf disk.dsk          # Extract all files from disk.dsk.\n"
+		"  tar c foo | " << programName << " -cf disk.dsk -  # Create a disk image from a tar stream.\n"
 		"\n"
 		"If a long option shows an argument as mandatory, then it is mandatory\n"
 		"for the equivalent short option also.  Similarly for optional arguments.\n"
@@ -1316,33 +5667,127 @@ void displayUsage(std::string_view programName)
 		"Main operation mode:\n"
   		"  -t, --list              list the contents of an archive\n"
 		"  -x, --extract, --get    extract files from an archive\n"
-		"  -c, --create            create a new archive\n"
+		"      --export            write files from an archive as tar stream to\n"
+		"                          stdout, e.g. '--export -f disk.dsk | tar t'\n"
+		"      --copy              copy files from an archive (or partition) to\n"
+		"                          the archive given by --to, or to another\n"
+		"                          partition (--to-partition) of the same archive\n"
+		"  -c, --create            create a new archive, a FILE named '-' reads\n"
+		"                          a tar stream from stdin (also for -r and -u)\n"
 		"  -r, --append            append files to the end of an archive\n"
 		"  -u, --update            only append files newer than copy in archive\n"
 		"  -A, --catenate          append tar files to an archive\n"
 		"      --concatenate       same as -A\n"
+		"      --verify            check the file system of the archive(s), the\n"
+		"                          archives can also be given as arguments\n"
+		"      --repair            same as --verify, but also fix the problems\n"
+		"      --index             create or update the catalog of the archive(s)\n"
+		"      --query=PATTERN     find files in the catalog(s) of the archive(s),\n"
+		"                          PATTERN is a name, a path (contains a '/') or\n"
+		"                          'hash:HEX', names and paths can use wildcards\n"
+		"      --serve=SOCKET      keep running and answer requests on Unix socket\n"
+		"                          SOCKET, images stay loaded between requests.\n"
+		"                          A request is one line of tab separated fields:\n"
+		"                            list|stat|read IMAGE PART PATH\n"
+		"                            write|update IMAGE PART PATH SIZE [MTIME]\n"
+		"                            flush|close [IMAGE]\n"
+		"                          PART is '-' for a plain image, write/update\n"
+		"                          are followed by SIZE bytes of file data. The\n"
+		"                          answer is 'ok SIZE' plus SIZE bytes of data\n"
+		"                          (tsv list lines or file contents), or 'error\n"
+		"                          MESSAGE'. Changes are written to disk on\n"
+		"                          flush, when idle for 2s and when stopped\n"
+		"      --grep=PATTERN      find the files in the archive(s) that contain\n"
+		"                          PATTERN ('hex:HEX' for bytes), the archives\n"
+		"                          can also be given as arguments, prints the\n"
+		"                          archive, path and offset of each match\n"
+		"      --diff              compare two archives (given as arguments)\n"
+		"                          sector by sector and list the added (A),\n"
+		"                          modified (M) and deleted (D) files\n"
+		"      --patch=FILE        with --diff: also write the changed sectors\n"
+		"                          to FILE\n"
+		"      --apply-patch=FILE  apply a patch made by --diff to the archive\n"
 		"\n"
 		"Handling of file attributes:\n"
 		"  -k, --keep                   keep existing files, do not overwrite\n"
 		"  -m, --modification-time      don't extract file modified time\n"
+		"      --io-engine=ENGINE       how host files are read/written: 'uring'\n"
+		"                               queues many files at once (Linux only),\n"
+		"                               'sync' one by one, 'auto' (default) uses\n"
+		"                               'uring' when available\n"
+		"      --name-map=FILE          host names that don't fit in 8.3 (or\n"
+		"                               collide and become NAME~N.EXT) are\n"
+		"                               written to FILE when adding files, and\n"
+		"                               read back on update and extraction\n"
+		"      --cache=DIR              keep created archives in DIR, creating\n"
+		"                               the same archive again (same files,\n"
+		"                               sizes, times and options) copies it from\n"
+		"                               there. With SOURCE_DATE_EPOCH set in the\n"
+		"                               environment all entries of a created\n"
+		"                               archive get that time and the file\n"
+		"                               contents are compared instead\n"
+		"      --manifest=FILE          also add the files listed in FILE (for\n"
+		"                               -c, -r and -u), one per line as tab\n"
+		"                               separated SOURCE and DEST fields, DEST\n"
+		"                               is the path in the archive. Optional\n"
+		"                               third and fourth field: attributes (any\n"
+		"                               of 'rhsa') and time (seconds since 1970)\n"
+		"      --base=IMAGE             with -c: start from a copy of IMAGE\n"
+		"                               instead of an empty archive, the files\n"
+		"                               are then added as with -u. The copy\n"
+		"                               shares unchanged data with IMAGE when\n"
+		"                               the file system supports that\n"
+		"      --exclude=PATTERN        skip the files and directories that\n"
+		"                               match PATTERN (wildcards allowed) when\n"
+		"                               reading host directories and when\n"
+		"                               extracting, listing or exporting. It\n"
+		"                               matches any tail of the path ('*.o',\n"
+		"                               'src/*.o'), a trailing '/' only matches\n"
+		"                               directories. Names given as arguments\n"
+		"                               are never skipped\n"
+		"      --include=PATTERN        only use the files that match PATTERN\n"
+		"                               (and no --exclude pattern)\n"
+		"      --exclude-from=FILE      read exclude patterns from FILE, one per\n"
+		"                               line\n"
 		"\n"
 		"Image selection and switching:\n"
 		"  -f, --file=ARCHIVE             use archive file or device ARCHIVE\n"
 		"                                 default name is 'diskimage.dsk'\n"
-		"  -S, --size=SIZE                SIZE can be nnnn[S|B|K|M]\n"
-		"                                 The following simple sizes are predefined\n"
-		"                                 'single' equals 360K, 'double' equals 720K\n"
-		"                                 and 'ide' equals 32M\n"
+		"  -S, --size=SIZE                SIZE can be nnnn[S|B|K|M] or the name of a\n"
+		"                                 geometry profile (see --list-profiles),\n"
+		"                                 e.g. 'single' equals 360K, 'double' equals\n"
+		"                                 720K and 'ide' equals 32M\n"
+		"                                 sizes above 32M create a FAT16 partition\n"
+		"                                 'auto' picks the smallest size that fits\n"
+		"      --plan                     show for each geometry profile how the\n"
+		"                                 files would fit (clusters, slack and free\n"
+		"                                 space), but don't create the archive\n"
+		"      --multi-volume             with -c: spread the files over as many\n"
+		"                                 archives of SIZE as needed, numbered like\n"
+		"                                 disk1.dsk, disk2.dsk, ... for -f disk.dsk\n"
+		"      --keep-dirs                with --multi-volume: keep each directory\n"
+		"                                 on one archive when it fits on one\n"
 		"  -1, --dos1                     use MSX-DOS1 boot sector and no subdirs\n"
   		"  -2, --dos2                     use MSX-DOS2 boot sector and use subdirs\n"
 		"  -M, --msxdir=SUBDIR            place new files in SUBDIR in the image\n"
 		"  -P, --partition=PART           Use partition PART when handling files\n"
-		"                                 PART can be 'all' to handle all partitions"
-		"\n"
+		"                                 PART can be 'all' to handle all partitions\n"
+		"      --catalog=CATALOG          use one catalog file for all archives, by\n"
+		"                                 default each archive has its own catalog\n"
+		"                                 file: ARCHIVE.msxcat\n"
+		"      --to=ARCHIVE               destination archive for --copy, default\n"
+		"                                 is the source archive, use --msxdir to\n"
+		"                                 copy into a subdir of the destination\n"
+		"      --to-partition=PART        destination partition for --copy\n"
 		"Informative output:\n"
 		"      --help            print this help, then exit\n"
 		"      --version         print tar program version number, then exit\n"
+		"      --list-profiles   print the disk geometries used for each image\n"
+		"                        size (usable as --size=NAME), then exit\n"
 		"  -v, --verbose         verbosely list files processed\n"
+		"      --format=FORMAT   list files as 'text' (default), 'ndjson', 'csv'\n"
+		"                        or 'tsv' with path, 8.3 name, attributes, size,\n"
+		"                        time, start cluster, cluster count and partition\n"
 		"\n"
 		"\n";
 }
@@ -1389,26 +5834,65 @@ ExpandResult expandFirstArgument(std::span<char*> args, const char* optionString
 	return result;
 }
 
+/** Add the exclude patterns in 'fileName' (one per line, empty lines and
+ * lines starting with '#' are ignored) to 'filter'
+ */
+void readExcludeFile(const std::string& fileName, PathFilter& filter)
+{
+	std::ifstream file(fileName);
+	if (!file) {
+		CRITICAL_ERROR("Couldn't open exclude file " << fileName);
+	}
+	std::string line;
+	while (std::getline(file, line)) {
+		StringOp::trimRight(line, "\r");
+		if (line.empty() || line[0] == '#') continue;
+		filter.exclude(line);
+	}
+}
+
 struct ParseResult {
 	enum class Command {
-		NONE, CREATE, LIST, EXTRACT, UPDATE, APPEND,
+		NONE, CREATE, LIST, EXTRACT, UPDATE, APPEND, VERIFY, INDEX, QUERY, EXPORT,
+		COPY, SERVE, DIFF, APPLY_PATCH, GREP,
 	};
+	enum class IoEngine { AUTO, URING, SYNC };
 
 	std::string_view programName;
 	std::vector<std::string> args;
 
 	std::string file = "diskimage.dsk";
 	std::string msxHostDir;
+	std::string catalog;
+	std::string copyTo;
+	std::string nameMap;
+	std::string serveSocket;
+	std::string cacheDir;
+	std::string manifest;
+	std::string base;
+	std::string patch;
+	std::string grep;
+	std::optional<std::string> query;
+	PathFilter filter;
 	Command command = Command::NONE;
 	int nbSectors = 1440; // initially assume a DD disk is used
 	std::optional<int> partition;
+	std::optional<int> toPartition;
+	ListFormat format = ListFormat::TEXT;
+	IoEngine ioEngine = IoEngine::AUTO;
 	bool extract = false;
 	bool dos2 = true;
 	bool keep = false;
+	bool repair = false;
 	bool touch = false;
 	bool debug = false;
 	bool help = false;
 	bool version = false;
+	bool listProfiles = false;
+	bool autoSize = false;
+	bool plan = false;
+	bool multiVolume = false;
+	bool keepDirs = false;
 	bool verbose = false;
 };
 ParseResult parseCommandLine(std::span<char*> origArgv)
@@ -1418,29 +5902,83 @@ ParseResult parseCommandLine(std::span<char*> origArgv)
 		"jz"; // undocumented
 
 	static constexpr int DEBUG_OPTION = CHAR_MAX + 1;
+	static constexpr int VERIFY_OPTION = CHAR_MAX + 2;
+	static constexpr int REPAIR_OPTION = CHAR_MAX + 3;
+	static constexpr int FORMAT_OPTION = CHAR_MAX + 4;
+	static constexpr int INDEX_OPTION = CHAR_MAX + 5;
+	static constexpr int QUERY_OPTION = CHAR_MAX + 6;
+	static constexpr int CATALOG_OPTION = CHAR_MAX + 7;
+	static constexpr int EXPORT_OPTION = CHAR_MAX + 8;
+	static constexpr int COPY_OPTION = CHAR_MAX + 9;
+	static constexpr int TO_OPTION = CHAR_MAX + 10;
+	static constexpr int TO_PARTITION_OPTION = CHAR_MAX + 11;
+	static constexpr int IO_ENGINE_OPTION = CHAR_MAX + 12;
+	static constexpr int NAME_MAP_OPTION = CHAR_MAX + 13;
+	static constexpr int SERVE_OPTION = CHAR_MAX + 14;
+	static constexpr int CACHE_OPTION = CHAR_MAX + 15;
+	static constexpr int MANIFEST_OPTION = CHAR_MAX + 16;
+	static constexpr int BASE_OPTION = CHAR_MAX + 17;
+	static constexpr int DIFF_OPTION = CHAR_MAX + 18;
+	static constexpr int PATCH_OPTION = CHAR_MAX + 19;
+	static constexpr int APPLY_PATCH_OPTION = CHAR_MAX + 20;
+	static constexpr int GREP_OPTION = CHAR_MAX + 21;
+	static constexpr int EXCLUDE_OPTION = CHAR_MAX + 22;
+	static constexpr int INCLUDE_OPTION = CHAR_MAX + 23;
+	static constexpr int EXCLUDE_FROM_OPTION = CHAR_MAX + 24;
 	int version = 0;
 	int help = 0;
+	int listProfiles = 0;
+	int plan = 0;
+	int multiVolume = 0;
+	int keepDirs = 0;
 	struct option longOptions[] = {
 		// documented options (keep these in the same order as in the help text)
 		{"list",              no_argument,       nullptr, 't'},
 		{"extract",           no_argument,       nullptr, 'x'},
 		{"get",               no_argument,       nullptr, 'x'},
+		{"export",            no_argument,       nullptr, EXPORT_OPTION},
+		{"copy",              no_argument,       nullptr, COPY_OPTION},
 		{"create",            no_argument,       nullptr, 'c'},
 		{"append",            no_argument,       nullptr, 'r'},
 		{"update",            no_argument,       nullptr, 'u'},
 		{"catenate",          no_argument,       nullptr, 'A'},
 		{"concatenate",       no_argument,       nullptr, 'A'},
+		{"verify",            no_argument,       nullptr, VERIFY_OPTION},
+		{"repair",            no_argument,       nullptr, REPAIR_OPTION},
+		{"index",             no_argument,       nullptr, INDEX_OPTION},
+		{"query",             required_argument, nullptr, QUERY_OPTION},
+		{"serve",             required_argument, nullptr, SERVE_OPTION},
+		{"grep",              required_argument, nullptr, GREP_OPTION},
+		{"diff",              no_argument,       nullptr, DIFF_OPTION},
+		{"patch",             required_argument, nullptr, PATCH_OPTION},
+		{"apply-patch",       required_argument, nullptr, APPLY_PATCH_OPTION},
 		{"keep",              no_argument,       nullptr, 'k'},
 		{"modification-time", no_argument,       nullptr, 'm'},
+		{"io-engine",         required_argument, nullptr, IO_ENGINE_OPTION},
+		{"name-map",          required_argument, nullptr, NAME_MAP_OPTION},
+		{"cache",             required_argument, nullptr, CACHE_OPTION},
+		{"manifest",          required_argument, nullptr, MANIFEST_OPTION},
+		{"base",              required_argument, nullptr, BASE_OPTION},
+		{"exclude",           required_argument, nullptr, EXCLUDE_OPTION},
+		{"include",           required_argument, nullptr, INCLUDE_OPTION},
+		{"exclude-from",      required_argument, nullptr, EXCLUDE_FROM_OPTION},
 		{"file",              required_argument, nullptr, 'f'},
 		{"size",              required_argument, nullptr, 'S'},
+		{"plan",              no_argument,       &plan,    1 },
+		{"multi-volume",      no_argument,       &multiVolume, 1 },
+		{"keep-dirs",         no_argument,       &keepDirs, 1 },
 		{"dos1",              no_argument,       nullptr, '1'},
 		{"dos2",              no_argument,       nullptr, '2'},
 		{"msxdir",            required_argument, nullptr, 'M'},
 		{"partition",         required_argument, nullptr, 'P'},
+		{"catalog",           required_argument, nullptr, CATALOG_OPTION},
+		{"to",                required_argument, nullptr, TO_OPTION},
+		{"to-partition",      required_argument, nullptr, TO_PARTITION_OPTION},
 		{"help",              no_argument,       &help,    1 },
 		{"version",           no_argument,       &version, 1 },
+		{"list-profiles",     no_argument,       &listProfiles, 1 },
 		{"verbose",           no_argument,       nullptr, 'v'},
+		{"format",            required_argument, nullptr, FORMAT_OPTION},
 
 		// undocumented option (developer-only)
 		{"debug",             no_argument,       nullptr, DEBUG_OPTION},
@@ -1469,6 +6007,121 @@ ParseResult parseCommandLine(std::span<char*> origArgv)
 			result.debug = true;
 			break;
 
+		case VERIFY_OPTION:
+			result.command = ParseResult::Command::VERIFY;
+			break;
+
+		case REPAIR_OPTION:
+			result.command = ParseResult::Command::VERIFY;
+			result.repair = true;
+			break;
+
+		case EXPORT_OPTION:
+			result.command = ParseResult::Command::EXPORT;
+			break;
+
+		case COPY_OPTION:
+			result.command = ParseResult::Command::COPY;
+			break;
+
+		case TO_OPTION:
+			result.copyTo = optX;
+			break;
+
+		case TO_PARTITION_OPTION:
+			result.toPartition = strtol(optX, &optX, 10);
+			break;
+
+		case INDEX_OPTION:
+			result.command = ParseResult::Command::INDEX;
+			break;
+
+		case QUERY_OPTION:
+			result.command = ParseResult::Command::QUERY;
+			result.query = optX;
+			break;
+
+		case CATALOG_OPTION:
+			result.catalog = optX;
+			break;
+
+		case NAME_MAP_OPTION:
+			result.nameMap = optX;
+			break;
+
+		case CACHE_OPTION:
+			result.cacheDir = optX;
+			break;
+
+		case MANIFEST_OPTION:
+			result.manifest = optX;
+			break;
+
+		case BASE_OPTION:
+			result.base = optX;
+			break;
+
+		case EXCLUDE_OPTION:
+			result.filter.exclude(optX);
+			break;
+
+		case INCLUDE_OPTION:
+			result.filter.include(optX);
+			break;
+
+		case EXCLUDE_FROM_OPTION:
+			readExcludeFile(optX, result.filter);
+			break;
+
+		case SERVE_OPTION:
+			result.command = ParseResult::Command::SERVE;
+			result.serveSocket = optX;
+			break;
+
+		case GREP_OPTION:
+			result.command = ParseResult::Command::GREP;
+			result.grep = optX;
+			break;
+
+		case DIFF_OPTION:
+			result.command = ParseResult::Command::DIFF;
+			break;
+
+		case PATCH_OPTION:
+			result.patch = optX;
+			break;
+
+		case APPLY_PATCH_OPTION:
+			result.command = ParseResult::Command::APPLY_PATCH;
+			result.patch = optX;
+			break;
+
+		case IO_ENGINE_OPTION:
+			if (strcasecmp(optX, "auto") == 0) {
+				result.ioEngine = ParseResult::IoEngine::AUTO;
+			} else if (strcasecmp(optX, "uring") == 0) {
+				result.ioEngine = ParseResult::IoEngine::URING;
+			} else if (strcasecmp(optX, "sync") == 0) {
+				result.ioEngine = ParseResult::IoEngine::SYNC;
+			} else {
+				CRITICAL_ERROR("Unknown I/O engine: " << optX);
+			}
+			break;
+
+		case FORMAT_OPTION:
+			if (strcasecmp(optX, "text") == 0) {
+				result.format = ListFormat::TEXT;
+			} else if (strcasecmp(optX, "ndjson") == 0) {
+				result.format = ListFormat::NDJSON;
+			} else if (strcasecmp(optX, "csv") == 0) {
+				result.format = ListFormat::CSV;
+			} else if (strcasecmp(optX, "tsv") == 0) {
+				result.format = ListFormat::TSV;
+			} else {
+				CRITICAL_ERROR("Unknown list format: " << optX);
+			}
+			break;
+
 		case '?':
 			result.help = true;
 			break;
@@ -1535,21 +6188,16 @@ ParseResult parseCommandLine(std::span<char*> origArgv)
 			break;
 
 		case 'S':
-			std::string imageSize = optX;
-			if (strncasecmp(imageSize.c_str(), "single", 6) == 0) {
-				result.nbSectors = 720;
-			} else if (strncasecmp(imageSize.c_str(), "double",
-			                       6) == 0) {
-				result.nbSectors = 1440;
-			} else if (strncasecmp(imageSize.c_str(), "ide", 3) ==
-			           0) {
-				result.nbSectors = 65401;
+			if (strcasecmp(optX, "auto") == 0) {
+				result.autoSize = true;
+			} else if (const auto* profile = findGeometry(optX)) {
+				result.nbSectors = profile->nbSectors;
 			} else {
 				// first find possible 'b','k' or 'm' end character
-				int size = 0;
-				int scale = SECTOR_SIZE;
+				long long size = 0;
+				long long scale = SECTOR_SIZE;
 				char* p = optX;
-				size = strtol(optX, &p, 10);
+				size = strtoll(optX, &p, 10);
 				while (*p != 0) ++p;
 				--p;
 				switch (*p) {
@@ -1577,6 +6225,10 @@ ParseResult parseCommandLine(std::span<char*> origArgv)
 	}
 	result.help |= help;
 	result.version |= version;
+	result.listProfiles |= listProfiles;
+	result.plan |= plan;
+	result.multiVolume |= multiVolume;
+	result.keepDirs |= keepDirs;
 
 	result.args.assign(argv.begin() + optind, argv.end());
 
@@ -1600,6 +6252,10 @@ int main(int argc, char** argv)
 		displayUsage(parsed.programName);
 		exit(0);
 	}
+	if (parsed.listProfiles) {
+		listGeometries();
+		exit(0);
+	}
 	if (parsed.version) {
 		std::cout <<
 			"msxtar 0.9\n"
@@ -1615,47 +6271,177 @@ int main(int argc, char** argv)
 		exit(0);
 	}
 
+	// only for new images, updates keep using the host times
+	const char* epoch = getenv("SOURCE_DATE_EPOCH");
+	if (epoch && *epoch && parsed.command == ParseResult::Command::CREATE) {
+		char* end;
+		errno = 0;
+		long long t = strtoll(epoch, &end, 10);
+		time_t tt = time_t(t);
+		struct tm* tm = (*end || errno) ? nullptr : localtime(&tt);
+		if (!tm || tm->tm_year + 1900 < 1980 || tm->tm_year + 1900 > 2107) {
+			CRITICAL_ERROR("SOURCE_DATE_EPOCH=" << epoch << " is not a time between 1980 and 2107");
+		}
+		fixedTime = tt;
+	}
+
 	// TODO refactor this
 	doSubdirs = parsed.dos2;
 	msxPartOption = parsed.partition.has_value();
 	touchOption = parsed.touch;
 	doExtract = parsed.extract;
 	verboseOption = parsed.verbose;
+	listFormat = parsed.format;
+	pathFilter = parsed.filter;
+
+	bool hostIo = parsed.command == ParseResult::Command::CREATE ||
+	              parsed.command == ParseResult::Command::UPDATE ||
+	              parsed.command == ParseResult::Command::APPEND ||
+	              parsed.command == ParseResult::Command::EXTRACT;
+	if (hostIo && parsed.ioEngine != ParseResult::IoEngine::SYNC) {
+		hostRing.emplace(128);
+		if (!hostRing->valid()) {
+			if (parsed.ioEngine == ParseResult::IoEngine::URING) {
+				std::cerr << "io_uring is not available, using blocking I/O\n";
+			}
+			hostRing.reset();
+		}
+	}
 
+	if ((parsed.autoSize || parsed.plan) && parsed.command != ParseResult::Command::CREATE) {
+		CRITICAL_ERROR("--size=auto and --plan can only be used with -c");
+	}
 
 	switch (parsed.command) {
 	case ParseResult::Command::NONE:
 		CRITICAL_ERROR(
-			"You must specify one of -Actrux\n"
+			"You must specify one of -Actrux, --verify, --index, --query, --grep or --diff\n"
 			"Try " << parsed.programName << " --help for more information.");
 
-	case ParseResult::Command::CREATE:
+	case ParseResult::Command::CREATE: {
+		std::vector<ManifestEntry> manifest;
+		if (!parsed.manifest.empty()) manifest = readManifest(parsed.manifest);
+		if (!parsed.base.empty()) {
+			if (parsed.autoSize || parsed.plan || parsed.multiVolume) {
+				CRITICAL_ERROR("--base can't be combined with --size=auto, --plan or --multi-volume");
+			}
+			trackImageChanges = true;
+			readDSK(parsed.base);
+			if (parsed.partition) {
+				if (*parsed.partition == -1) {
+					CRITICAL_ERROR("Specific partition only!");
+				}
+				chPart(*parsed.partition);
+			}
+			chroot(parsed.msxHostDir);
+			for (const auto& arg : parsed.args) {
+				if (arg == "-") {
+					addTarStream(stdin, parsed.keep);
+				} else {
+					updateInDSK(arg, parsed.keep);
+				}
+			}
+			addManifest(manifest, parsed.keep);
+			flushHostIo();
+			writeImageFromBase(parsed.base, parsed.file);
+			if (!parsed.nameMap.empty()) writeNameMap(parsed.nameMap);
+			break;
+		}
+		if (parsed.multiVolume) {
+			SpaceNeeds needs = gatherSpaceNeeds(parsed.args, manifest, parsed.msxHostDir);
+			if (!needs.complete) {
+				CRITICAL_ERROR("Can't split a tar stream over several archives");
+			}
+			if (parsed.autoSize) {
+				CRITICAL_ERROR("--multi-volume needs a fixed --size");
+			}
+			FsLayout layout = layoutForSize(parsed.nbSectors);
+			if (layout.nbSectorsPerCluster == 0) {
+				CRITICAL_ERROR("Image too large, FAT16 supports at most "
+				               << (64 * MAX_FAT16_CLUSTERS) << " sectors");
+			}
+			auto volumes = packVolumes(needs, layout, parsed.keepDirs);
+			if (parsed.plan) {
+				for (size_t v = 0; v < volumes.size(); ++v) {
+					std::cout << volumeName(parsed.file, v + 1) << ": "
+					          << volumes[v].files.size() << " files, "
+					          << volumes[v].clusters << '/' << layout.nbClusters() << " clusters\n";
+				}
+				break;
+			}
+			if (!writeVolumes(needs, volumes, parsed.nbSectors, parsed.dos2, parsed.file, parsed.nameMap)) {
+				return 1;
+			}
+			break;
+		}
+		if (parsed.autoSize || parsed.plan) {
+			SpaceNeeds needs = gatherSpaceNeeds(parsed.args, manifest, parsed.msxHostDir);
+			if (!needs.complete) {
+				CRITICAL_ERROR("Can't plan the size for a tar stream, use --size");
+			}
+			std::optional<int> given;
+			if (!parsed.autoSize) given = parsed.nbSectors;
+			parsed.nbSectors = planImageSize(needs, given, parsed.plan || verboseOption);
+			if (parsed.plan) break;
+		}
+		std::string cached;
+		if (!parsed.cacheDir.empty()) {
+			std::string key = imageCacheKey(parsed.args, manifest, parsed.nbSectors, parsed.dos2,
+			                                parsed.msxHostDir, !parsed.nameMap.empty());
+			if (!key.empty()) cached = parsed.cacheDir + '/' + key;
+		}
+		if (!cached.empty() && cloneFile(cached + ".dsk", parsed.file) &&
+		    (parsed.nameMap.empty() || cloneFile(cached + ".map", parsed.nameMap))) {
+			PRT_VERBOSE("Using cached image " << cached << ".dsk");
+			break;
+		}
 		createEmptyDSK(parsed.nbSectors, parsed.dos2);
 		chroot(parsed.msxHostDir);
 		for (const auto& arg : parsed.args) {
-			addCreateDSK(arg);
+			if (arg == "-") {
+				addTarStream(stdin, true);
+			} else {
+				addCreateDSK(arg);
+			}
+		}
+		addManifest(manifest, true);
+		flushHostIo();
+		if (!writeImageToDisk(parsed.file)) return 1;
+		if (!parsed.nameMap.empty()) writeNameMap(parsed.nameMap);
+		if (!cached.empty()) {
+			// the map first, an image without its map is never used
+			mkdir_ex(parsed.cacheDir.c_str());
+			if (parsed.nameMap.empty() || cloneFile(parsed.nameMap, cached + ".map")) {
+				cloneFile(parsed.file, cached + ".dsk");
+			}
 		}
-		writeImageToDisk(parsed.file);
 		break;
+	}
 
 	case ParseResult::Command::LIST:
 	case ParseResult::Command::EXTRACT:
 		readDSK(parsed.file);
+		if (!parsed.nameMap.empty()) readNameMap(parsed.nameMap);
+		if (verboseOption) printListHeader();
 		if (parsed.partition) {
 			if (*parsed.partition == -1) {
 				for (int partition = 0; partition < 31; ++partition) {
-					PRT_VERBOSE("Handling partition " << partition);
+					if (listFormat == ListFormat::TEXT) {
+						PRT_VERBOSE("Handling partition " << partition);
+					}
 					if (chPart(partition)) {
 						char p[40];
 						sprintf(p, "./" "PARTITION%02i", partition);
 						std::string dirname = p;
-						mkdir_ex(dirname.c_str());
-						recurseDirExtract(
-							dirname, msxChrootSector, msxChrootStartIndex);
+						if (doExtract) mkdir_ex(dirname.c_str());
+						currentPartition = partition;
+						listPathSkip = dirname.size() + 1;
+						recurseDirExtract(dirname, msxChrootSector);
 					}
 				}
 			} else {
 				if (chPart(*parsed.partition)) {
+					currentPartition = *parsed.partition;
 					chroot(parsed.msxHostDir);
 					doSpecifiedExtraction(parsed.args);
 				}
@@ -1664,12 +6450,42 @@ int main(int argc, char** argv)
 			chroot(parsed.msxHostDir);
 			doSpecifiedExtraction(parsed.args);
 		}
+		if (!finishExtraction()) {
+			listOutput.flush();
+			return 1;
+		}
+		listOutput.flush();
+		break;
+
+	case ParseResult::Command::EXPORT: {
+		readDSK(parsed.file);
+		OutputBuffer out(stdout);
+		if (parsed.partition) {
+			if (*parsed.partition == -1) {
+				for (int partition = 0; partition < 31; ++partition) {
+					if (chPart(partition)) {
+						char p[40];
+						sprintf(p, "PARTITION%02i", partition);
+						exportTar(out, parsed.args, p);
+					}
+				}
+			} else if (chPart(*parsed.partition)) {
+				chroot(parsed.msxHostDir);
+				exportTar(out, parsed.args, "");
+			}
+		} else {
+			chroot(parsed.msxHostDir);
+			exportTar(out, parsed.args, "");
+		}
+		endTar(out);
 		break;
+	}
 
 	case ParseResult::Command::APPEND:
 		parsed.keep = true; // TODO make 'parsed' const
 		[[fallthrough]];
 	case ParseResult::Command::UPDATE:
+		trackImageChanges = true;
 		readDSK(parsed.file);
 		if (parsed.partition) {
 			if (*parsed.partition == -1) {
@@ -1678,10 +6494,76 @@ int main(int argc, char** argv)
 			chPart(*parsed.partition);
 		}
 		chroot(parsed.msxHostDir);
+		if (!parsed.nameMap.empty()) readNameMap(parsed.nameMap);
 		for (const auto& arg : parsed.args) {
-			updateInDSK(arg, parsed.keep);
+			if (arg == "-") {
+				addTarStream(stdin, parsed.keep);
+			} else {
+				updateInDSK(arg, parsed.keep);
+			}
+		}
+		if (!parsed.manifest.empty()) addManifest(readManifest(parsed.manifest), parsed.keep);
+		flushHostIo();
+		if (!writeImageToDisk(parsed.file)) return 1;
+		if (!parsed.nameMap.empty()) writeNameMap(parsed.nameMap);
+		break;
+
+	case ParseResult::Command::COPY: {
+		trackImageChanges = true;
+		readDSK(parsed.file);
+		if (parsed.partition) {
+			if (*parsed.partition == -1) {
+				CRITICAL_ERROR("Specific partition only!");
+			}
+			if (!chPart(*parsed.partition)) {
+				CRITICAL_ERROR("Couldn't use partition " << *parsed.partition);
+			}
 		}
-		writeImageToDisk(parsed.file);
+		auto items = collectCopyItems(parsed.args);
+
+		std::string dest = parsed.copyTo.empty() ? parsed.file : parsed.copyTo;
+		if (dest != parsed.file) {
+			msxPartOption = parsed.toPartition.has_value();
+			readDSK(dest);
+		}
+		if (parsed.toPartition && !chPart(*parsed.toPartition)) {
+			CRITICAL_ERROR("Couldn't use partition " << *parsed.toPartition);
+		}
+		msxChrootSector = rootDirStart;
+		msxChrootStartIndex = 0;
+		chroot(parsed.msxHostDir);
+		copyItems(items, parsed.keep);
+		if (!writeImageToDisk(dest)) return 1;
+		break;
+	}
+
+	case ParseResult::Command::SERVE:
+		return serve(parsed.serveSocket);
+
+	case ParseResult::Command::GREP:
+		if (parsed.args.empty()) {
+			return grepImages(std::span{&parsed.file, 1}, parsed.grep);
+		}
+		return grepImages(parsed.args, parsed.grep);
+
+	case ParseResult::Command::DIFF:
+		return diffImages(parsed.args, parsed.patch);
+
+	case ParseResult::Command::APPLY_PATCH:
+		if (!applyPatch(parsed.patch, parsed.file)) return 1;
 		break;
+
+	case ParseResult::Command::INDEX:
+	case ParseResult::Command::QUERY:
+		if (parsed.args.empty() && parsed.catalog.empty()) {
+			parsed.args.push_back(parsed.file);
+		}
+		return doCatalog(parsed.catalog, parsed.args, parsed.query);
+
+	case ParseResult::Command::VERIFY:
+		if (parsed.args.empty()) {
+			return verifyImages(std::span{&parsed.file, 1}, parsed.repair);
+		}
+		return verifyImages(parsed.args, parsed.repair);
 	}
 }
@@ -0,0 +1,52 @@
+#!/bin/sh
+# Check the partitions of an IDE (IDEFDISK) image that lie beyond 2GB and
+# 4GB. The image is a sparse file, it takes only a few MB on disk.
+#
+# usage: tests/sparse-hd.sh [path/to/msxtar]
+
+set -e
+msxtar=$(realpath "${1:-./msxtar}")
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+cd "$tmp"
+
+# write 32-bit value $2 (little endian) at byte offset $1 of hd.img
+putLE32() {
+	printf "$(printf '\\%03o\\%03o\\%03o\\%03o' \
+		$(($2 & 255)) $(($2 >> 8 & 255)) $(($2 >> 16 & 255)) $(($2 >> 24 & 255)))" |
+		dd of=hd.img bs=1 seek="$1" conv=notrunc status=none
+}
+
+# partition $1 starts at sector $2 and gets the file system of image $3
+addPartition() {
+	entry=$((14 + (30 - $1) * 16))
+	putLE32 $((entry + 8)) "$2"
+	putLE32 $((entry + 12)) $(($(stat -c %s "$3") / 512))
+	dd if="$3" of=hd.img bs=512 seek="$2" conv=notrunc status=none
+}
+
+mkdir -p src/sub
+head -c 100000 /dev/urandom > src/big.bin
+head -c 3000 /dev/urandom > src/sub/small.bin
+echo hello > src/sub/hello.txt
+(cd src && "$msxtar" -cf ../part.dsk --size=ide-4m big.bin sub)
+
+truncate -s 5G hd.img
+printf '\353\376\220MSX_IDE ' | dd of=hd.img conv=notrunc status=none
+addPartition 0 $((5 * 1024 * 1024)) part.dsk  # at 2.5GB
+addPartition 1 $((9 * 1024 * 1024)) part.dsk  # at 4.5GB
+
+status=0
+for p in 0 1; do
+	"$msxtar" -tf hd.img --partition=$p > list$p
+	if ! grep -q '^big.bin ' list$p || ! grep -q '^sub ' list$p; then
+		echo "partition $p: listing is wrong"; cat list$p; status=1
+	fi
+	mkdir out$p
+	(cd out$p && "$msxtar" -xf ../hd.img --partition=$p)
+	if ! diff -r src out$p; then
+		echo "partition $p: extracted files differ"; status=1
+	fi
+done
+[ $status = 0 ] && echo "sparse-hd: OK"
+exit $status